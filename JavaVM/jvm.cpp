@@ -1,7 +1,10 @@
 #include "jvm.h"
 #include "jvmClass.h"
 #include "jvmExec.h"
+#include "jvmObject.h"
+#include <fstream>
 #include <iostream>
+#include <algorithm>
 #include <cassert>
 
 using namespace std;
@@ -10,6 +13,7 @@ using namespace jvm;
 VM::VM()
 {
 	m_stackFrame.reserve(4096);
+	m_handleTable.push_back(nullptr); // null reference
 }
 
 VM::~VM()
@@ -17,34 +21,100 @@ VM::~VM()
 }
 
 void VM::Load(const char* path)
+{
+	DefineClass(path);
+}
+
+JClass* VM::DefineClass(const char* path)
 {
 	{
 		CFClassFile cf;
 		bool r = loadClass(cf, path, *this);
 		if (!r)
-			return;
+			return nullptr;
+		if (FindClass(cf.constant_pool[cf.constant_pool[cf.this_class].val.f1.v].val.f5.idx))
+		{
+			cout << "Error: class is already loaded : " << path << endl;
+			return nullptr; // throw LinkageError
+		}
+		if (m_verifyBytecode && !detail::VerifyClass(*this, cf))
+			return nullptr;
 		m_classFilePool.emplace_back(move(cf));
 	}
 
+	m_classPool.push_back({ m_classFilePool.back() });
+	JClass& jc = m_classPool.back();
+	jc.name = jc.cf.constant_pool[jc.cf.constant_pool[jc.cf.this_class].val.f1.v].val.f5.idx;
+	jc.stringConstants.resize(jc.cf.constant_pool_count);
+	jc.resolvedMethods.resize(jc.cf.constant_pool_count);
+	jc.resolvedClasses.resize(jc.cf.constant_pool_count);
+	jc.resolvedFields.resize(jc.cf.constant_pool_count);
+	jc.resolvedStaticFields.resize(jc.cf.constant_pool_count);
+
+	// Superclasses and interfaces are linked first, so their layout is already fixed
+	m_loadingClasses.push_back(jc.name);
+	if (jc.cf.super_class != 0)
+	{
+		u32 superName = jc.cf.constant_pool[jc.cf.constant_pool[jc.cf.super_class].val.f1.v].val.f5.idx;
+		if (m_stringPool[superName] != L"java/lang/Object")
+		{
+			jc.super = LoadClass(superName);
+			if (!jc.super)
+				cout << "Error: superclass is not loaded" << endl;
+		}
+	}
+	jc.isInterface = (jc.cf.access_flags & 0x0200) != 0; // ACC_INTERFACE
+	for (u16 i : jc.cf.interfaces)
+	{
+		JClass* iface = LoadClass(jc.cf.constant_pool[jc.cf.constant_pool[i].val.f1.v].val.f5.idx);
+		if (iface)
+			jc.interfaces.push_back(iface);
+		else
+			cout << "Error: interface is not loaded" << endl;
+	}
+	m_loadingClasses.pop_back();
+	detail::LayoutInstanceFields(*this, jc);
+	detail::LinkMethods(*this, jc);
+	if (jc.super)
+		jc.super->subtypes.push_back(&jc);
+	for (JClass* iface : jc.interfaces)
+		iface->subtypes.push_back(&jc);
+	detail::InvalidateDevirtualizedSites(jc, m_devirtualizedSites);
+	BindCompiledMethods(jc);
+	ReadCodeCache(jc);
+
 	// staticȃtB[h̍\z
-	JClass jc = { m_classFilePool.back() };
 	jc.staticFields.reserve(jc.cf.fields_count);
 	for (int i = 0; i < jc.cf.fields_count; i++)
 	{
 		auto& field = jc.cf.fields[i];
-		auto& fldNameRef = jc.cf.constant_pool[field.name_index].val.f5.idx;
-		auto& fldName = m_stringPool[fldNameRef];
-		auto& typeNameRef = jc.cf.constant_pool[field.descriptor_index].val.f5.idx;
-		auto& typeName = m_stringPool[typeNameRef];
+		if (~field.access_flags & 0x0008) // ACC_STATIC
+			continue;
+		u32 fldName = jc.cf.constant_pool[field.name_index].val.f5.idx;
+		u32 typeName = jc.cf.constant_pool[field.descriptor_index].val.f5.idx;
 
-		JType jt = DecodeType(*this, typeName);
+		JType jt = DecodeType(*this, m_stringPool[typeName]);
 		JValue val = {};
 
-		JMember mem = { fldName, jt, val };
+		// Constant fields get their value before <clinit> runs, javac emits no code for them.
+		// String constants are not supported yet and stay null.
+		for (auto& attr : field.attributes)
+		{
+			if (attr.type != CFAttribute::Type::ConstantValue || jt.aryDim > 0)
+				continue;
+			auto& cv = jc.cf.constant_pool[attr.val.constantValue.constantvalue_index];
+			if (cv.type == CFConstantPool::Type::Integer || cv.type == CFConstantPool::Type::Float)
+				memcpy(&val.val, &cv.val.f3.v, 4);
+			else if (cv.type == CFConstantPool::Type::Long || cv.type == CFConstantPool::Type::Double)
+				memcpy(&val.val, &cv.val.f4.v, 8);
+		}
+
+		JMember mem = { fldName, typeName, jt, val };
 		jc.staticFields.emplace_back(move(mem));
 	}
 
-	// Static initializer
+	// Static initializer, run by InitializeClass. Classes without one anywhere in the superclass
+	// chain have nothing to run and are initialized at once.
 	for (auto& method : jc.cf.methods)
 	{
 		auto& metNameRef = jc.cf.constant_pool[method.name_index].val.f5.idx;
@@ -53,29 +123,146 @@ void VM::Load(const char* path)
 		auto& sigName = m_stringPool[sigNameRef];
 		if (metName == L"<clinit>" && sigName == L"()V")
 		{
-			Invoke(jc, method, true);
-			m_stackFrame.clear(); // HACK: string[]pushĂ܂Ă
+			jc.clinit = &method;
 			break;
 		}
 	}
+	if (!jc.clinit && (!jc.super || jc.super->state == ClassState::Initialized))
+		jc.state = ClassState::Initialized;
+	return &jc;
+}
+
+namespace
+{
+	// Class file path of a binary class name
+	string GetClassFilePath(const string& dir, const wstring& name)
+	{
+		string path = dir + "/";
+		for (wchar_t c : name)
+		{
+			// UTF-8
+			if (c < 0x80)
+				path += static_cast<char>(c);
+			else if (c < 0x800)
+			{
+				path += static_cast<char>(0xc0 | (c >> 6));
+				path += static_cast<char>(0x80 | (c & 0x3f));
+			}
+			else
+			{
+				path += static_cast<char>(0xe0 | ((c >> 12) & 0x0f));
+				path += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+				path += static_cast<char>(0x80 | (c & 0x3f));
+			}
+		}
+		return path + ".class";
+	}
+}
 
-	m_classPool.emplace_back(move(jc));
+JClass* VM::LoadClass(u32 name)
+{
+	JClass* jc = FindClass(name);
+	if (jc || m_missingClasses.count(name))
+		return jc;
+	if (find(m_loadingClasses.begin(), m_loadingClasses.end(), name) != m_loadingClasses.end())
+	{
+		cout << "Error: class circularity" << endl;
+		return nullptr; // throw ClassCircularityError
+	}
+
+	for (auto& dir : m_classPath)
+	{
+		string path = GetClassFilePath(dir, m_stringPool[name]);
+		if (!ifstream(path, ios::binary))
+			continue;
+		jc = DefineClass(path.c_str());
+		if (jc && jc->name != name)
+		{
+			cout << "Error: class file defines another class : " << path << endl;
+			return nullptr; // throw NoClassDefFoundError
+		}
+		return jc;
+	}
+	m_missingClasses.insert(name);
+	return nullptr;
+}
+
+void VM::InitializeClass(JClass& jclass)
+{
+	// The initializer itself may use the class while it runs
+	if (jclass.state != ClassState::Linked)
+		return;
+	jclass.state = ClassState::Initializing;
+	if (jclass.super && !jclass.isInterface)
+		InitializeClass(*jclass.super);
+	if (jclass.clinit)
+	{
+		// Above the frames of a running method
+		u32 ret[2] = {};
+		ExecuteCall(jclass, *jclass.clinit, 0, static_cast<u32>(m_stackFrame.size()), ret);
+	}
+	jclass.state = ClassState::Initialized;
 }
 
 JObject& VM::NewPrimitiveArray(PrimitiveType type, s32 numElem)
 {
-	size_t sz = 0;
+	size_t sz = GetPrimitiveSize(type) * static_cast<size_t>(numElem);
+	assert(sz > 0 || numElem == 0);
+
+	return NewObject(ObjectKind::Array, type, numElem, sz);
+}
+
+JObject& VM::NewReferenceArray(const JClass* elementClass, s32 numElem)
+{
+	return NewObject(ObjectKind::Array, PrimitiveType::Class, numElem, 4 * static_cast<size_t>(numElem), elementClass);
+}
+
+JObject& VM::NewPinnedArray(PrimitiveType type, void* data, s32 numElem)
+{
+	JObject& obj = NewObject(ObjectKind::Array, type, numElem, 0);
+	obj.data = ObjectData(static_cast<u8*>(data), ObjectDataDeleter{ false });
+	return obj;
+}
 
-	switch (type)
+void VM::UnpinArray(JObject& ary)
+{
+	if (ary.data.get_deleter().owned)
+		return;
+	ary.data.reset();
+	ary.length = 0;
+}
+
+JObject* detail::HostType<JObject*>::Load(VM& vm, const u32* p)
+{
+	return p[0] ? &vm.GetObject(p[0]) : nullptr;
+}
+
+JObject& VM::NewInstance(const JClass& jclass)
+{
+	return NewObject(ObjectKind::Instance, PrimitiveType::Class, static_cast<s32>(jclass.instanceSize), jclass.instanceSize, &jclass);
+}
+
+JClass* VM::FindClass(u32 name)
+{
+	for (auto& jc : m_classPool)
 	{
-	case PrimitiveType::Int:
-		sz = 4 * numElem;
-		break;
-	default:
-		assert(0); // 
+		if (jc.name == name)
+			return &jc;
 	}
+	return nullptr;
+}
 
-	m_instanceTable.emplace_back(JObject{0, type, numElem, make_unique<u8[]>(sz)});
+JObject& VM::NewObject(ObjectKind kind, PrimitiveType type, s32 length, size_t size, const JClass* clazz)
+{
+	u32 handle = static_cast<u32>(m_handleTable.size());
+	m_instanceTable.emplace_back(JObject{0, ObjectData(new u8[size]()), clazz, length, handle, 0, type, kind});
+	m_handleTable.push_back(&m_instanceTable.back());
+	if (m_allocSampleInterval && --m_allocCountdown == 0)
+	{
+		m_allocSamples.push_back({ m_allocSite, kind, type, clazz, size });
+		m_allocCountdown = m_allocSampleInterval;
+	}
+	m_allocSite = {};
 	return m_instanceTable.back();
 }
 
@@ -91,36 +278,109 @@ u32 VM::InternString(std::wstring&& str)
 }
 
 void VM::Invoke(const wstring& clazz, const wstring& method, const wstring& signature)
+{
+	JClass* jc = nullptr;
+	const CFMethod* met = FindMethod(clazz, method, signature, jc);
+	if (met)
+	{
+		InitializeClass(*jc);
+		Invoke(*jc, *met, false);
+	}
+	else
+		cout << "Method not found" << endl;
+}
+
+const CFMethod* VM::FindMethod(const wstring& clazz, const wstring& method, const wstring& signature, JClass*& owner)
 {
 	for (auto& jc : m_classPool)
 	{
+		if (m_stringPool[jc.name] != clazz)
+			continue;
 		CFClassFile& cls = jc.cf;
-		auto& thisClass = cls.constant_pool[cls.this_class];
-		auto& classNameRef = cls.constant_pool[thisClass.val.f1.v].val.f5.idx;
-		auto& className = m_stringPool[classNameRef];
-		if (className == clazz)
+		for (auto& met : cls.methods)
 		{
-			for (auto& met : cls.methods)
+			auto& metName = m_stringPool[cls.constant_pool[met.name_index].val.f5.idx];
+			auto& sigName = m_stringPool[cls.constant_pool[met.descriptor_index].val.f5.idx];
+			if (metName == method && sigName == signature)
 			{
-				auto& metNameRef = cls.constant_pool[met.name_index].val.f5.idx;
-				auto& metName = m_stringPool[metNameRef];
-				auto& sigNameRef = cls.constant_pool[met.descriptor_index].val.f5.idx;
-				auto& sigName = m_stringPool[sigNameRef];
-				if (metName == method && sigName == signature)
-				{
-					Invoke(jc, met, false);
-					return;
-				}
+				owner = &jc;
+				return &met;
 			}
 		}
 	}
-	cout << "Method not found" << endl;
+	return nullptr;
 }
 
-void VM::Invoke(JClass& jclass, const CFMethod& method, bool allowNonPublic) noexcept
+const CFMethod* VM::PrepareMethod(const wstring& clazz, const wstring& method, const wstring& signature,
+	const detail::HostKind* args, size_t numArgs, detail::HostKind ret, JClass*& owner, u32& argSlots)
+{
+	const CFMethod* met = FindMethod(clazz, method, signature, owner);
+	if (!met)
+	{
+		cout << "Method not found" << endl;
+		return nullptr;
+	}
+	if ((~met->access_flags & 0x0001) || (~met->access_flags & 0x0008) || !met->code) // ACC_PUBLIC, ACC_STATIC
+	{
+		cout << "Error: prepared method must be public, static and not native" << endl;
+		return nullptr;
+	}
+
+	const auto Kind = [](const JType& t)
+	{
+		if (t.aryDim > 0 || t.type == PrimitiveType::Class)
+			return detail::HostKind::Reference;
+		switch (t.type)
+		{
+		case PrimitiveType::Void: return detail::HostKind::Void;
+		case PrimitiveType::Long: return detail::HostKind::Long;
+		case PrimitiveType::Float: return detail::HostKind::Float;
+		case PrimitiveType::Double: return detail::HostKind::Double;
+		default: return detail::HostKind::Int;
+		}
+	};
+	const JSignature& sig = met->signature;
+	bool matches = (sig.args.size() == numArgs) && (Kind(sig.ret) == ret);
+	for (size_t i = 0; matches && i < numArgs; i++)
+		matches = (Kind(sig.args[i]) == args[i]);
+	if (!matches)
+	{
+		cout << "Error: host types do not match the method signature" << endl;
+		return nullptr;
+	}
+
+	argSlots = GetArgSlotSize(sig);
+	return met;
+}
+
+void VM::ExecuteCall(JClass& jclass, const CFMethod& method, u32 argSlots, u32 base, u32* ret)
 {
-	const CFClassFile& classFile = jclass.cf;
+	if (jclass.state != ClassState::Initialized)
+		InitializeClass(jclass);
+	if (method.compiled)
+	{
+		method.compiled(*this, m_stackFrame.data() + base, ret);
+		m_stackFrame.resize(base);
+		return;
+	}
+
+	detail::VMResource res = { *this, m_stringPool, m_stackFrame, m_frames };
+	auto vmcont = detail::VMContext{
+		jclass,
+		method,
+		argSlots,
+		base + argSlots
+	};
+	execute(vmcont, res);
 
+	// The result is left in the first argument slots
+	for (u32 i = 0; i < 2 && base + i < m_stackFrame.size(); i++)
+		ret[i] = m_stackFrame[base + i];
+	m_stackFrame.resize(base);
+}
+
+void VM::Invoke(JClass& jclass, const CFMethod& method, bool allowNonPublic) noexcept
+{
 	if ((!allowNonPublic) && (~method.access_flags & 0x0001)) // ACC_PUBLIC
 	{
 		cout << "Invoke method must be public" << endl;
@@ -137,30 +397,18 @@ void VM::Invoke(JClass& jclass, const CFMethod& method, bool allowNonPublic) noe
 		return;
 	}
 
-	bool methodFound = false;
-	for (auto& attr : method.attributes)
+	if (!method.compiled && !method.code)
 	{
-		auto& nameRef = classFile.constant_pool[attr.attribute_name_index].val.f5.idx;
-		auto& name = m_stringPool[nameRef];
-		if (name == L"Code")
-		{
-			detail::VMContext cont = { jclass, method };
-			detail::VMResource res = { *this, m_stringPool, m_stackFrame };
-			m_stackFrame.resize(1);
-			auto vmcont = detail::VMContext{
-				cont.jclass,
-				cont.method,
-				1, // string[] args
-				m_stackFrame.size()
-			};
-			//TODO: push args value
-			execute(vmcont, res);
-			methodFound = true;
-		}
+		cout << "Cannot invoke method because method name not found" << endl;
+		return;
 	}
 
-	if (!methodFound)
-		cout << "Cannot invoke method because method name not found" << endl;
+	// Arguments are zero, main gets a null String[]
+	const u32 argSlots = GetArgSlotSize(method.signature);
+	const u32 base = static_cast<u32>(m_stackFrame.size());
+	m_stackFrame.resize(base + argSlots);
+	u32 ret[2] = {};
+	ExecuteCall(jclass, method, argSlots, base, ret);
 }
 
 namespace
@@ -217,8 +465,9 @@ JType jvm::DecodeType(VM& vm, const std::wstring& str)
 	return t;
 }
 
-JSignature jvm::DecodeSignature(VM& vm, const std::wstring& str)
+JSignature jvm::DecodeSignature(VM& vm, const std::wstring& descriptor)
 {
+	const wstring str(descriptor); // may be an element of the string pool, which grows while interning class names
 	JSignature sig;
 	JType t;
 	int p = 0;
@@ -1,11 +1,20 @@
 #pragma once
 
+#include <cassert>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <cmath>
 #include <string>
 #include <vector>
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <iosfwd>
 
 namespace jvm
 {
@@ -22,18 +31,31 @@ namespace jvm
 	using c8 = char;
 	using c16 = wchar_t;
 
+#if defined(_MSC_VER)
 	inline void revbits(u16& v) { v = _byteswap_ushort(v); }
 	inline void revbits(u32& v) { v = _byteswap_ulong(v); }
 	inline void revbits(u64& v) { v = _byteswap_uint64(v); }
+#else
+	inline void revbits(u16& v) { v = __builtin_bswap16(v); }
+	inline void revbits(u32& v) { v = __builtin_bswap32(v); }
+	inline void revbits(u64& v) { v = __builtin_bswap64(v); }
+#endif
 
 	class VM;
+	struct AotMethod;
 	struct JClass;
 
 	struct CFClassFile;
 	struct CFMethod;
+	struct CFCode;
 
 	namespace detail
 	{
+		struct CallSite;
+		struct MappedFile;
+		struct NativeImage;
+		struct CodeCacheEntry;
+
 		struct VMContext
 		{
 			JClass& jclass;
@@ -42,15 +64,43 @@ namespace jvm
 			u32 baseStackIndex;
 		};
 
+		struct DecodedCode;
+
+		// Activation record of the interpreter, the locals and operand stack live in the VM stack
+		struct Frame
+		{
+			JClass* jclass;
+			const CFMethod* method;
+			DecodedCode* decoded; // null until the frame is entered
+			u32 localIdx; // first local, the arguments come first
+			u32 codeIdx; // instruction to resume at, saved when the frame calls or reaches a safepoint
+		};
+
 		struct VMResource
 		{
 			VM& vm;
 			std::vector<std::wstring>& stringPool;
 			std::vector<u32>& stackFrame;
+			std::vector<Frame>& frames;
+		};
+
+		// Native replacement of a pure JDK method.
+		// args points to the first argument slot, the result is written to ret
+		// (two slots for long and double).
+		using IntrinsicFunc = void (*)(VM& vm, const u32* args, u32* ret);
+
+		// Result of resolving a Methodref constant, cached on first call
+		struct ResolvedMethod
+		{
+			IntrinsicFunc intrinsic = nullptr;
+			const CFMethod* method = nullptr;
+			JClass* owner = nullptr; // class declaring method
+			u16 argSlots = 0;
+			u16 retSlots = 0;
 		};
 	}
 
-	enum class PrimitiveType
+	enum class PrimitiveType : u8
 	{
 		Boolean,
 		Char,
@@ -64,12 +114,41 @@ namespace jvm
 		Void
 	};
 
+	enum class ObjectKind : u8
+	{
+		Array,
+		String, // java.lang.String
+		Instance,
+	};
+
+	// Deleter of JObject::data. Pinned arrays view host memory, which is not freed.
+	struct ObjectDataDeleter
+	{
+		bool owned = true;
+		void operator()(u8* p) const
+		{
+			if (owned)
+				delete[] p;
+		}
+	};
+	using ObjectData = std::unique_ptr<u8[], ObjectDataDeleter>;
+
+	// Arrays: type is the element type and length the element count. Reference arrays have
+	// type Class, hold handles and clazz is the element class, null if not loaded by the VM.
+	// Strings: the payload is Latin-1 (type Byte) when every char fits in one byte,
+	// UTF-16 (type Char) otherwise, and length is the number of chars.
+	// Instances: type is Class, clazz the class of the object and the payload holds the
+	// fields at the offsets of JClass::instanceFields, length is the payload size.
 	struct JObject
 	{
 		u64 marker;
-		PrimitiveType type;
+		ObjectData data;
+		const JClass* clazz;
 		s32 length;
-		std::unique_ptr<u8[]> data;
+		u32 handle; // reference value stored in stack slots, 0 is null
+		s32 hash; // cached String.hashCode(), 0 if not computed yet
+		PrimitiveType type;
+		ObjectKind kind;
 	};
 
 	struct JValue
@@ -101,17 +180,251 @@ namespace jvm
 		std::vector<JType> args;
 	};
 
+	// Element size of a primitive array
+	inline size_t GetPrimitiveSize(PrimitiveType type)
+	{
+		switch (type)
+		{
+		case PrimitiveType::Boolean:
+		case PrimitiveType::Byte:
+			return 1;
+		case PrimitiveType::Char:
+		case PrimitiveType::Short:
+			return 2;
+		case PrimitiveType::Int:
+		case PrimitiveType::Float:
+			return 4;
+		case PrimitiveType::Long:
+		case PrimitiveType::Double:
+			return 8;
+		default:
+			return 0;
+		}
+	}
+
+	// Bytes of the payload of an object: array elements, string chars or instance fields
+	inline size_t GetPayloadSize(const JObject& obj)
+	{
+		switch (obj.kind)
+		{
+		case ObjectKind::Array:
+			return ((obj.type == PrimitiveType::Class) ? 4 : GetPrimitiveSize(obj.type)) * static_cast<size_t>(obj.length);
+		case ObjectKind::String:
+			return ((obj.type == PrimitiveType::Byte) ? 1 : 2) * static_cast<size_t>(obj.length);
+		default:
+			return static_cast<size_t>(obj.length); // instance payload
+		}
+	}
+
+	// Number of 32bit stack slots occupied by a value (long and double take two)
+	inline u32 GetSlotSize(const JType& t)
+	{
+		if (t.aryDim > 0)
+			return 1;
+		switch (t.type)
+		{
+		case PrimitiveType::Void:
+			return 0;
+		case PrimitiveType::Long:
+		case PrimitiveType::Double:
+			return 2;
+		default:
+			return 1;
+		}
+	}
+
+	inline u32 GetArgSlotSize(const JSignature& sig)
+	{
+		u32 n = 0;
+		for (auto& a : sig.args)
+			n += GetSlotSize(a);
+		return n;
+	}
+
+	// Static field
 	struct JMember
 	{
-		const std::wstring& name;
+		u32 name; // string pool index
+		u32 descriptor;
 		JType type;
 		JValue obj;
 	};
 
+	// Non-static field. The offset is fixed when the class is linked.
+	struct JField
+	{
+		u32 name; // string pool index
+		u32 descriptor;
+		u32 offset;
+		u8 size;
+		PrimitiveType type; // Class for references
+		const JClass* owner; // declaring class
+	};
+
+	// Virtual method slot
+	struct JVirtualMethod
+	{
+		u32 name; // string pool index
+		u32 descriptor;
+		detail::ResolvedMethod target; // argSlots includes the receiver
+	};
+
+	// Maps the methods of an interface to vtable slots of an implementing class
+	struct JITable
+	{
+		const JClass* iface;
+		std::vector<u32> slots; // vtable index of each entry of iface->vtable
+	};
+
+	// Loaded classes are linked at once and initialized on first active use
+	enum class ClassState : u8
+	{
+		Linked,
+		Initializing, // <clinit> of the class or a superclass is running
+		Initialized,
+	};
+
 	struct JClass
 	{
 		CFClassFile& cf;
+		u32 name = 0; // string pool index of the binary class name
+		bool isInterface = false;
+		JClass* super = nullptr; // null for classes deriving java.lang.Object
+		std::vector<JClass*> interfaces; // direct superinterfaces
+		std::vector<JClass*> subtypes; // loaded classes and interfaces naming this one as super or superinterface
+		u32 instanceSize = 0; // including superclass fields
+		std::vector<JField> instanceFields; // declared by this class
+		std::vector<JVirtualMethod> vtable; // superclass slots first
+		std::vector<JITable> itables; // every interface implemented directly or indirectly
+		std::unordered_map<const JClass*, u32> itableIndex; // interface -> index of itables
 		std::vector<JMember> staticFields;
+		const CFMethod* clinit = nullptr; // static initializer, null if none
+		ClassState state = ClassState::Linked;
+		std::vector<u32> stringConstants; // resolved ldc String handles, indexed by constant pool index
+		std::vector<detail::ResolvedMethod> resolvedMethods; // indexed by constant pool index
+		std::vector<JClass*> resolvedClasses;
+		std::vector<const JField*> resolvedFields;
+		// Cached by the first access, which then initializes the declaring class, so later accesses
+		// skip the initialization check. An access made while that class is initializing, by its
+		// <clinit> or code it calls on this thread, sees the fields before the initializer finished.
+		std::vector<JMember*> resolvedStaticFields;
+		std::shared_ptr<detail::CodeCacheEntry> codeCache; // decoded methods read from the code cache
+	};
+
+	namespace detail
+	{
+		// Argument and result types of prepared calls
+		enum class HostKind : u8
+		{
+			Void,
+			Int, // boolean, byte, char, short and int
+			Long,
+			Float,
+			Double,
+			Reference,
+		};
+
+		template<class T> struct HostType;
+
+		template<> struct HostType<void>
+		{
+			static const HostKind Kind = HostKind::Void;
+			static void Load(VM&, const u32*) {}
+		};
+
+		template<> struct HostType<s32>
+		{
+			static const HostKind Kind = HostKind::Int;
+			static const u32 Slots = 1;
+			static void Store(u32* p, s32 v) { p[0] = static_cast<u32>(v); }
+			static s32 Load(VM&, const u32* p) { return static_cast<s32>(p[0]); }
+		};
+
+		template<> struct HostType<s64>
+		{
+			static const HostKind Kind = HostKind::Long;
+			static const u32 Slots = 2;
+			static void Store(u32* p, s64 v) { memcpy(p, &v, 8); }
+			static s64 Load(VM&, const u32* p) { s64 v; memcpy(&v, p, 8); return v; }
+		};
+
+		template<> struct HostType<float>
+		{
+			static const HostKind Kind = HostKind::Float;
+			static const u32 Slots = 1;
+			static void Store(u32* p, float v) { memcpy(p, &v, 4); }
+			static float Load(VM&, const u32* p) { float v; memcpy(&v, p, 4); return v; }
+		};
+
+		template<> struct HostType<double>
+		{
+			static const HostKind Kind = HostKind::Double;
+			static const u32 Slots = 2;
+			static void Store(u32* p, double v) { memcpy(p, &v, 8); }
+			static double Load(VM&, const u32* p) { double v; memcpy(&v, p, 8); return v; }
+		};
+
+		template<> struct HostType<JObject*>
+		{
+			static const HostKind Kind = HostKind::Reference;
+			static const u32 Slots = 1;
+			static void Store(u32* p, JObject* v) { p[0] = v ? v->handle : 0; }
+			static JObject* Load(VM& vm, const u32* p);
+		};
+	}
+
+	// Public static method resolved once by VM::Prepare and called with typed arguments.
+	//   auto add = vm.Prepare<s32(s32, s32)>(L"Main", L"add", L"(II)I");
+	//   s32 sum = vm.Call(add, 1, 2);
+	template<class F> class PreparedCall;
+
+	template<class R, class... Args>
+	class PreparedCall<R(Args...)>
+	{
+	public:
+		bool IsValid() const { return m_method != nullptr; }
+
+	private:
+		friend class VM;
+		void Resolve(VM& vm, const std::wstring& clazz, const std::wstring& method, const std::wstring& signature);
+
+		JClass* m_class = nullptr;
+		const CFMethod* m_method = nullptr;
+		u32 m_argSlots = 0;
+	};
+
+	// Where an object was allocated, method is null for allocations by the host
+	struct AllocationSite
+	{
+		const JClass* owner;
+		const CFMethod* method;
+		u32 pc;
+	};
+
+	// Allocation recorded by sampling
+	struct AllocationSample
+	{
+		AllocationSite site;
+		ObjectKind kind;
+		PrimitiveType type; // element type of arrays
+		const JClass* clazz; // class of instances
+		size_t size; // payload bytes
+	};
+
+	// Live objects of one kind, element type and class
+	struct HeapHistogramEntry
+	{
+		ObjectKind kind;
+		PrimitiveType type;
+		const JClass* clazz;
+		size_t count;
+		size_t bytes;
+	};
+
+	enum class ReportFormat : u8
+	{
+		Text,
+		Csv,
 	};
 
 	class VM
@@ -122,38 +435,198 @@ namespace jvm
 		void Load(const char* path);
 		void Invoke(const std::wstring& clazz, const std::wstring& method, const std::wstring& signature);
 		JObject& NewPrimitiveArray(PrimitiveType type, s32 numElem);
+		// Array of references, elementClass is null for classes the VM does not load
+		JObject& NewReferenceArray(const JClass* elementClass, s32 numElem);
+
+		// Primitive array viewing host memory without copying. The memory is not freed by the VM
+		// and must stay valid until UnpinArray, which leaves an empty array behind.
+		JObject& NewPinnedArray(PrimitiveType type, void* data, s32 numElem);
+		void UnpinArray(JObject& ary);
+
+		// Resolves the method and checks the signature against F, invalid if they differ
+		template<class F>
+		PreparedCall<F> Prepare(const std::wstring& clazz, const std::wstring& method, const std::wstring& signature);
+		template<class R, class... Args>
+		R Call(const PreparedCall<R(Args...)>& call, Args... args);
+		JObject& NewInstance(const JClass& jclass);
+		JClass* FindClass(u32 name);
+
+		// Directories searched for classes that are not loaded, as <dir>/<binary name>.class.
+		// Classes are loaded from there when first referenced, superclasses first.
+		void AddClassPath(const std::string& dir) { m_classPath.push_back(dir); }
+		// Finds the class or loads it from the class path, null if not found
+		JClass* LoadClass(u32 name);
+		// Runs the static initializers of the class and its superclasses, unless done or running already
+		void InitializeClass(JClass& jclass);
+		void RegisterDevirtualizedSite(detail::CallSite& site) { m_devirtualizedSites.push_back(&site); }
 		u32 InternString(std::wstring&& str);
 		const std::wstring& GetInternedString(u32 handle)
 		{
 			return m_stringPool[handle];
 		}
+		JObject& GetObject(u32 handle)
+		{
+			return *m_handleTable[handle];
+		}
+
+		// java.lang.String
+		JObject& NewString(const u16* chars, s32 len);
+		JObject& GetStringConstant(u32 stringPoolIdx);
+		JObject& InternJavaString(JObject& str);
+		// New strings equal to an interned string share its payload, they are still distinct objects
+		void SetStringDeduplication(bool enable) { m_dedupStrings = enable; }
+
+		// Largest bytecode size of static methods inlined into their callers, 0 disables inlining
+		void SetInlineBudget(u32 bytes) { m_inlineBudget = bytes; }
+		u32 GetInlineBudget() const { return m_inlineBudget; }
+
+		// Constant folding, propagation and dead code removal of verified methods when they are decoded
+		void SetOptimizeBytecode(bool optimize) { m_optimizeBytecode = optimize; }
+		bool GetOptimizeBytecode() const { return m_optimizeBytecode; }
+
+		// Verification of loaded classes. Without it, methods run in the checked interpreter.
+		void SetVerifyBytecode(bool verify) { m_verifyBytecode = verify; }
+		bool GetVerifyBytecode() const { return m_verifyBytecode; }
+
+		// Records the site of every Nth allocation, 0 disables sampling. Clears earlier samples.
+		void SetAllocationSampling(u32 interval);
+		const std::vector<AllocationSample>& GetAllocationSamples() const { return m_allocSamples; }
+		// Called by the interpreter before allocating, consumed by the next allocation
+		void SetAllocationSite(const JClass* owner, const CFMethod* method, u32 pc) { m_allocSite = { owner, method, pc }; }
+
+		// Heap profile, see jvmProfile.cpp
+		std::vector<HeapHistogramEntry> GetHeapHistogram() const; // largest first
+		void PrintHeapHistogram(std::ostream& os, ReportFormat format) const;
+		void PrintAllocationSites(std::ostream& os, ReportFormat format) const;
+
+		// Ahead-of-time compilation, see jvmAot.cpp.
+		// Writes the C++ source of a native image of the loaded classes, returns the number of compiled methods.
+		u32 WriteNativeImageSource(std::ostream& os);
+		// Binds the methods of a native image built from the source. Calls resolved before are not rebound.
+		bool LoadNativeImage(const char* path);
+
+		// Cache of decoded methods, see jvmCodeCache.cpp. SaveCodeCache writes the methods decoded so far
+		// to the directory, classes loaded later with the same class file reuse them.
+		void SetCodeCacheDirectory(const std::string& dir) { m_codeCacheDir = dir; }
+		bool SaveCodeCache();
+
+		// Limit of the VM stack in slots, deep Java recursion stops there instead of the native stack
+		void SetMaxStackSize(u32 slots) { m_maxStackSize = slots; }
+		u32 GetMaxStackSize() const { return m_maxStackSize; }
+		// Limit of the interpreter frames, methods without locals and operand stack do not grow the VM stack
+		void SetMaxFrameDepth(u32 frames) { m_maxFrameDepth = frames; }
+		u32 GetMaxFrameDepth() const { return m_maxFrameDepth; }
+		// Interpreter frames, callers first. Frames entered by the host are included.
+		const std::vector<detail::Frame>& GetFrames() const { return m_frames; }
+
+		// Safepoints, see jvmSafepoint.cpp. Operations may be requested from any thread and run on the
+		// thread executing Java code at its next backedge or method entry, with the frames walkable.
+		void RequestSafepoint(std::function<void(VM&)> operation);
+		// Runs the pending operations, called by the interpreter when the poll word is set
+		void Safepoint();
+		const std::atomic<bool>& GetSafepointPoll() const { return m_safepointPoll; }
+
+		// Heap snapshot of the objects, static fields and interned strings. Restore it into a VM that
+		// loaded the same classes in the same order and has not allocated anything yet, classes not
+		// loaded yet are taken from the class path. Restored classes keep their initialization state.
+		bool SaveHeapSnapshot(const char* path);
+		bool RestoreHeapSnapshot(const char* path);
 
 		VM(const VM&) = delete;
 		VM& operator=(const VM&) = delete;
 
 	private:
+		template<class F> friend class PreparedCall;
+
 		std::vector<std::wstring> m_stringPool;
-		std::vector<JClass> m_classPool;
-		std::vector<CFClassFile> m_classFilePool;
+		std::list<JClass> m_classPool;
+		std::list<CFClassFile> m_classFilePool; // JClass refers to the elements
 		std::vector<u32> m_stackFrame;
+		std::vector<detail::Frame> m_frames;
+		u32 m_maxStackSize = 1u << 22;
+		u32 m_maxFrameDepth = 1u << 16;
 		std::list<JObject> m_instanceTable;
+		std::vector<JObject*> m_handleTable;
+		std::unordered_multimap<s32, u32> m_stringTable; // hashCode -> interned String handle
+		bool m_dedupStrings = false;
+		u32 m_inlineBudget = 35;
+		bool m_optimizeBytecode = true;
+		bool m_verifyBytecode = true;
+		std::shared_ptr<detail::MappedFile> m_snapshot; // backs the payloads of restored objects
+		AllocationSite m_allocSite = {};
+		u32 m_allocSampleInterval = 0;
+		u32 m_allocCountdown = 0;
+		std::vector<AllocationSample> m_allocSamples;
+		std::unordered_map<std::wstring, const AotMethod*> m_compiledMethods; // "class.name(descriptor)"
+		std::vector<std::shared_ptr<detail::NativeImage>> m_nativeImages;
+		std::string m_codeCacheDir; // empty if the code cache is disabled
+		std::vector<std::string> m_classPath;
+		std::unordered_set<u32> m_missingClasses; // not found in the class path
+		std::vector<u32> m_loadingClasses; // being loaded, to detect circular superclasses
+		std::atomic<bool> m_safepointPoll{ false }; // set while operations are pending
+		std::mutex m_safepointMutex;
+		std::vector<std::function<void(VM&)>> m_safepointOperations;
+		std::vector<detail::CallSite*> m_devirtualizedSites; // call sites bound by class hierarchy analysis
+
+		JObject& NewObject(ObjectKind kind, PrimitiveType type, s32 length, size_t size, const JClass* clazz = nullptr);
+		JObject* FindInternedString(const JObject& str);
+		JObject* FindInternedString(const u16* chars, s32 len);
 
+		JClass* DefineClass(const char* path);
 		void Invoke(JClass& jclass, const CFMethod& method, bool allowNonPublic) noexcept;
+		const CFMethod* FindMethod(const std::wstring& clazz, const std::wstring& method, const std::wstring& signature, JClass*& owner);
+		const CFMethod* PrepareMethod(const std::wstring& clazz, const std::wstring& method, const std::wstring& signature,
+			const detail::HostKind* args, size_t numArgs, detail::HostKind ret, JClass*& owner, u32& argSlots);
+		void BindCompiledMethods(JClass& jc);
+		void ReadCodeCache(JClass& jc);
+		void ExecuteCall(JClass& jclass, const CFMethod& method, u32 argSlots, u32 base, u32* ret);
 	};
 
-	inline intptr_t StackObjectToValue(const JObject& o)
+	template<class R, class... Args>
+	void PreparedCall<R(Args...)>::Resolve(VM& vm, const std::wstring& clazz, const std::wstring& method, const std::wstring& signature)
+	{
+		const detail::HostKind args[] = { detail::HostKind::Void, detail::HostType<Args>::Kind... }; // never empty
+		m_method = vm.PrepareMethod(clazz, method, signature, args + 1, sizeof...(Args), detail::HostType<R>::Kind, m_class, m_argSlots);
+	}
+
+	template<class F>
+	PreparedCall<F> VM::Prepare(const std::wstring& clazz, const std::wstring& method, const std::wstring& signature)
+	{
+		PreparedCall<F> call;
+		call.Resolve(*this, clazz, method, signature);
+		return call;
+	}
+
+	template<class R, class... Args>
+	R VM::Call(const PreparedCall<R(Args...)>& call, Args... args)
+	{
+		u32 ret[2] = {};
+		if (!call.IsValid())
+		{
+			assert(0); // Prepare failed, the result is zero or null
+			return detail::HostType<R>::Load(*this, ret);
+		}
+
+		u32 slots[sizeof...(Args) * 2 + 1];
+		u32* p = slots;
+		const int expand[] = { 0, (detail::HostType<Args>::Store(p, args), p += detail::HostType<Args>::Slots, 0)... };
+		(void)expand;
+
+		const u32 base = static_cast<u32>(m_stackFrame.size());
+		m_stackFrame.insert(m_stackFrame.end(), slots, p);
+		ExecuteCall(*call.m_class, *call.m_method, call.m_argSlots, base, ret);
+		return detail::HostType<R>::Load(*this, ret);
+	}
+
+	// Stack slots are 32bit, so references are stored as handles instead of pointers
+	inline u32 StackObjectToValue(const JObject& o)
 	{
-		const JObject* j = &o;
-		intptr_t v;
-		memcpy(&v, &j, sizeof v);
-		return v;
+		return o.handle;
 	}
 
-	inline JObject& StackValueToObject(intptr_t v)
+	inline JObject& StackValueToObject(VM& vm, u32 v)
 	{
-		JObject* o;
-		memcpy(&o, &v, sizeof o);
-		return *o;
+		return vm.GetObject(v);
 	}
 
 	JType DecodeType(VM& vm, const std::wstring& str);
@@ -0,0 +1,486 @@
+#include "jvmAot.h"
+#include "jvmClass.h"
+#include "jvmObject.h"
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <set>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+// Ahead-of-time compilation.
+//
+// The translator writes verified static methods as C++ functions with the signature of an
+// intrinsic, one C++ local per JVM local and operand stack slot. Only int and reference
+// values are handled, so every value takes one slot. Compiled code cannot throw, so methods
+// using arrays or dividing by a non-constant are left to the interpreter, as are methods using
+// anything else (long, float, double, fields, allocation, exception handlers, calls to methods
+// that are not compiled). Branch targets become labels and calls between compiled methods
+// are direct calls. Backward branches poll for safepoints, LoadNativeImage gives the image
+// the poll flag of the VM and the function running them. The flag is a global of the image,
+// so an image is used by one VM at a time.
+// The generated file is compiled into a shared object exporting AotEntryName. LoadNativeImage
+// binds the functions to methods whose bytecode hash matches, and resolution of invokestatic
+// calls them like intrinsics.
+
+namespace jvm
+{
+	namespace detail
+	{
+		// Handle of a loaded native image
+		struct NativeImage
+		{
+#if defined(_WIN32)
+			HMODULE module = nullptr;
+#else
+			void* module = nullptr;
+#endif
+			const std::atomic<bool>** poll = nullptr; // released for other VMs when unloaded
+
+			~NativeImage()
+			{
+				if (poll)
+					*poll = nullptr;
+				if (!module)
+					return;
+#if defined(_WIN32)
+				FreeLibrary(module);
+#else
+				dlclose(module);
+#endif
+			}
+		};
+	}
+}
+
+namespace
+{
+	struct AotCandidate
+	{
+		JClass* jclass;
+		CFMethod* method;
+		unique_ptr<DecodedCode> code;
+		vector<s32> depth;
+		vector<const CFMethod*> callees;
+		u32 index;
+	};
+
+	string Narrow(const wstring& str)
+	{
+		string s;
+		for (wchar_t c : str)
+			s += static_cast<char>(c);
+		return s;
+	}
+
+	bool IsAscii(const wstring& str)
+	{
+		for (wchar_t c : str)
+		{
+			if (c < 0x20 || c >= 0x7f || c == L'"' || c == L'\\')
+				return false;
+		}
+		return true;
+	}
+
+	// int, boolean, byte, char, short and references only
+	bool IsSupportedDescriptor(const wstring& desc)
+	{
+		for (size_t i = 0; i < desc.size(); i++)
+		{
+			if (desc[i] == L'L')
+			{
+				i = desc.find(L';', i); // J, F and D may appear in class names
+				if (i == wstring::npos)
+					return false;
+			}
+			else if (desc[i] == L'J' || desc[i] == L'F' || desc[i] == L'D')
+				return false;
+		}
+		return true;
+	}
+
+	bool IsSupportedOp(u16 op)
+	{
+		if (op <= 0x11) // nop, aconst_null, iconst_<i>, bipush, sipush
+			return op != 0x09 && op != 0x0a && !(0x0b <= op && op <= 0x0f);
+		switch (op)
+		{
+		case 0x12: case 0x13: // ldc, ldc_w
+		case 0x15: case 0x19: // iload, aload
+		case 0x1a: case 0x1b: case 0x1c: case 0x1d: case 0x2a: case 0x2b: case 0x2c: case 0x2d:
+		case 0x36: case 0x3a: // istore, astore
+		case 0x3b: case 0x3c: case 0x3d: case 0x3e: case 0x4b: case 0x4c: case 0x4d: case 0x4e:
+		case 0x57: case 0x58: case 0x59: case 0x5a: case 0x5c: case 0x5f: // pop, pop2, dup, dup_x1, dup2, swap
+		case 0x60: case 0x64: case 0x68: case 0x6c: case 0x70: case 0x74: // iadd ~ ineg
+		case 0x78: case 0x7a: case 0x7c: case 0x7e: case 0x80: case 0x82: // shifts, logic
+		case 0x84: // iinc
+		case 0x91: case 0x92: case 0x93: // i2b, i2c, i2s
+		case 0xa7: case 0xaa: case 0xab: // goto, switches
+		case 0xac: case 0xb0: case 0xb1: // ireturn, areturn, return
+		case 0xb8: // invokestatic
+			return true;
+		default:
+			return (0x99 <= op && op <= 0xa6) || op == 0xc6 || op == 0xc7; // if<cond>, if_icmp<cond>, if_acmp<cond>, ifnull, ifnonnull
+		}
+	}
+
+	// Checks everything but the callees
+	bool PrepareCandidate(VM& vm, AotCandidate& c)
+	{
+		const CFMethod& m = *c.method;
+		const auto& cp = c.jclass->cf.constant_pool;
+		if (!m.code || !m.verified || (m.access_flags & 0x0020) || (~m.access_flags & 0x0008)) // ACC_SYNCHRONIZED, ACC_STATIC
+			return false;
+		if (m.code->exception_table_lenth != 0)
+			return false;
+		const wstring& desc = vm.GetInternedString(cp[m.descriptor_index].val.f5.idx);
+		if (!IsSupportedDescriptor(desc) || !IsAscii(desc) || !IsAscii(vm.GetInternedString(cp[m.name_index].val.f5.idx))
+			|| !IsAscii(vm.GetInternedString(c.jclass->name)))
+			return false;
+
+		c.code = Decode(*m.code);
+		if (!c.code || !ComputeStackDepths(vm, c.jclass->cf, *c.code, c.depth))
+			return false;
+		vector<bool> isTarget(c.code->insns.size(), false);
+		for (auto& insn : c.code->insns)
+		{
+			if (IsBranch(insn.op))
+				isTarget[insn.a] = true;
+		}
+		ForEachSwitchTarget(*c.code, [&](u32 t) { isTarget[t] = true; });
+		for (u32 k = 0; k < c.code->insns.size(); k++)
+		{
+			const Insn& insn = c.code->insns[k];
+			if (!IsSupportedOp(insn.op))
+				return false;
+			if (insn.op == 0x6c || insn.op == 0x70) // idiv, irem by a constant other than 0 only
+			{
+				const Insn* prev = (k > 0 && !isTarget[k]) ? &c.code->insns[k - 1] : nullptr;
+				if (!prev || !(0x02 <= prev->op && prev->op <= 0x11) || prev->a == 0)
+					return false;
+			}
+			if ((insn.op == 0x12 || insn.op == 0x13) && cp[insn.a].type != CFConstantPool::Type::Integer)
+				return false;
+			if (insn.op == 0xb8)
+			{
+				const ResolvedMethod* r = ResolveMethod(vm, *c.jclass, static_cast<u16>(insn.a), false);
+				if (!r || !r->method || r->intrinsic)
+					return false;
+				if (r->owner != c.jclass && r->owner->state != ClassState::Initialized)
+					return false; // the call would skip the static initializer of the class
+				c.callees.push_back(r->method);
+			}
+		}
+		return true;
+	}
+
+	class Emitter
+	{
+	public:
+		Emitter(VM& vm, const AotCandidate& c, const unordered_map<const CFMethod*, u32>& index)
+			: m_vm(vm), m_c(c), m_index(index)
+		{
+		}
+
+		void Emit(ostream& os)
+		{
+			const auto& insns = m_c.code->insns;
+			vector<bool> isTarget(insns.size(), false);
+			for (auto& insn : insns)
+			{
+				if (IsBranch(insn.op))
+					isTarget[insn.a] = true;
+			}
+			ForEachSwitchTarget(*m_c.code, [&](u32 t) { isTarget[t] = true; });
+
+			ostringstream body;
+			for (u32 k = 0; k < insns.size(); k++)
+			{
+				if (m_c.depth[k] < 0)
+					continue; // unreachable
+				if (isTarget[k])
+					body << "L" << k << ":\n";
+				EmitInsn(body, insns[k], k, static_cast<u32>(m_c.depth[k]));
+			}
+
+			const u32 params = GetArgSlotSize(m_c.method->signature);
+			os << "\t// " << Narrow(m_vm.GetInternedString(m_c.jclass->name)) << '.' << Name() << Descriptor() << "\n";
+			os << "\tvoid m" << m_c.index << "(jvm::VM& vm, const jvm::u32* args, jvm::u32* ret)\n\t{\n";
+			os << "\t\t(void)vm; (void)args; (void)ret;\n";
+			for (u32 i = 0; i < m_c.method->code->max_locals; i++)
+			{
+				if (m_usedLocals.count(i) || i < params)
+					os << "\t\tjvm::s32 l" << i << " = " << ((i < params) ? "static_cast<jvm::s32>(args[" + to_string(i) + "])" : "0") << ";\n";
+			}
+			for (u32 i : m_usedStack)
+				os << "\t\tjvm::s32 s" << i << " = 0;\n";
+			os << body.str() << "\t}\n\n";
+		}
+
+	private:
+		VM& m_vm;
+		const AotCandidate& m_c;
+		const unordered_map<const CFMethod*, u32>& m_index;
+		set<u32> m_usedLocals;
+		set<u32> m_usedStack;
+
+		string Name() const
+		{
+			return Narrow(m_vm.GetInternedString(m_c.jclass->cf.constant_pool[m_c.method->name_index].val.f5.idx));
+		}
+		string Descriptor() const
+		{
+			return Narrow(m_vm.GetInternedString(m_c.jclass->cf.constant_pool[m_c.method->descriptor_index].val.f5.idx));
+		}
+		string S(u32 i)
+		{
+			m_usedStack.insert(i);
+			return "s" + to_string(i);
+		}
+		string L(u32 i)
+		{
+			m_usedLocals.insert(i);
+			return "l" + to_string(i);
+		}
+
+		static const char* Condition(u16 op)
+		{
+			switch (op)
+			{
+			case 0x99: case 0x9f: case 0xa5: case 0xc6: return "==";
+			case 0x9a: case 0xa0: case 0xa6: case 0xc7: return "!=";
+			case 0x9b: case 0xa1: return "<";
+			case 0x9c: case 0xa2: return ">=";
+			case 0x9d: case 0xa3: return ">";
+			default: return "<=";
+			}
+		}
+
+		// Jump to a label, polling first on backedges
+		static string Goto(u32 from, u32 target)
+		{
+			return string((target <= from) ? "{ if (jvm::detail::AotPoll(Poll)) Safepoint(vm); goto L" : "goto L") + to_string(target) + ((target <= from) ? "; }" : ";");
+		}
+
+		void EmitInsn(ostream& os, const Insn& insn, u32 k, u32 d)
+		{
+			const u16 op = insn.op;
+			os << "\t\t";
+			if (op == 0x01)
+				os << S(d) << " = 0;";
+			else if (0x02 <= op && op <= 0x11)
+				os << S(d) << " = " << insn.a << ";";
+			else if (op == 0x12 || op == 0x13)
+				os << S(d) << " = " << static_cast<s32>(m_c.jclass->cf.constant_pool[insn.a].val.f3.v) << ";";
+			else if (op == 0x15 || op == 0x19 || (0x1a <= op && op <= 0x1d) || (0x2a <= op && op <= 0x2d))
+				os << S(d) << " = " << L(insn.a) << ";";
+			else if (op == 0x36 || op == 0x3a || (0x3b <= op && op <= 0x3e) || (0x4b <= op && op <= 0x4e))
+				os << L(insn.a) << " = " << S(d - 1) << ";";
+			else if (op == 0x59)
+				os << S(d) << " = " << S(d - 1) << ";";
+			else if (op == 0x5a)
+				os << S(d) << " = " << S(d - 1) << "; " << S(d - 1) << " = " << S(d - 2) << "; " << S(d - 2) << " = " << S(d) << ";";
+			else if (op == 0x5c)
+				os << S(d) << " = " << S(d - 2) << "; " << S(d + 1) << " = " << S(d - 1) << ";";
+			else if (op == 0x5f)
+				os << S(d) << " = " << S(d - 1) << "; " << S(d - 1) << " = " << S(d - 2) << "; " << S(d - 2) << " = " << S(d) << ";";
+			else if (op == 0x74)
+				os << S(d - 1) << " = jvm::detail::AotNeg(" << S(d - 1) << ");";
+			else if (0x60 <= op && op <= 0x7c)
+			{
+				static const char* const Funcs[] = { "Add", "Sub", "Mul", "Div", "Rem", "", "Shl", "Shr", "UShr" };
+				const char* f = (op >= 0x78) ? Funcs[6 + (op - 0x78) / 2] : Funcs[(op - 0x60) / 4];
+				os << S(d - 2) << " = jvm::detail::Aot" << f << "(" << S(d - 2) << ", " << S(d - 1) << ");";
+			}
+			else if (op == 0x7e || op == 0x80 || op == 0x82)
+				os << S(d - 2) << " " << ((op == 0x7e) ? "&" : (op == 0x80) ? "|" : "^") << "= " << S(d - 1) << ";";
+			else if (op == 0x84)
+				os << L(insn.a) << " = jvm::detail::AotAdd(" << L(insn.a) << ", " << insn.b << ");";
+			else if (0x91 <= op && op <= 0x93)
+				os << S(d - 1) << " = static_cast<" << ((op == 0x91) ? "jvm::s8" : (op == 0x92) ? "jvm::u16" : "jvm::s16") << ">(" << S(d - 1) << ");";
+			else if ((0x99 <= op && op <= 0x9e) || op == 0xc6 || op == 0xc7)
+				os << "if (" << S(d - 1) << " " << Condition(op) << " 0) " << Goto(k, insn.a);
+			else if (0x9f <= op && op <= 0xa6)
+				os << "if (" << S(d - 2) << " " << Condition(op) << " " << S(d - 1) << ") " << Goto(k, insn.a);
+			else if (op == 0xa7)
+				os << Goto(k, insn.a);
+			else if (op == 0xaa || op == 0xab)
+			{
+				const SwitchTable& s = m_c.code->switches[insn.a];
+				os << "switch (" << S(d - 1) << ")\n\t\t{\n";
+				for (size_t i = 0; i < s.targets.size(); i++)
+				{
+					if (s.targets[i] == s.defaultTarget)
+						continue; // also the empty slots of hashed tables
+					s32 key = (s.kind == SwitchTable::Kind::Table) ? static_cast<s32>(static_cast<u32>(s.low) + static_cast<u32>(i)) : s.keys[i];
+					os << "\t\tcase " << key << ": " << Goto(k, s.targets[i]) << "\n";
+				}
+				os << "\t\tdefault: " << Goto(k, s.defaultTarget) << "\n\t\t}";
+			}
+			else if (op == 0xac || op == 0xb0)
+				os << "ret[0] = static_cast<jvm::u32>(" << S(d - 1) << "); return;";
+			else if (op == 0xb1)
+				os << "return;";
+			else if (op == 0xb8)
+			{
+				const ResolvedMethod* r = ResolveMethod(m_vm, *m_c.jclass, static_cast<u16>(insn.a), false);
+				const u32 n = r->argSlots;
+				os << "{ jvm::u32 a[" << (n ? n : 1) << "] = {";
+				for (u32 i = 0; i < n; i++)
+					os << ((i == 0) ? " " : ", ") << "static_cast<jvm::u32>(" << S(d - n + i) << ")";
+				os << " }; jvm::u32 r[2] = {}; m" << m_index.at(r->method) << "(vm, a, r);";
+				if (r->retSlots)
+					os << " " << S(d - n) << " = static_cast<jvm::s32>(r[0]);";
+				os << " }";
+			}
+			else
+				os << "; // " << hex << op << dec; // nop, pop, pop2
+			os << "\n";
+		}
+	};
+}
+
+u32 VM::WriteNativeImageSource(ostream& os)
+{
+	// Candidates, then drop methods calling methods that are not compiled until nothing changes
+	vector<AotCandidate> candidates;
+	for (auto& jc : m_classPool)
+	{
+		for (auto& m : jc.cf.methods)
+		{
+			AotCandidate c = { &jc, &m, nullptr, {}, {}, 0 };
+			if (PrepareCandidate(*this, c))
+				candidates.push_back(move(c));
+		}
+	}
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		set<const CFMethod*> compiled;
+		for (auto& c : candidates)
+			compiled.insert(c.method);
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			for (const CFMethod* callee : candidates[i].callees)
+			{
+				if (!compiled.count(callee))
+				{
+					candidates.erase(candidates.begin() + i--);
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+
+	unordered_map<const CFMethod*, u32> index;
+	for (u32 i = 0; i < candidates.size(); i++)
+	{
+		candidates[i].index = i;
+		index[candidates[i].method] = i;
+	}
+
+	os << "// Generated by jvm_aot\n#include \"jvmAot.h\"\n\nnamespace\n{\n\tjvm::AotSafepointFunc Safepoint = nullptr;\n"
+		"\tconst std::atomic<bool>* Poll = nullptr;\n\n";
+	for (auto& c : candidates)
+		os << "\tvoid m" << c.index << "(jvm::VM& vm, const jvm::u32* args, jvm::u32* ret);\n";
+	os << "\n";
+	for (auto& c : candidates)
+		Emitter(*this, c, index).Emit(os);
+
+	if (!candidates.empty())
+	{
+		os << "\tconst jvm::AotMethod Methods[] =\n\t{\n";
+		for (auto& c : candidates)
+		{
+			const auto& cp = c.jclass->cf.constant_pool;
+			os << "\t\t{ \"" << Narrow(m_stringPool[c.jclass->name]) << "\", \"" << Narrow(m_stringPool[cp[c.method->name_index].val.f5.idx])
+				<< "\", \"" << Narrow(m_stringPool[cp[c.method->descriptor_index].val.f5.idx]) << "\", "
+				<< HashBytecode(c.method->code->code.begin(), c.method->code->code_length) << "u, m" << c.index << " },\n";
+		}
+		os << "\t};\n";
+	}
+	os << "\tconst jvm::AotImage Image = { jvm::AotAbiVersion, sizeof(jvm::JObject), " << candidates.size() << ", "
+		<< (candidates.empty() ? "nullptr" : "Methods") << ", &Safepoint, &Poll };\n}\n\n";
+	os << "JVM_AOT_EXPORT const jvm::AotImage* jvm_aot_image()\n{\n\treturn &Image;\n}\n";
+	return static_cast<u32>(candidates.size());
+}
+
+bool VM::LoadNativeImage(const char* path)
+{
+	auto image = make_shared<detail::NativeImage>();
+	const AotImage* (*entry)() = nullptr;
+#if defined(_WIN32)
+	image->module = LoadLibraryA(path);
+	if (image->module)
+		entry = reinterpret_cast<const AotImage* (*)()>(GetProcAddress(image->module, AotEntryName));
+#else
+	image->module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (image->module)
+		entry = reinterpret_cast<const AotImage* (*)()>(dlsym(image->module, AotEntryName));
+#endif
+	if (!entry)
+	{
+		cout << "Error: cannot load native image : " << path << endl;
+		return false;
+	}
+	const AotImage* aot = entry();
+	if (aot->abiVersion != AotAbiVersion || aot->objectSize != sizeof(JObject))
+	{
+		cout << "Error: native image was built for another VM : " << path << endl;
+		return false;
+	}
+	if (*aot->poll && *aot->poll != &m_safepointPoll)
+	{
+		cout << "Error: native image is used by another VM : " << path << endl;
+		return false;
+	}
+	*aot->poll = &m_safepointPoll;
+	*aot->safepoint = [](VM& vm) { vm.Safepoint(); };
+	image->poll = aot->poll;
+
+	for (u32 i = 0; i < aot->count; i++)
+	{
+		const AotMethod& m = aot->methods[i];
+		wstring key;
+		for (const char* p : { m.clazz, ".", m.name, m.descriptor })
+			key.append(p, p + strlen(p));
+		m_compiledMethods[key] = &m;
+	}
+	m_nativeImages.push_back(move(image));
+	for (auto& jc : m_classPool)
+		BindCompiledMethods(jc);
+	return true;
+}
+
+void VM::BindCompiledMethods(JClass& jc)
+{
+	if (m_compiledMethods.empty())
+		return;
+	const auto& cp = jc.cf.constant_pool;
+	for (auto& m : jc.cf.methods)
+	{
+		if (!m.code || !m.verified || m.compiled)
+			continue;
+		auto it = m_compiledMethods.find(m_stringPool[jc.name] + L"." + m_stringPool[cp[m.name_index].val.f5.idx] + m_stringPool[cp[m.descriptor_index].val.f5.idx]);
+		if (it == m_compiledMethods.end())
+			continue;
+		if (it->second->codeHash != HashBytecode(m.code->code.begin(), m.code->code_length))
+		{
+			cout << "Error: native code is out of date : " << Narrow(it->first) << endl;
+			continue;
+		}
+		m.compiled = it->second->func;
+	}
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "jvm.h"
+
+// Native images built by jvm_aot, see jvmAot.cpp.
+// Generated sources include this header only, so images do not link against the VM.
+
+#if defined(_WIN32)
+#define JVM_AOT_EXPORT extern "C" __declspec(dllexport)
+#else
+#define JVM_AOT_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+namespace jvm
+{
+	const u32 AotAbiVersion = 3;
+
+	// Name of the function exported by native images, returning the AotImage
+	const char* const AotEntryName = "jvm_aot_image";
+
+	struct AotMethod
+	{
+		const char* clazz; // binary class name
+		const char* name;
+		const char* descriptor;
+		u32 codeHash; // HashBytecode of the compiled method, stale code is not bound
+		detail::IntrinsicFunc func;
+	};
+
+	// Runs the pending safepoint operations, images cannot call VM::Safepoint directly
+	using AotSafepointFunc = void (*)(VM& vm);
+
+	struct AotImage
+	{
+		u32 abiVersion;
+		u32 objectSize; // sizeof(JObject) of the compiler
+		u32 count;
+		const AotMethod* methods;
+		AotSafepointFunc* safepoint; // set by LoadNativeImage
+		const std::atomic<bool>** poll; // set by LoadNativeImage to the poll flag of the VM
+	};
+
+	// FNV-1a of the bytecode
+	inline u32 HashBytecode(const u8* code, u32 length)
+	{
+		u32 h = 2166136261u;
+		for (u32 i = 0; i < length; i++)
+			h = (h ^ code[i]) * 16777619u;
+		return h;
+	}
+
+	namespace detail
+	{
+		// Helpers of the generated code, with the semantics of the interpreter
+
+		inline s32 AotAdd(s32 a, s32 b) { return static_cast<s32>(static_cast<u32>(a) + static_cast<u32>(b)); }
+		inline s32 AotSub(s32 a, s32 b) { return static_cast<s32>(static_cast<u32>(a) - static_cast<u32>(b)); }
+		inline s32 AotMul(s32 a, s32 b) { return static_cast<s32>(static_cast<u32>(a) * static_cast<u32>(b)); }
+		inline s32 AotNeg(s32 a) { return static_cast<s32>(0u - static_cast<u32>(a)); }
+		inline s32 AotShl(s32 a, s32 b) { return static_cast<s32>(static_cast<u32>(a) << (b & 31)); }
+		inline s32 AotShr(s32 a, s32 b) { return a >> (b & 31); }
+		inline s32 AotUShr(s32 a, s32 b) { return static_cast<s32>(static_cast<u32>(a) >> (b & 31)); }
+
+		// Polled on backward branches like the interpreter, see jvmSafepoint.cpp.
+		// The flag is passed through AotImage::poll, so images do not depend on the layout of VM.
+		inline bool AotPoll(const std::atomic<bool>* poll) { return poll->load(std::memory_order_relaxed); }
+
+		// The divisor is a non-zero constant, see PrepareCandidate
+		inline s32 AotDiv(s32 a, s32 b) { return (b == -1) ? AotNeg(a) : a / b; }
+		inline s32 AotRem(s32 a, s32 b) { return (b == -1) ? 0 : a % b; }
+	}
+}
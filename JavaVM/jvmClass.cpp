@@ -2,39 +2,130 @@
 #include <fstream>
 #include <iostream>
 #include <cassert>
+#include <iterator>
 
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
-//#include <codecvt>
-//#include <sstream>
-//#include <locale>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define JVM_UTF8_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define JVM_UTF8_AVX2
+#endif
 
 using namespace std;
 using namespace jvm;
 
 namespace
 {
-	wstring utf8toucs(const char* str, int len)
+	// Widens a run of pure ASCII bytes and returns the number of bytes consumed.
+	// Stops at the first block that contains a non-ASCII byte.
+	size_t widenAscii(const u8* src, size_t len, c16* dst)
 	{
-#if 0
-		// FIXME: Cannot handle non-shortest null character.
-		wstringstream input;
-		input.imbue(locale(input.getloc(), new codecvt_utf8_utf16<wchar_t>()));
-		input << str;
-		return input.str();
-#else
-		int ulen = ::MultiByteToWideChar(CP_UTF8, 0, str, len, 0, 0);
-		if (ulen == 0)
-			return wstring();
-
-		wstring ucs(ulen, L'\0');
-		::MultiByteToWideChar(CP_UTF8, 0, str, len, (wchar_t*)ucs.data(), ulen);
-		return ucs;
+		size_t i = 0;
+#if defined(JVM_UTF8_AVX2)
+		for (; i + 32 <= len; i += 32)
+		{
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+			if (_mm256_movemask_epi8(v) != 0)
+				break;
+			if (sizeof(c16) == 2)
+			{
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+			}
+			else
+			{
+				for (int k = 0; k < 4; k++)
+				{
+					__m128i q = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i + 8 * k));
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 8 * k), _mm256_cvtepu8_epi32(q));
+				}
+			}
+		}
+#endif
+#if defined(JVM_UTF8_SSE2)
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			if (_mm_movemask_epi8(v) != 0)
+				break;
+			__m128i lo = _mm_unpacklo_epi8(v, zero);
+			__m128i hi = _mm_unpackhi_epi8(v, zero);
+			if (sizeof(c16) == 2)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), lo);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), hi);
+			}
+			else
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi16(lo, zero));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 4), _mm_unpackhi_epi16(lo, zero));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpacklo_epi16(hi, zero));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+			}
+		}
 #endif
+		for (; i < len && src[i] < 0x80; i++)
+			dst[i] = src[i];
+		return i;
 	}
 
-	void readAttribute(CFAttribute& ai, ifstream& ifs, const vector<CFConstantPool>& constPool, VM& vm)
+	// Decodes the JVM's modified UTF-8 (JVMS 4.4.7).
+	// NUL is encoded in two bytes and supplementary characters as a surrogate pair
+	// of 3-byte sequences. Pairs are joined when wchar_t can hold a whole code point.
+	wstring utf8toucs(const u8* str, size_t len)
 	{
+		wstring ucs(len, L'\0'); // never longer than the byte count
+		c16* dst = &ucs[0];
+		size_t n = 0;
+		size_t i = 0;
+
+		while (i < len)
+		{
+			size_t run = widenAscii(str + i, len - i, dst + n);
+			i += run;
+			n += run;
+			if (i >= len)
+				break;
+
+			u32 c = str[i];
+			u32 ch;
+			if ((c & 0xE0) == 0xC0 && i + 1 < len && (str[i + 1] & 0xC0) == 0x80)
+			{
+				ch = ((c & 0x1F) << 6) | (str[i + 1] & 0x3F); // 0xC0 0x80 is NUL
+				i += 2;
+			}
+			else if ((c & 0xF0) == 0xE0 && i + 2 < len && (str[i + 1] & 0xC0) == 0x80 && (str[i + 2] & 0xC0) == 0x80)
+			{
+				ch = ((c & 0x0F) << 12) | ((str[i + 1] & 0x3F) << 6) | (str[i + 2] & 0x3F);
+				i += 3;
+			}
+			else
+			{
+				ch = 0xFFFD; // malformed
+				i += 1;
+			}
+
+			if (sizeof(c16) == 4 && 0xD800 <= ch && ch < 0xDC00 && i + 2 < len
+				&& str[i] == 0xED && (str[i + 1] & 0xF0) == 0xB0 && (str[i + 2] & 0xC0) == 0x80)
+			{
+				u32 low = 0xD000 | ((str[i + 1] & 0x3F) << 6) | (str[i + 2] & 0x3F);
+				ch = 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
+				i += 3;
+			}
+			dst[n++] = static_cast<c16>(ch);
+		}
+
+		ucs.resize(n);
+		return ucs;
+	}
+
+	void readAttribute(CFAttribute& ai, ifstream& ifs, CFClassFile& cf, VM& vm)
+	{
+		const auto& constPool = cf.constant_pool;
+
 		ifs.read((char*)&ai.attribute_name_index, 2);
 		revbits(ai.attribute_name_index);
 
@@ -58,13 +149,13 @@ namespace
 			ifs.read((char*)&cd.code_length, 4);
 			revbits(cd.code_length);
 
-			cd.code.resize(cd.code_length);
-			ifs.read((char*)&cd.code[0], cd.code_length);
+			cd.code = cf.arena.NewArray<u8>(cd.code_length);
+			ifs.read((char*)cd.code.begin(), cd.code_length);
 
 			ifs.read((char*)&cd.exception_table_lenth, 2);
 			revbits(cd.exception_table_lenth);
 
-			cd.exception_table.resize(cd.exception_table_lenth);
+			cd.exception_table = cf.arena.NewArray<CFAttribute::Value::Code::Exception>(cd.exception_table_lenth);
 			for (auto& e : cd.exception_table)
 			{
 				ifs.read((char*)&e.start_pc, 2);
@@ -83,10 +174,10 @@ namespace
 			ifs.read((char*)&cd.attributes_count, 2);
 			revbits(cd.attributes_count);
 
-			cd.attributes.resize(cd.attributes_count);
+			cd.attributes = cf.arena.NewArray<CFAttribute>(cd.attributes_count);
 			for (auto& at : cd.attributes)
 			{
-				readAttribute(at, ifs, constPool, vm);
+				readAttribute(at, ifs, cf, vm);
 			}
 		}
 		else if (name == L"LineNumberTable")
@@ -98,7 +189,7 @@ namespace
 			ifs.read((char*)&ln.line_number_table_length, 2);
 			revbits(ln.line_number_table_length);
 
-			ln.line_number_table.resize(ln.line_number_table_length);
+			ln.line_number_table = cf.arena.NewArray<pair<u16, u16>>(ln.line_number_table_length);
 			for (auto& e : ln.line_number_table)
 			{
 				u16 start_pc;
@@ -119,7 +210,7 @@ namespace
 			ifs.read((char*)&lv.local_variable_table_length, 2);
 			revbits(lv.local_variable_table_length);
 
-			lv.local_variable_table.resize(lv.local_variable_table_length);
+			lv.local_variable_table = cf.arena.NewArray<CFAttribute::Value::LocalVariableTable::LocalVariable>(lv.local_variable_table_length);
 			for (auto& v : lv.local_variable_table)
 			{
 				ifs.read((char*)&v.start_pc, 2);
@@ -134,6 +225,14 @@ namespace
 				revbits(v.index);
 			}
 		}
+		else if (name == L"ConstantValue")
+		{
+			ai.type = CFAttribute::Type::ConstantValue;
+			new (&ai.val.constantValue) CFAttribute::Value::ConstantValue;
+
+			ifs.read((char*)&ai.val.constantValue.constantvalue_index, 2);
+			revbits(ai.val.constantValue.constantvalue_index);
+		}
 		else if (name == L"SourceFile")
 		{
 			ai.type = CFAttribute::Type::SourceFile;
@@ -147,8 +246,8 @@ namespace
 			ai.type = CFAttribute::Type::Unknown;
 			new (&ai.val.unknown) CFAttribute::Value::Unknown;
 
-			ai.val.unknown.info.resize(ai.attribute_length);
-			ifs.read((char*)&ai.val.unknown.info[0], ai.attribute_length);
+			ai.val.unknown.info = cf.arena.NewArray<u8>(ai.attribute_length);
+			ifs.read((char*)ai.val.unknown.info.begin(), ai.attribute_length);
 		}
 	};
 }
@@ -184,22 +283,23 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 	revbits(cf.constant_pool_count);
 	cout << "Constant pool count : " << cf.constant_pool_count << endl;
 
-	cf.constant_pool.resize(cf.constant_pool_count);
-	cf.constant_pool[0] = CFConstantPool();
+	cf.constant_pool = cf.arena.NewArray<CFConstantPool>(cf.constant_pool_count);
 	memset(&cf.constant_pool[0], 0, sizeof cf.constant_pool[0]);
 
+	vector<u8> utf8Buf;
+	utf8Buf.reserve(256);
+
 	for (int i = 1; i < cf.constant_pool_count; i++)
 	{
 		CFConstantPool cp;
 		memset(&cp, 0, sizeof cp);
-		char temp[3 * 65537];
 
 		ifs.read((char*)&cp.type, 1);
 		switch (cp.type)
 		{
 		case CFConstantPool::Type::Class:
 		case CFConstantPool::Type::String:
-		case CFConstantPool::Type::InvokeDynamic:
+		case CFConstantPool::Type::MethodType:
 			ifs.read((char*)&cp.val.f1.v, 2);
 			revbits(cp.val.f1.v);
 			break;
@@ -207,7 +307,7 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 		case CFConstantPool::Type::Methodref:
 		case CFConstantPool::Type::InterfaceMethodref:
 		case CFConstantPool::Type::NameAndType:
-		case CFConstantPool::Type::MethodType:
+		case CFConstantPool::Type::InvokeDynamic:
 			ifs.read((char*)&cp.val.f2.v1, 2);
 			ifs.read((char*)&cp.val.f2.v2, 2);
 			revbits(cp.val.f2.v1);
@@ -226,8 +326,9 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 		case CFConstantPool::Type::Utf8:
 			ifs.read((char*)&cp.val.f5.len, 2);
 			revbits(cp.val.f5.len);
-			ifs.read(temp, cp.val.f5.len);
-			cp.val.f5.idx = vm.InternString(utf8toucs(temp, cp.val.f5.len));
+			utf8Buf.resize(cp.val.f5.len);
+			ifs.read((char*)utf8Buf.data(), cp.val.f5.len);
+			cp.val.f5.idx = vm.InternString(utf8toucs(utf8Buf.data(), cp.val.f5.len));
 			break;
 		case CFConstantPool::Type::MethodHandle:
 			ifs.read((char*)&cp.val.f6.kind, 1);
@@ -239,6 +340,13 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 			return false;
 		}
 		cf.constant_pool[i] = cp;
+
+		// 8 byte constants take two entries, the second one is unusable
+		if (cp.type == CFConstantPool::Type::Long || cp.type == CFConstantPool::Type::Double)
+		{
+			if (++i < cf.constant_pool_count)
+				memset(&cf.constant_pool[i], 0, sizeof cf.constant_pool[i]);
+		}
 	}
 
 	ifs.read((char*)&cf.access_flags, 2);
@@ -259,7 +367,7 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 
 	if (cf.interfaces_count > 0)
 	{
-		cf.interfaces.resize(cf.interfaces_count);
+		cf.interfaces = cf.arena.NewArray<u16>(cf.interfaces_count);
 		ifs.read((char*)&cf.interfaces[0], 2 * cf.interfaces_count);
 		for (auto& n : cf.interfaces)
 			revbits(n);
@@ -269,10 +377,10 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 	revbits(cf.fields_count);
 	cout << "Fields count : " << cf.fields_count << endl;
 
-	cf.methods.reserve(cf.fields_count);
+	cf.fields = cf.arena.NewArray<CFField>(cf.fields_count);
 	for (int m = 0; m < cf.fields_count; m++)
 	{
-		CFField field;
+		CFField& field = cf.fields[m];
 
 		ifs.read((char*)&field.access_flags, 2);
 		revbits(field.access_flags);
@@ -286,12 +394,11 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 		ifs.read((char*)&field.attributes_count, 2);
 		revbits(field.attributes_count);
 
-		field.attributes.resize(field.attributes_count);
+		field.attributes = cf.arena.NewArray<CFAttribute>(field.attributes_count);
 		for (int i = 0; i < field.attributes_count; i++)
 		{
-			readAttribute(field.attributes[i], ifs, cf.constant_pool, vm);
+			readAttribute(field.attributes[i], ifs, cf, vm);
 		}
-		cf.fields.emplace_back(move(field));
 	}
 
 	ifs.read((char*)&cf.methods_count, 2);
@@ -315,10 +422,12 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 		ifs.read((char*)&method.attributes_count, 2);
 		revbits(method.attributes_count);
 
-		method.attributes.resize(method.attributes_count);
+		method.attributes = cf.arena.NewArray<CFAttribute>(method.attributes_count);
 		for (int i = 0; i < method.attributes_count; i++)
 		{
-			readAttribute(method.attributes[i], ifs, cf.constant_pool, vm);
+			readAttribute(method.attributes[i], ifs, cf, vm);
+			if (method.attributes[i].type == CFAttribute::Type::Code)
+				method.code = &method.attributes[i].val.code;
 		}
 
 		// Pre decode
@@ -332,10 +441,10 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 	revbits(cf.attributes_count);
 	cout << "Attributes count : " << cf.attributes_count << endl;
 
-	cf.attributes.resize(cf.attributes_count);
+	cf.attributes = cf.arena.NewArray<CFAttribute>(cf.attributes_count);
 	for (int i = 0; i < cf.attributes_count; i++)
 	{
-		readAttribute(cf.attributes[i], ifs, cf.constant_pool, vm);
+		readAttribute(cf.attributes[i], ifs, cf, vm);
 	}
 
 	if (ifs.bad() || ifs.eof())
@@ -344,126 +453,39 @@ bool jvm::loadClass(CFClassFile& cf, const char* path, VM& vm)
 		return false;
 	}
 
-	cout << "Class file loaded" << endl;
-	return true;
-}
-
-jvm::CFAttribute::~CFAttribute()
-{
-	switch (type)
-	{
-	case Type::Undef:
-		break;
-	case Type::Unknown:
-		val.unknown.~Unknown();
-		break;
-	case Type::ConstantValue:
-		val.constantValue.~ConstantValue();
-		break;
-	case Type::Code:
-		val.code.~Code();
-		break;
-	case Type::LineNumberTable:
-		val.lineNumberTable.~LineNumberTable();
-		break;
-	case Type::LocalVariableTable:
-		val.localVariableTable.~LocalVariableTable();
-		break;
-	case Type::SourceFile:
-		val.sourceFile.~SourceFile();
-		break;
-	case Type::Exception:
-		val.exception.~Exception();
-		break;
-	default:
-		assert(0);
-	}
-}
-
-jvm::CFAttribute::CFAttribute(CFAttribute&& c)
-{
-	type = c.type;
-	attribute_name_index = c.attribute_name_index;
-	attribute_length = c.attribute_length;
+	// Identifies the class in the code cache
+	ifs.clear();
+	ifs.seekg(0);
+	cf.contentHash = 14695981039346656037ull;
+	for (istreambuf_iterator<char> it(ifs), end; it != end; ++it)
+		cf.contentHash = (cf.contentHash ^ static_cast<u8>(*it)) * 1099511628211ull;
 
-	switch (type)
-	{
-	case Type::Undef:
-		break;
-	case Type::Unknown:
-		new (&val.unknown) Value::Unknown;
-		val.unknown = move(c.val.unknown);
-		break;
-	case Type::ConstantValue:
-		new (&val.constantValue) Value::ConstantValue;
-		val.constantValue = move(c.val.constantValue);
-		break;
-	case Type::Code:
-		new (&val.code) Value::Code;
-		val.code = move(c.val.code);
-		break;
-	case Type::LineNumberTable:
-		new (&val.lineNumberTable) Value::LineNumberTable;
-		val.lineNumberTable = c.val.lineNumberTable;
-		break;
-	case Type::LocalVariableTable:
-		new (&val.localVariableTable) Value::LocalVariableTable;
-		val.localVariableTable = c.val.localVariableTable;
-		break;
-	case Type::SourceFile:
-		new (&val.sourceFile) Value::SourceFile;
-		val.sourceFile = c.val.sourceFile;
-		break;
-	case Type::Exception:
-		new (&val.exception) Value::Exception;
-		val.exception = move(c.val.exception);
-		break;
-	default:
-		assert(0);
-	}
+	cout << "Class file loaded (metadata " << cf.arena.GetAllocatedSize() << " bytes)" << endl;
+	return true;
 }
 
-CFAttribute& jvm::CFAttribute::operator=(const CFAttribute& c)
+void* jvm::ClassArena::Allocate(size_t size, size_t align)
 {
-	type = c.type;
-	attribute_name_index = c.attribute_name_index;
-	attribute_length = c.attribute_length;
-
-	switch (type)
+	size_t pad = (align - (reinterpret_cast<uintptr_t>(m_cur) & (align - 1))) & (align - 1);
+	if (m_cur == nullptr || m_remain < pad + size)
 	{
-	case Type::Undef:
-		break;
-	case Type::Unknown:
-		new (&val.unknown) Value::Unknown;
-		val.unknown = c.val.unknown;
-		break;
-	case Type::ConstantValue:
-		new (&val.constantValue) Value::ConstantValue;
-		val.constantValue = c.val.constantValue;
-		break;
-	case Type::Code:
-		new (&val.code) Value::Code;
-		val.code = c.val.code;
-		break;
-	case Type::LineNumberTable:
-		new (&val.lineNumberTable) Value::LineNumberTable;
-		val.lineNumberTable = c.val.lineNumberTable;
-		break;
-	case Type::LocalVariableTable:
-		new (&val.localVariableTable) Value::LocalVariableTable;
-		val.localVariableTable = c.val.localVariableTable;
-		break;
-	case Type::SourceFile:
-		new (&val.sourceFile) Value::SourceFile;
-		val.sourceFile = c.val.sourceFile;
-		break;
-	case Type::Exception:
-		new (&val.exception) Value::Exception;
-		val.exception = c.val.exception;
-		break;
-	default:
-		assert(0);
+		// Oversized requests get a dedicated block so that the current one keeps being filled
+		if (size + align > BlockSize / 4)
+		{
+			m_blocks.emplace_back(make_unique<u8[]>(size + align));
+			u8* p = m_blocks.back().get();
+			p += (align - (reinterpret_cast<uintptr_t>(p) & (align - 1))) & (align - 1);
+			m_allocated += size;
+			return p;
+		}
+		m_blocks.emplace_back(make_unique<u8[]>(BlockSize));
+		m_cur = m_blocks.back().get();
+		m_remain = BlockSize;
+		pad = (align - (reinterpret_cast<uintptr_t>(m_cur) & (align - 1))) & (align - 1);
 	}
-
-	return *this;
+	u8* p = m_cur + pad;
+	m_cur += pad + size;
+	m_remain -= pad + size;
+	m_allocated += size;
+	return p;
 }
@@ -1,12 +1,68 @@
 #pragma once
 
 #include "jvm.h"
+#include "jvmDecode.h"
 #include <vector>
+#include <type_traits>
+#include <new>
 
 namespace jvm
 {
 	using namespace std;
 
+	//---------- Metadata arena ----------//
+
+	// Non-owning view of an array allocated from a ClassArena.
+	template<class T>
+	struct ArenaArray
+	{
+		T* ptr = nullptr;
+		u32 count = 0;
+
+		T* begin() const { return ptr; }
+		T* end() const { return ptr + count; }
+		T& operator[](size_t i) const { return ptr[i]; }
+		u32 size() const { return count; }
+		bool empty() const { return count == 0; }
+	};
+
+	// Bump allocator owning all variable-length metadata of one class file.
+	// Memory is released at once when the owning class file is destroyed.
+	class ClassArena
+	{
+	public:
+		ClassArena() = default;
+		ClassArena(ClassArena&&) = default;
+		ClassArena& operator=(ClassArena&&) = default;
+		ClassArena(const ClassArena&) = delete;
+		ClassArena& operator=(const ClassArena&) = delete;
+
+		void* Allocate(size_t size, size_t align);
+
+		template<class T>
+		ArenaArray<T> NewArray(u32 count)
+		{
+			static_assert(is_trivially_destructible<T>::value, "Arena never runs destructors");
+			ArenaArray<T> a;
+			if (count == 0)
+				return a;
+			a.ptr = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+			a.count = count;
+			for (u32 i = 0; i < count; i++)
+				new (&a.ptr[i]) T();
+			return a;
+		}
+
+		size_t GetAllocatedSize() const { return m_allocated; }
+
+	private:
+		static const size_t BlockSize = 16 * 1024;
+		vector<unique_ptr<u8[]>> m_blocks;
+		u8* m_cur = nullptr;
+		size_t m_remain = 0;
+		size_t m_allocated = 0;
+	};
+
 	//---------- Basic class formats ----------//
 
 	struct CFConstantPool
@@ -60,6 +116,7 @@ namespace jvm
 	};
 
 	struct CFAttribute;
+	struct CFCode;
 
 	struct CFField
 	{
@@ -67,7 +124,7 @@ namespace jvm
 		u16 name_index;
 		u16 descriptor_index;
 		u16 attributes_count;
-		vector<CFAttribute> attributes;
+		ArenaArray<CFAttribute> attributes;
 	};
 
 	struct CFMethod
@@ -76,34 +133,73 @@ namespace jvm
 		u16 name_index;
 		u16 descriptor_index;
 		u16 attributes_count;
-		vector<CFAttribute> attributes;
+		ArenaArray<CFAttribute> attributes;
 
 		// Pre decode
 		JSignature signature;
+		const CFCode* code = nullptr; // Code attribute, null if native or abstract
+		mutable std::unique_ptr<detail::DecodedCode> decoded; // built on first execution
+		bool verified = false; // passed the verifier at load time, runs without interpreter guards
+		detail::IntrinsicFunc compiled = nullptr; // native code bound from an AOT image
+
+		CFMethod() = default;
+		CFMethod(CFMethod&&) = default;
+		CFMethod& operator=(CFMethod&&) = default;
+		CFMethod(const CFMethod&) = delete;
+		CFMethod& operator=(const CFMethod&) = delete;
 	};
 
 	struct CFClassFile
 	{
+		ClassArena arena;
+
 		u32 magic;
 		u16 minor_version;
 		u16 major_version;
 		u16 constant_pool_count;
-		vector<CFConstantPool> constant_pool;
+		ArenaArray<CFConstantPool> constant_pool;
 		u16 access_flags;
 		u16 this_class;
 		u16 super_class;
 		u16 interfaces_count;
-		vector<u16> interfaces;
+		ArenaArray<u16> interfaces;
 		u16 fields_count;
-		vector<CFField> fields;
+		ArenaArray<CFField> fields;
 		u16 methods_count;
-		vector<CFMethod> methods;
+		vector<CFMethod> methods; // contiguous, reserved to methods_count
 		u16 attributes_count;
-		vector<CFAttribute> attributes;
+		ArenaArray<CFAttribute> attributes;
+		u64 contentHash = 0; // FNV-1a of the class file bytes
+
+		CFClassFile() = default;
+		CFClassFile(CFClassFile&&) = default;
+		CFClassFile& operator=(CFClassFile&&) = default;
+		CFClassFile(const CFClassFile&) = delete;
+		CFClassFile& operator=(const CFClassFile&) = delete;
 	};
 
 	//---------- Attributes ----------//
 
+	struct CFCode
+	{
+		u16 max_stack;
+		u16 max_locals;
+		u32 code_length;
+		ArenaArray<u8> code;
+		u16 exception_table_lenth;
+		struct Exception {
+			u16 start_pc;
+			u16 end_pc;
+			u16 handler_pc;
+			u16 catch_type;
+		};
+		ArenaArray<Exception> exception_table;
+		u16 attributes_count;
+		ArenaArray<CFAttribute> attributes;
+	};
+
+	// All variants only refer to arena memory, so an attribute is a
+	// fixed-size record that is never deep copied.
 	struct CFAttribute
 	{
 		enum class Type
@@ -124,7 +220,7 @@ namespace jvm
 		{
 			struct Unknown
 			{
-				vector<u8> info;
+				ArenaArray<u8> info;
 			} unknown;
 
 			struct ConstantValue
@@ -132,28 +228,13 @@ namespace jvm
 				u16 constantvalue_index;
 			} constantValue;
 
-			struct Code
-			{
-				u16 max_stack;
-				u16 max_locals;
-				u32 code_length;
-				vector<u8> code;
-				u16 exception_table_lenth;
-				struct Exception {
-					u16 start_pc;
-					u16 end_pc;
-					u16 handler_pc;
-					u16 catch_type;
-				};
-				vector<Exception> exception_table;
-				u16 attributes_count;
-				vector<CFAttribute> attributes;
-			} code;
+			using Code = CFCode;
+			Code code;
 
 			struct LineNumberTable
 			{
 				u16 line_number_table_length;
-				vector<pair<u16, u16>> line_number_table; // {start_pt, line_number}
+				ArenaArray<pair<u16, u16>> line_number_table; // {start_pt, line_number}
 			} lineNumberTable;
 
 			struct LocalVariableTable
@@ -167,7 +248,7 @@ namespace jvm
 					u16 descriptor_index;
 					u16 index; // slot
 				};
-				vector<LocalVariable> local_variable_table;
+				ArenaArray<LocalVariable> local_variable_table;
 			} localVariableTable;
 
 			struct SourceFile
@@ -178,23 +259,19 @@ namespace jvm
 			struct Exception
 			{
 				u16 number_of_exceptions;
-				vector<u16> exception_index_table;
+				ArenaArray<u16> exception_index_table;
 			} exception;
 
 			Value() {}
-			~Value() {}
 		} val;
 
 		CFAttribute()
 		{
 		}
-		~CFAttribute();
-		CFAttribute(const CFAttribute& c)
-		{
-			*this = c;
-		}
-		CFAttribute(CFAttribute&& c);
-		CFAttribute& operator=(const CFAttribute& c);
+		CFAttribute(CFAttribute&&) = default;
+		CFAttribute& operator=(CFAttribute&&) = default;
+		CFAttribute(const CFAttribute&) = delete;
+		CFAttribute& operator=(const CFAttribute&) = delete;
 	};
 
 	//---------- Functions ----------//
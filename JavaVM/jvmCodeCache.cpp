@@ -0,0 +1,522 @@
+#include "jvmDecode.h"
+#include "jvmClass.h"
+#include "jvmObject.h"
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <type_traits>
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+const char jvm::detail::CodeCacheBuildStamp[] = __DATE__ " " __TIME__;
+
+// Derived code cache.
+//
+// The decoded code of every method that ran, after inlining, scalar replacement, loop idioms,
+// bounds check elimination and field resolution, is written per class to
+//   <dir>/<key>.jcc
+// where key hashes the class file bytes and the build of the sources deriving the code. The
+// decoded code also depends on the classes the constant pool names (inlined callees, field
+// offsets), so their content hashes are recorded and compared when the code is taken, loading the
+// classes that are not loaded yet. Inlining also depends on which of them were initialized, a
+// method taken before they are is decoded again. Call site caches are the only runtime state and
+// are recreated empty. Code read from a file is range checked like unverified code and its field
+// offsets are compared with the resolved fields, entries that do not validate are ignored, and
+// the method is decoded again.
+
+namespace jvm
+{
+	namespace detail
+	{
+		struct CodeCacheDependency
+		{
+			wstring name;
+			u64 hash; // contentHash
+			bool initialized; // initialized with a static initializer, its callees may be inlined
+		};
+
+		struct CodeCacheEntry
+		{
+			vector<CodeCacheDependency> dependencies;
+			vector<unique_ptr<DecodedCode>> methods; // indexed by method, null if not cached
+			bool invalid = false; // a dependency was loaded with other bytes
+		};
+	}
+}
+
+namespace
+{
+	const u32 CodeCacheMagic = 0x4843434a; // "JCCH"
+	const u32 CodeCacheVersion = 4; // increase when DecodedCode or the optimization passes change
+
+	static_assert(is_trivially_copyable<Insn>::value && is_trivially_copyable<LoopIdiom>::value, "written as raw bytes");
+
+	u64 GetCacheKey(const CFClassFile& cf)
+	{
+		// Binaries built at another time may decode differently
+		static const char* const BuildStamps[] = { DecodeBuildStamp, InlineBuildStamp, EscapeBuildStamp, LoopBuildStamp,
+			OptimizeBuildStamp, ObjectBuildStamp, CodeCacheBuildStamp };
+		u64 h = cf.contentHash;
+		for (const char* stamp : BuildStamps)
+		{
+			for (const char* p = stamp; *p; p++)
+				h = (h ^ static_cast<u8>(*p)) * 1099511628211ull;
+		}
+		return (h ^ CodeCacheVersion) * 1099511628211ull;
+	}
+
+	string GetCachePath(const string& dir, const CFClassFile& cf)
+	{
+		static const char Hex[] = "0123456789abcdef";
+		string name(16, '0');
+		u64 key = GetCacheKey(cf);
+		for (int i = 15; i >= 0; i--, key >>= 4)
+			name[i] = Hex[key & 15];
+		return dir + "/" + name + ".jcc";
+	}
+
+	class Writer
+	{
+	public:
+		vector<u8> buf;
+
+		template<class T>
+		void Put(const T& v)
+		{
+			const u8* p = reinterpret_cast<const u8*>(&v);
+			buf.insert(buf.end(), p, p + sizeof(T));
+		}
+		template<class T>
+		void PutVector(const vector<T>& v)
+		{
+			Put(static_cast<u32>(v.size()));
+			const u8* p = reinterpret_cast<const u8*>(v.data());
+			buf.insert(buf.end(), p, p + sizeof(T) * v.size());
+		}
+	};
+
+	class Reader
+	{
+	public:
+		Reader(const vector<u8>& buf) : m_buf(buf) {}
+
+		bool ok = true;
+
+		template<class T>
+		T Get()
+		{
+			T v = {};
+			if (m_pos + sizeof(T) > m_buf.size())
+			{
+				ok = false;
+				return v;
+			}
+			memcpy(&v, &m_buf[m_pos], sizeof(T));
+			m_pos += sizeof(T);
+			return v;
+		}
+		template<class T>
+		vector<T> GetVector()
+		{
+			u32 n = Get<u32>();
+			if (!ok || n > (m_buf.size() - m_pos) / sizeof(T))
+			{
+				ok = false;
+				return {};
+			}
+			vector<T> v(n);
+			if (n == 0)
+				return v;
+			memcpy(v.data(), &m_buf[m_pos], sizeof(T) * n);
+			m_pos += sizeof(T) * n;
+			return v;
+		}
+		bool AtEnd() const { return m_pos == m_buf.size(); }
+
+	private:
+		const vector<u8>& m_buf;
+		size_t m_pos = 0;
+	};
+
+	void WriteDecodedCode(Writer& w, const DecodedCode& code)
+	{
+		w.PutVector(code.insns);
+		w.PutVector(code.handlerInsn);
+		w.PutVector(code.loops);
+		w.Put(static_cast<u32>(code.guards.size()));
+		for (auto& g : code.guards)
+		{
+			w.Put(g.index);
+			w.Put(g.bound);
+			w.Put(g.boundIsLength);
+			w.Put(g.boundIsConst);
+			w.Put(g.boundConst);
+			w.PutVector(g.arrays);
+			w.Put(g.fastEntry);
+		}
+		w.Put(static_cast<u32>(code.switches.size()));
+		for (auto& s : code.switches)
+		{
+			w.Put(s.kind);
+			w.Put(s.low);
+			w.Put(s.mult);
+			w.Put(s.shift);
+			w.Put(s.defaultTarget);
+			w.PutVector(s.keys);
+			w.PutVector(s.targets);
+		}
+		w.Put(static_cast<u32>(code.callSites.size()));
+		w.Put(code.extraLocals);
+		w.Put(code.extraStack);
+	}
+
+	unique_ptr<DecodedCode> ReadDecodedCode(Reader& r)
+	{
+		auto code = make_unique<DecodedCode>();
+		code->insns = r.GetVector<Insn>();
+		code->handlerInsn = r.GetVector<u32>();
+		code->loops = r.GetVector<LoopIdiom>();
+		u32 guards = r.Get<u32>();
+		for (u32 i = 0; r.ok && i < guards; i++)
+		{
+			LoopGuard g;
+			g.index = r.Get<u16>();
+			g.bound = r.Get<u16>();
+			g.boundIsLength = r.Get<bool>();
+			g.boundIsConst = r.Get<bool>();
+			g.boundConst = r.Get<s32>();
+			g.arrays = r.GetVector<u16>();
+			g.fastEntry = r.Get<u32>();
+			code->guards.push_back(move(g));
+		}
+		u32 switches = r.Get<u32>();
+		for (u32 i = 0; r.ok && i < switches; i++)
+		{
+			SwitchTable s;
+			s.kind = r.Get<SwitchTable::Kind>();
+			s.low = r.Get<s32>();
+			s.mult = r.Get<u32>();
+			s.shift = r.Get<u32>();
+			s.defaultTarget = r.Get<u32>();
+			s.keys = r.GetVector<s32>();
+			s.targets = r.GetVector<u32>();
+			code->switches.push_back(move(s));
+		}
+		u32 callSites = r.Get<u32>();
+		if (r.ok && callSites <= code->insns.size())
+			code->callSites.resize(callSites); // filled again by the interpreter
+		else
+			r.ok = false;
+		code->extraLocals = r.Get<u16>();
+		code->extraStack = r.Get<u16>();
+		return r.ok ? move(code) : nullptr;
+	}
+
+	// Operand stack slots consumed and produced by a VM internal instruction
+	void GetInternalStackEffect(u16 op, u32& pop, u32& push)
+	{
+		switch (op)
+		{
+		case OpIALoadUnchecked: pop = 2; push = 1; break;
+		case OpIAStoreUnchecked: pop = 3; push = 0; break;
+		case OpGetFieldByte: case OpGetFieldChar: case OpGetFieldShort: case OpGetField32: pop = 1; push = 1; break;
+		case OpGetField64: pop = 1; push = 2; break;
+		case OpPutField8: case OpPutField16: case OpPutField32: pop = 2; push = 0; break;
+		case OpPutField64: pop = 3; push = 0; break;
+		default: pop = 0; push = 0; break; // OpLoopKernel, OpLoopGuard
+		}
+	}
+
+	// Resolved field accesses load and store the field their Fieldref names now. The classes
+	// declaring the fields are loaded by then, so this is checked when the code is taken.
+	bool HasResolvedFields(VM& vm, JClass& jclass, const DecodedCode& code)
+	{
+		for (auto& insn : code.insns)
+		{
+			if (insn.op < OpGetFieldByte || OpPutField64 < insn.op)
+				continue;
+			const JField* f = ResolveField(vm, jclass, static_cast<u16>(insn.b));
+			if (!f || static_cast<s32>(f->offset) != insn.a || FieldAccessOp(*f, insn.op >= OpPutField8) != insn.op)
+				return false;
+		}
+		return true;
+	}
+
+	// Indices into the instructions and tables, local and constant pool operands are in range,
+	// and verified methods, which run without the guards of CheckInsn, keep the stack in bounds
+	bool IsValidCode(VM& vm, const CFClassFile& cf, const CFMethod& method, const DecodedCode& code)
+	{
+		const auto& insns = code.insns;
+		const s64 n = static_cast<s64>(insns.size());
+		const s64 maxLocals = method.code->max_locals + code.extraLocals;
+		const auto IsInsn = [&](s64 i) { return 0 <= i && i < n; };
+		const auto IsLocal = [&](s64 i) { return 0 <= i && i < maxLocals; };
+		const auto IsIndex = [](s64 i, size_t size) { return 0 <= i && i < static_cast<s64>(size); };
+
+		if (n == 0 || code.handlerInsn.size() != method.code->exception_table_lenth)
+			return false;
+		if (!all_of(code.handlerInsn.begin(), code.handlerInsn.end(), IsInsn))
+			return false;
+		for (auto& insn : insns)
+		{
+			const u16 op = insn.op;
+			if ((0xca <= op && op < OpLoopKernel) || op > OpPutField64 || op == 0xa8 || op == 0xa9 || op == 0xc9) // jsr / ret are not run
+				return false;
+			if (IsBranch(op) && !IsInsn(insn.a))
+				return false;
+			if ((op == 0xaa || op == 0xab) && !IsIndex(insn.a, code.switches.size()))
+				return false;
+			if ((op == 0xb6 || op == 0xb9) && !IsIndex(insn.b, code.callSites.size()))
+				return false;
+			if ((op == OpLoopKernel && !IsIndex(insn.a, code.loops.size())) || (op == OpLoopGuard && !IsIndex(insn.a, code.guards.size())))
+				return false;
+			if (OpGetFieldByte <= op && op <= OpPutField64
+				&& (insn.a < 0 || !IsIndex(insn.b, cf.constant_pool.size()) || cf.constant_pool[insn.b].type != CFConstantPool::Type::Fieldref))
+				return false;
+			if (!CheckOperands(cf, insn, static_cast<u32>(maxLocals)))
+				return false;
+		}
+		// Execution cannot run past the last instruction
+		if (!CannotFallThrough(insns.back().op))
+			return false;
+
+		for (auto& l : code.loops)
+		{
+			if (l.kind > LoopIdiom::Kind::FindFirst || !IsLocal(l.index) || !(l.boundIsConst || IsLocal(l.bound))
+				|| !IsLocal(l.dst) || !IsLocal(l.src1) || !IsLocal(l.src2) || !IsLocal(l.acc)
+				|| !(l.valueIsConst || IsLocal(l.value)) || !IsInsn(l.foundTarget))
+				return false;
+		}
+		for (auto& g : code.guards)
+		{
+			if (!IsLocal(g.index) || !(g.boundIsConst || IsLocal(g.bound)) || !IsInsn(g.fastEntry)
+				|| !all_of(g.arrays.begin(), g.arrays.end(), IsLocal))
+				return false;
+		}
+		for (auto& s : code.switches)
+		{
+			if (!IsInsn(s.defaultTarget) || !all_of(s.targets.begin(), s.targets.end(), IsInsn))
+				return false;
+			switch (s.kind)
+			{
+			case SwitchTable::Kind::Table:
+				break;
+			case SwitchTable::Kind::Binary:
+				if (s.keys.size() != s.targets.size())
+					return false;
+				break;
+			case SwitchTable::Kind::Hash:
+				if (s.shift < 1 || s.shift > 31 || s.keys.size() != (size_t(1) << (32 - s.shift)) || s.targets.size() != s.keys.size())
+					return false;
+				break;
+			default:
+				return false;
+			}
+		}
+		if (!method.verified)
+			return true;
+
+		const s32 maxStack = method.code->max_stack + code.extraStack;
+		vector<s32> depth(insns.size(), -1);
+		vector<u32> work;
+		const auto Flow = [&](s64 to, s32 d)
+		{
+			if (!IsInsn(to) || d > maxStack)
+				return false;
+			if (depth[to] < 0)
+			{
+				depth[to] = d;
+				work.push_back(static_cast<u32>(to));
+				return true;
+			}
+			return depth[to] == d;
+		};
+		if (!Flow(0, 0) || !all_of(code.handlerInsn.begin(), code.handlerInsn.end(), [&](u32 h) { return Flow(h, 1); }))
+			return false;
+		while (!work.empty())
+		{
+			const u32 k = work.back();
+			work.pop_back();
+			const Insn& insn = insns[k];
+			u32 pop, push;
+			if (insn.op >= OpLoopKernel)
+				GetInternalStackEffect(insn.op, pop, push);
+			else if (!GetStackEffect(vm, cf, insn, pop, push))
+				return false;
+			if (static_cast<u32>(depth[k]) < pop)
+				return false;
+			const s32 d = depth[k] - static_cast<s32>(pop) + static_cast<s32>(push);
+
+			if (IsBranch(insn.op) && !Flow(insn.a, d))
+				return false;
+			if (insn.op == 0xaa || insn.op == 0xab)
+			{
+				const SwitchTable& t = code.switches[insn.a];
+				if (!Flow(t.defaultTarget, d) || !all_of(t.targets.begin(), t.targets.end(), [&](u32 to) { return Flow(to, d); }))
+					return false;
+				continue;
+			}
+			if (insn.op == OpLoopKernel && code.loops[insn.a].kind == LoopIdiom::Kind::FindFirst && !Flow(code.loops[insn.a].foundTarget, d))
+				return false;
+			if (insn.op == OpLoopGuard && !Flow(code.guards[insn.a].fastEntry, d))
+				return false;
+			if (CannotFallThrough(insn.op))
+				continue;
+			if (!Flow(k + 1, d))
+				return false;
+		}
+		return true;
+	}
+
+	// Classes named by the constant pool and their superclasses
+	vector<const JClass*> GetDependencies(VM& vm, const JClass& jc)
+	{
+		vector<const JClass*> deps;
+		const auto& cp = jc.cf.constant_pool;
+		for (u16 i = 1; i < jc.cf.constant_pool_count; i++)
+		{
+			if (cp[i].type != CFConstantPool::Type::Class)
+				continue;
+			for (const JClass* c = vm.FindClass(cp[cp[i].val.f1.v].val.f5.idx); c; c = c->super)
+			{
+				if (find(deps.begin(), deps.end(), c) == deps.end())
+					deps.push_back(c);
+			}
+		}
+		return deps;
+	}
+
+	// Inlining a callee of another class skips its initialization, unobservable without <clinit>.
+	// The class and its superclasses are initialized before its methods run.
+	bool NeedsInitialization(const JClass& jc, const JClass* c)
+	{
+		for (const JClass* s = &jc; s; s = s->super)
+		{
+			if (s == c)
+				return false;
+		}
+		for (; c; c = c->super)
+		{
+			if (c->clinit)
+				return true;
+		}
+		return false;
+	}
+}
+
+bool VM::SaveCodeCache()
+{
+	if (m_codeCacheDir.empty())
+		return false;
+
+	bool result = true;
+	for (auto& jc : m_classPool)
+	{
+		if (none_of(jc.cf.methods.begin(), jc.cf.methods.end(), [](const CFMethod& m) { return m.decoded != nullptr; }))
+			continue;
+
+		Writer w;
+		w.Put(CodeCacheMagic);
+		w.Put(GetCacheKey(jc.cf));
+		auto deps = GetDependencies(*this, jc);
+		w.Put(static_cast<u32>(deps.size()));
+		for (const JClass* c : deps)
+		{
+			const wstring& name = m_stringPool[c->name];
+			w.PutVector(vector<u16>(name.begin(), name.end()));
+			w.Put(c->cf.contentHash);
+			w.Put(c->state == ClassState::Initialized && NeedsInitialization(jc, c));
+		}
+		w.Put(static_cast<u32>(jc.cf.methods.size()));
+		for (auto& m : jc.cf.methods)
+		{
+			w.Put(static_cast<u8>(m.decoded ? 1 : 0));
+			if (m.decoded)
+				WriteDecodedCode(w, *m.decoded);
+		}
+
+		string path = GetCachePath(m_codeCacheDir, jc.cf);
+		ofstream ofs(path, ios::binary);
+		ofs.write(reinterpret_cast<const char*>(w.buf.data()), static_cast<streamsize>(w.buf.size()));
+		if (!ofs)
+		{
+			cout << "Error: cannot write code cache : " << path << endl;
+			result = false;
+		}
+	}
+	return result;
+}
+
+void VM::ReadCodeCache(JClass& jc)
+{
+	if (m_codeCacheDir.empty())
+		return;
+	ifstream ifs(GetCachePath(m_codeCacheDir, jc.cf), ios::binary);
+	if (!ifs)
+		return; // not cached yet
+	vector<u8> buf((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+	Reader r(buf);
+	auto entry = make_shared<detail::CodeCacheEntry>();
+	if (r.Get<u32>() != CodeCacheMagic || r.Get<u64>() != GetCacheKey(jc.cf))
+		return;
+	u32 deps = r.Get<u32>();
+	for (u32 i = 0; r.ok && i < deps; i++)
+	{
+		vector<u16> name = r.GetVector<u16>();
+		u64 hash = r.Get<u64>();
+		bool initialized = r.Get<bool>();
+		entry->dependencies.push_back({ wstring(name.begin(), name.end()), hash, initialized });
+	}
+	if (r.Get<u32>() != jc.cf.methods.size())
+		return;
+	entry->methods.resize(jc.cf.methods.size());
+	bool valid = true;
+	for (size_t i = 0; i < entry->methods.size(); i++)
+	{
+		auto& m = entry->methods[i];
+		if (r.ok && r.Get<u8>())
+		{
+			m = ReadDecodedCode(r);
+			valid = valid && (!m || (jc.cf.methods[i].code && IsValidCode(*this, jc.cf, jc.cf.methods[i], *m)));
+		}
+	}
+	if (!r.ok || !r.AtEnd() || !valid)
+	{
+		cout << "Error: broken code cache entry, ignored" << endl;
+		return;
+	}
+	jc.codeCache = move(entry);
+}
+
+bool jvm::detail::TakeCachedCode(VM& vm, JClass& jclass, const CFMethod& method)
+{
+	CodeCacheEntry& entry = *jclass.codeCache;
+	auto& code = entry.methods[&method - jclass.cf.methods.data()];
+	if (entry.invalid || !code)
+		return false;
+
+	// Everything the code was derived from must be loaded with the same bytes. Classes that are
+	// missing or not initialized yet reject this method only, later methods check again.
+	for (auto& d : entry.dependencies)
+	{
+		const JClass* c = vm.LoadClass(vm.InternString(wstring(d.name)));
+		if (c && c->cf.contentHash != d.hash)
+		{
+			entry.invalid = true;
+			return false;
+		}
+		if (!c || (d.initialized && c->state != ClassState::Initialized))
+			return false;
+	}
+	if (!HasResolvedFields(vm, jclass, *code))
+	{
+		cout << "Error: broken code cache entry, ignored" << endl;
+		entry.invalid = true;
+		return false;
+	}
+	method.decoded = move(code);
+	return true;
+}
@@ -0,0 +1,547 @@
+#include "jvmDecode.h"
+#include "jvmClass.h"
+#include "jvmObject.h"
+#include <iostream>
+#include <cassert>
+#include <functional>
+#include <algorithm>
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+const char jvm::detail::DecodeBuildStamp[] = __DATE__ " " __TIME__;
+
+namespace
+{
+	// Instruction length in bytes, 0 for variable length instructions
+	const u8 OpLength[256] =
+	{
+	//	0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x00
+		2, 3, 2, 3, 3, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, // 0x10
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x20
+		1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, // 0x30
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+		1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3, 3, // 0x90
+		3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 0, 0, 1, 1, 1, 1, // 0xa0
+		1, 1, 3, 3, 3, 3, 3, 3, 3, 5, 5, 3, 2, 3, 1, 1, // 0xb0
+		3, 3, 1, 1, 0, 4, 3, 3, 5, 5, 0, 0, 0, 0, 0, 0, // 0xc0
+	};
+
+	// Slots popped / pushed by instructions with a fixed stack effect, 0xFF if it depends on operands
+	const u8 OpPop[256] =
+	{
+	//	0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, // 0x20
+		2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, // 0x30
+		2, 2, 2, 1, 1, 1, 1, 2, 2, 2, 2, 1, 1, 1, 1, 3, // 0x40
+		4, 3, 4, 3, 3, 3, 3, 1, 2, 1, 2, 3, 2, 3, 4, 2, // 0x50
+		2, 4, 2, 4, 2, 4, 2, 4, 2, 4, 2, 4, 2, 4, 2, 4, // 0x60
+		2, 4, 2, 4, 1, 2, 1, 2, 2, 3, 2, 3, 2, 3, 2, 4, // 0x70
+		2, 4, 2, 4, 0, 1, 1, 1, 2, 2, 2, 1, 1, 1, 2, 2, // 0x80
+		2, 1, 1, 1, 4, 2, 2, 4, 4, 1, 1, 1, 1, 1, 1, 2, // 0x90
+		2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 1, 1, 1, 2, 1, 2, // 0xa0
+		1, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 1, 1, 1, 1, // 0xb0
+		1, 1, 1, 1, 0xFF, 0xFF, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, // 0xc0
+	};
+
+	const u8 OpPush[256] =
+	{
+	//	0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f
+		0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 1, 1, 1, 2, 2, // 0x00
+		1, 1, 1, 1, 2, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 2, // 0x10
+		2, 2, 1, 1, 1, 1, 2, 2, 2, 2, 1, 1, 1, 1, 1, 2, // 0x20
+		1, 2, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x30
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x40
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 4, 4, 5, 6, 2, // 0x50
+		1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, // 0x60
+		1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, // 0x70
+		1, 2, 1, 2, 0, 2, 1, 2, 1, 1, 2, 1, 2, 2, 1, 2, // 0x80
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, // 0x90
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, // 0xa0
+		0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 1, 1, 1, 1, 0, // 0xb0
+		1, 1, 0, 0, 0xFF, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, // 0xc0
+	};
+
+	inline u16 ReadU16(const u8* p)
+	{
+		return static_cast<u16>((p[0] << 8) | p[1]);
+	}
+
+	inline s32 ReadS32(const u8* p)
+	{
+		return static_cast<s32>((static_cast<u32>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+	}
+
+	// Returns 0 if the opcode is unknown or the instruction runs past the end of the code
+	u32 GetInsnLength(const u8* code, u32 pc, u32 codeLength)
+	{
+		u8 op = code[pc];
+		if (OpLength[op] != 0)
+			return (pc + OpLength[op] <= codeLength) ? OpLength[op] : 0;
+
+		u32 pad = 3 - (pc & 3); // operands are aligned to 4 bytes from the method start
+		s64 len = 0;
+		switch (op)
+		{
+		case 0xaa: // tableswitch
+		{
+			if (pc + 1 + pad + 12 > codeLength)
+				return 0;
+			s32 low = ReadS32(&code[pc + 1 + pad + 4]);
+			s32 high = ReadS32(&code[pc + 1 + pad + 8]);
+			if (high < low)
+				return 0;
+			len = 1 + pad + 12 + 4 * (static_cast<s64>(high) - low + 1);
+			break;
+		}
+		case 0xab: // lookupswitch
+		{
+			if (pc + 1 + pad + 8 > codeLength)
+				return 0;
+			s32 npairs = ReadS32(&code[pc + 1 + pad + 4]);
+			if (npairs < 0)
+				return 0;
+			len = 1 + pad + 8 + 8 * static_cast<s64>(npairs);
+			break;
+		}
+		case 0xc4: // wide
+			if (pc + 1 >= codeLength)
+				return 0;
+			len = (code[pc + 1] == 0x84) ? 6 : 4;
+			break;
+		default:
+			cout << "Error: unknown mnemonic : 0x" << hex << static_cast<int>(op) << dec << endl;
+			return 0;
+		}
+		return (pc + len <= codeLength) ? static_cast<u32>(len) : 0;
+	}
+
+	// Reads the operands of a tableswitch / lookupswitch. Targets are bytecode offsets.
+	SwitchTable DecodeSwitch(const u8* code, u32 pc)
+	{
+		SwitchTable s;
+		const u8* p = &code[pc + 1 + (3 - (pc & 3))];
+		s.defaultTarget = pc + ReadS32(p);
+		if (code[pc] == 0xaa) // tableswitch
+		{
+			s.kind = SwitchTable::Kind::Table;
+			s.low = ReadS32(p + 4);
+			s32 high = ReadS32(p + 8);
+			for (s64 key = s.low; key <= high; key++)
+				s.targets.push_back(pc + ReadS32(p + 12 + 4 * (key - s.low)));
+		}
+		else // lookupswitch
+		{
+			s.kind = SwitchTable::Kind::Binary;
+			s32 npairs = ReadS32(p + 4);
+			for (s32 i = 0; i < npairs; i++)
+			{
+				s.keys.push_back(ReadS32(p + 8 + 8 * i));
+				s.targets.push_back(pc + ReadS32(p + 12 + 8 * i));
+			}
+		}
+		return s;
+	}
+
+	// Replaces the binary search of a lookupswitch by a dense table or a perfect hash if possible
+	void OptimizeLookupSwitch(SwitchTable& s)
+	{
+		const size_t n = s.keys.size();
+		if (n == 0)
+			return;
+
+		// Dense keys, at least a quarter of the range is used
+		const s64 range = static_cast<s64>(s.keys.back()) - s.keys.front() + 1;
+		if (range <= static_cast<s64>(4 * n) && range <= 4096)
+		{
+			vector<u32> table(static_cast<size_t>(range), s.defaultTarget);
+			for (size_t i = 0; i < n; i++)
+				table[s.keys[i] - s.keys.front()] = s.targets[i];
+			s.kind = SwitchTable::Kind::Table;
+			s.low = s.keys.front();
+			s.keys.clear();
+			s.targets = move(table);
+			return;
+		}
+
+		// Multiplicative hashing into a table of 2n ~ 4n slots, binary search is as fast for a few keys
+		if (n < 8 || n > 4096)
+			return;
+		static const u32 Multipliers[] = { 0x9e3779b1, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f, 0x165667b1, 0xd3a2646d };
+		u32 bits = 1;
+		while ((1u << bits) < 2 * n)
+			bits++;
+		for (u32 b = bits; b <= bits + 1; b++)
+		{
+			for (u32 mult : Multipliers)
+			{
+				vector<s32> keys(1u << b);
+				vector<u32> targets(1u << b, s.defaultTarget);
+				vector<bool> used(1u << b, false);
+				bool perfect = true;
+				for (size_t i = 0; i < n && perfect; i++)
+				{
+					u32 h = (static_cast<u32>(s.keys[i]) * mult) >> (32 - b);
+					perfect = !used[h];
+					used[h] = true;
+					keys[h] = s.keys[i];
+					targets[h] = s.targets[i];
+				}
+				if (!perfect)
+					continue;
+				s.kind = SwitchTable::Kind::Hash;
+				s.mult = mult;
+				s.shift = 32 - b;
+				s.keys = move(keys);
+				s.targets = move(targets);
+				return;
+			}
+		}
+	}
+
+	void DecodeInsn(const u8* code, u32 pc, Insn& insn)
+	{
+		u8 op = code[pc];
+		insn.op = op;
+		insn.pc = static_cast<u16>(pc);
+		insn.a = 0;
+		insn.b = 0;
+
+		if (0x1a <= op && op <= 0x2d) // xload_<n>
+		{
+			insn.a = (op - 0x1a) & 3;
+			return;
+		}
+		if (0x3b <= op && op <= 0x4e) // xstore_<n>
+		{
+			insn.a = (op - 0x3b) & 3;
+			return;
+		}
+
+		switch (op)
+		{
+		case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07: case 0x08: // iconst_<i>
+			insn.a = op - 0x03;
+			break;
+		case 0x10: // bipush
+			insn.a = static_cast<s8>(code[pc + 1]);
+			break;
+		case 0x11: // sipush
+			insn.a = static_cast<s16>(ReadU16(&code[pc + 1]));
+			break;
+		case 0x12: // ldc
+		case 0x15: case 0x16: case 0x17: case 0x18: case 0x19: // xload
+		case 0x36: case 0x37: case 0x38: case 0x39: case 0x3a: // xstore
+		case 0xa9: // ret
+		case 0xbc: // newarray
+			insn.a = code[pc + 1];
+			break;
+		case 0x84: // iinc
+			insn.a = code[pc + 1];
+			insn.b = static_cast<s8>(code[pc + 2]);
+			break;
+		case 0x13: case 0x14: // ldc_w, ldc2_w
+		case 0xb2: case 0xb3: case 0xb4: case 0xb5: // get/put static/field
+		case 0xb6: case 0xb7: case 0xb8: // invokevirtual/special/static
+		case 0xbb: case 0xbd: case 0xc0: case 0xc1: // new, anewarray, checkcast, instanceof
+			insn.a = ReadU16(&code[pc + 1]);
+			break;
+		case 0xb9: // invokeinterface
+		case 0xba: // invokedynamic
+			insn.a = ReadU16(&code[pc + 1]);
+			break;
+		case 0xc5: // multianewarray
+			insn.a = ReadU16(&code[pc + 1]);
+			insn.b = code[pc + 3];
+			break;
+		case 0xc4: // wide
+			insn.op = code[pc + 1];
+			insn.a = ReadU16(&code[pc + 2]);
+			if (insn.op == 0x84)
+				insn.b = static_cast<s16>(ReadU16(&code[pc + 4]));
+			break;
+		case 0xc8: // goto_w
+			insn.op = 0xa7;
+			insn.a = static_cast<s32>(pc) + ReadS32(&code[pc + 1]);
+			break;
+		case 0xc9: // jsr_w
+			insn.a = static_cast<s32>(pc) + ReadS32(&code[pc + 1]);
+			break;
+		default:
+			if (IsBranch(op) || op == 0xa8) // if<cond>, if_icmp<cond>, if_acmp<cond>, goto, jsr, ifnull, ifnonnull
+				insn.a = static_cast<s32>(pc) + static_cast<s16>(ReadU16(&code[pc + 1]));
+			break;
+		}
+	}
+
+	// getfield / putfield of loaded classes become loads and stores at a fixed offset
+	void ResolveFieldAccesses(VM& vm, JClass& jclass, DecodedCode& code)
+	{
+		for (auto& insn : code.insns)
+		{
+			if (insn.op != 0xb4 && insn.op != 0xb5)
+				continue;
+			const JField* f = ResolveField(vm, jclass, static_cast<u16>(insn.a));
+			if (!f)
+				continue; // resolved by the interpreter
+			insn.op = FieldAccessOp(*f, insn.op == 0xb5);
+			insn.b = insn.a; // the code cache checks the offset against the field
+			insn.a = static_cast<s32>(f->offset);
+		}
+	}
+}
+
+u16 jvm::detail::FieldAccessOp(const JField& f, bool put)
+{
+	switch (f.size)
+	{
+	case 1:
+		return put ? OpPutField8 : OpGetFieldByte;
+	case 2:
+		return put ? OpPutField16 : (f.type == PrimitiveType::Char) ? OpGetFieldChar : OpGetFieldShort;
+	case 8:
+		return put ? OpPutField64 : OpGetField64;
+	default:
+		return put ? OpPutField32 : OpGetField32;
+	}
+}
+
+unique_ptr<DecodedCode> jvm::detail::Decode(const CFCode& cd)
+{
+	auto decoded = make_unique<DecodedCode>();
+	auto& insns = decoded->insns;
+
+	// Pass 1: split into instructions
+	vector<s32> pcToInsn(cd.code_length + 1, -1);
+	for (u32 pc = 0, len = 0; pc < cd.code_length; pc += len)
+	{
+		len = GetInsnLength(cd.code.begin(), pc, cd.code_length);
+		if (len == 0)
+			return nullptr;
+		pcToInsn[pc] = static_cast<s32>(insns.size());
+		Insn insn;
+		DecodeInsn(cd.code.begin(), pc, insn);
+		if (insn.op == 0xaa || insn.op == 0xab) // tableswitch, lookupswitch
+		{
+			insn.a = static_cast<s32>(decoded->switches.size());
+			decoded->switches.push_back(DecodeSwitch(cd.code.begin(), pc));
+			const auto& keys = decoded->switches.back().keys;
+			if (adjacent_find(keys.begin(), keys.end(), greater_equal<s32>()) != keys.end())
+				return nullptr; // lookupswitch keys must be sorted
+		}
+		insns.push_back(insn);
+	}
+
+	// Pass 2: bytecode offsets to instruction indices, call sites
+	for (auto& insn : insns)
+	{
+		if (insn.op == 0xb6 || insn.op == 0xb9) // invokevirtual, invokeinterface
+		{
+			insn.b = static_cast<s32>(decoded->callSites.size());
+			decoded->callSites.emplace_back();
+		}
+		if (IsBranch(insn.op) || insn.op == 0xa8 || insn.op == 0xc9)
+		{
+			if (insn.a < 0 || insn.a >= static_cast<s32>(cd.code_length) || pcToInsn[insn.a] < 0)
+				return nullptr;
+			insn.a = pcToInsn[insn.a];
+		}
+	}
+	bool valid = true;
+	ForEachSwitchTarget(*decoded, [&](u32& target)
+	{
+		valid = valid && target < cd.code_length && pcToInsn[target] >= 0;
+		target = valid ? static_cast<u32>(pcToInsn[target]) : 0;
+	});
+	if (!valid)
+		return nullptr;
+	for (auto& s : decoded->switches)
+	{
+		if (s.kind == SwitchTable::Kind::Binary)
+			OptimizeLookupSwitch(s);
+	}
+	for (auto& e : cd.exception_table)
+	{
+		if (e.handler_pc >= cd.code_length || pcToInsn[e.handler_pc] < 0)
+			return nullptr;
+		decoded->handlerInsn.push_back(static_cast<u32>(pcToInsn[e.handler_pc]));
+	}
+
+	return decoded;
+}
+
+bool jvm::detail::GetStackEffect(VM& vm, const CFClassFile& cf, const Insn& insn, u32& pop, u32& push)
+{
+	if (insn.op >= 0x100)
+		return false; // VM internal instructions are not analyzed
+
+	if (insn.op != 0xc5 && OpPop[insn.op] != 0xFF) // multianewarray pops its dimensions
+	{
+		pop = OpPop[insn.op];
+		push = OpPush[insn.op];
+		return true;
+	}
+
+	const auto& cp = cf.constant_pool;
+	const auto Descriptor = [&](u16 ref) -> const wstring&
+	{
+		u16 nat = cp[ref].val.f2.v2;
+		return vm.GetInternedString(cp[cp[nat].val.f2.v2].val.f5.idx);
+	};
+
+	switch (insn.op)
+	{
+	case 0xb2: // getstatic
+	case 0xb4: // getfield
+	{
+		u32 sz = GetSlotSize(DecodeType(vm, Descriptor(insn.a)));
+		pop = (insn.op == 0xb4) ? 1 : 0;
+		push = sz;
+		return true;
+	}
+	case 0xb3: // putstatic
+	case 0xb5: // putfield
+	{
+		u32 sz = GetSlotSize(DecodeType(vm, Descriptor(insn.a)));
+		pop = sz + ((insn.op == 0xb5) ? 1 : 0);
+		push = 0;
+		return true;
+	}
+	case 0xb6: // invokevirtual
+	case 0xb7: // invokespecial
+	case 0xb8: // invokestatic
+	case 0xb9: // invokeinterface
+	case 0xba: // invokedynamic
+	{
+		JSignature sig = DecodeSignature(vm, Descriptor(insn.a));
+		pop = GetArgSlotSize(sig) + ((insn.op == 0xb8 || insn.op == 0xba) ? 0 : 1);
+		push = GetSlotSize(sig.ret);
+		return true;
+	}
+	case 0xc5: // multianewarray
+		pop = insn.b;
+		push = 1;
+		return true;
+	default:
+		return false; // wide is folded away by the decoder
+	}
+}
+
+bool jvm::detail::ComputeStackDepths(VM& vm, const CFClassFile& cf, const DecodedCode& code, vector<s32>& depth)
+{
+	const auto& insns = code.insns;
+	depth.assign(insns.size(), -1);
+	vector<u32> work;
+	const auto Flow = [&](u32 to, s32 d)
+	{
+		if (to >= insns.size())
+			return false;
+		if (depth[to] < 0)
+		{
+			depth[to] = d;
+			work.push_back(to);
+			return true;
+		}
+		return depth[to] == d;
+	};
+
+	if (!Flow(0, 0))
+		return false;
+	for (u32 h : code.handlerInsn)
+	{
+		if (!Flow(h, 1)) // the exception
+			return false;
+	}
+
+	while (!work.empty())
+	{
+		u32 k = work.back();
+		work.pop_back();
+		const Insn& insn = insns[k];
+
+		u32 pop, push;
+		if (!GetStackEffect(vm, cf, insn, pop, push) || static_cast<u32>(depth[k]) < pop)
+			return false;
+		s32 d = depth[k] - static_cast<s32>(pop) + static_cast<s32>(push);
+
+		if (insn.op == 0xa8 || insn.op == 0xa9 || insn.op == 0xc9)
+			return false; // jsr, ret
+		if (IsBranch(insn.op) && !Flow(insn.a, d))
+			return false;
+		if (insn.op == 0xaa || insn.op == 0xab) // tableswitch, lookupswitch
+		{
+			const SwitchTable& s = code.switches[insn.a];
+			if (!Flow(s.defaultTarget, d))
+				return false;
+			for (u32 t : s.targets)
+			{
+				if (!Flow(t, d))
+					return false;
+			}
+			continue;
+		}
+		if (insn.op == 0xa7 || (0xac <= insn.op && insn.op <= 0xb1) || insn.op == 0xbf) // goto, xreturn, athrow
+			continue;
+		if (!Flow(k + 1, d))
+			return false;
+	}
+	return true;
+}
+
+void jvm::detail::InsertInsn(DecodedCode& code, u32 at, const Insn& insn)
+{
+	for (auto& i : code.insns)
+	{
+		if ((IsBranch(i.op) || i.op == 0xa8 || i.op == 0xc9) && static_cast<u32>(i.a) > at)
+			i.a++;
+	}
+	for (auto& h : code.handlerInsn)
+	{
+		if (h > at)
+			h++;
+	}
+	for (auto& l : code.loops)
+	{
+		if (l.kind == LoopIdiom::Kind::FindFirst && l.foundTarget > at)
+			l.foundTarget++;
+	}
+	for (auto& g : code.guards)
+	{
+		if (g.fastEntry > at)
+			g.fastEntry++;
+	}
+	ForEachSwitchTarget(code, [&](u32& target)
+	{
+		if (target > at)
+			target++;
+	});
+	code.insns.insert(code.insns.begin() + at, insn);
+}
+
+DecodedCode* jvm::detail::PreDecode(VM& vm, JClass& jclass, const CFMethod& method)
+{
+	if (method.decoded || (jclass.codeCache && TakeCachedCode(vm, jclass, method)))
+		return method.decoded.get();
+
+	assert(method.code);
+	auto decoded = Decode(*method.code);
+	if (!decoded)
+		return nullptr; // rejected by the verifier, if it ran
+	InlineStaticCalls(vm, jclass, method, *decoded);
+	OptimizeCode(vm, jclass, method, *decoded);
+	ScalarReplaceArrays(vm, jclass.cf, method, *decoded);
+	RecognizeLoopIdioms(*decoded);
+	EliminateBoundsChecks(vm, jclass.cf, *decoded);
+	ResolveFieldAccesses(vm, jclass, *decoded);
+
+	method.decoded = move(decoded);
+	return method.decoded.get();
+}
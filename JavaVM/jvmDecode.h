@@ -0,0 +1,255 @@
+#pragma once
+
+#include "jvm.h"
+#include <algorithm>
+
+namespace jvm
+{
+	namespace detail
+	{
+		// VM internal opcodes, placed above the Java opcode range
+		enum InternalOp : u16
+		{
+			OpLoopKernel = 0x100, // a: index of DecodedCode::loops
+			OpIALoadUnchecked,    // iaload / iastore whose array and index are proven valid
+			OpIAStoreUnchecked,
+			OpLoopGuard,          // a: index of DecodedCode::guards
+			OpGetFieldByte,       // getfield / putfield resolved to the field offset in a, Fieldref index in b
+			OpGetFieldChar,
+			OpGetFieldShort,
+			OpGetField32,
+			OpGetField64,
+			OpPutField8,
+			OpPutField16,
+			OpPutField32,
+			OpPutField64,
+		};
+
+		// Pre-decoded instruction.
+		// Operands are read once at decode time and branch targets are instruction indices.
+		struct Insn
+		{
+			u16 op; // Java opcode (goto_w is folded into goto) or InternalOp
+			u16 pc; // bytecode offset of the original instruction
+			s32 a;  // local index, immediate, constant pool index or branch target
+			s32 b;  // iinc delta, call site index, multianewarray dimensions, Fieldref index
+		};
+
+		// Loop replaced by a vector kernel, see jvmLoop.cpp
+		struct LoopIdiom
+		{
+			enum class Kind : u8
+			{
+				Reduce,    // acc = acc OP a[i]
+				Fill,      // dst[i] = value
+				Copy,      // dst[i] = a[i]
+				Binary,    // dst[i] = a[i] OP b[i]
+				FindFirst, // if (a[i] == value) { found block }
+			} kind;
+			u16 op;            // Java opcode of the reduction / element-wise operation
+			u16 index;         // induction variable local
+			u16 bound;         // local holding the bound, or the array local whose length is the bound
+			bool boundIsLength;
+			bool boundIsConst; // the bound is boundConst
+			s32 boundConst;
+			u16 dst;           // array locals
+			u16 src1;
+			u16 src2;
+			u16 acc;           // accumulator local of Reduce
+			bool valueIsConst; // Fill / FindFirst value
+			s32 value;         // constant, or local index
+			u32 foundTarget;   // FindFirst: first instruction of the found block
+		};
+
+		// Loop entry check for a counted loop without bounds checks, see jvmLoop.cpp
+		struct LoopGuard
+		{
+			u16 index;          // induction variable local
+			u16 bound;          // same as LoopIdiom
+			bool boundIsLength;
+			bool boundIsConst;
+			s32 boundConst;
+			std::vector<u16> arrays; // int array locals indexed by the induction variable
+			u32 fastEntry;      // head of the unchecked copy of the loop
+		};
+
+		// Inline cache of an invokevirtual / invokeinterface site.
+		// Up to CacheSize receiver classes are cached, other receivers use the vtable or
+		// the hashed itable lookup of the receiver class.
+		struct CallSite
+		{
+			static const u32 CacheSize = 4;
+
+			enum class Kind : u8
+			{
+				Unresolved,
+				Virtual,   // index is a vtable slot of declClass
+				Interface, // index is an entry of declClass->vtable, dispatched through the itable
+				Direct,    // method outside the vtable (private)
+				String,    // java.lang.String native, resolved into direct
+			} kind = Kind::Unresolved;
+			const ResolvedMethod* direct = nullptr; // Direct target, or the only loaded implementation of a virtual call
+			u8 count = 0; // valid cache entries
+			u16 argSlots = 0; // including the receiver
+			u32 index = 0;
+			const JClass* declClass = nullptr;
+			struct Entry
+			{
+				const JClass* receiver;
+				const ResolvedMethod* target;
+			} cache[CacheSize];
+		};
+
+		// Jump table of a tableswitch / lookupswitch, targets are instruction indices
+		struct SwitchTable
+		{
+			enum class Kind : u8
+			{
+				Table,  // targets[key - low], also used for dense lookupswitch keys
+				Binary, // binary search over the sorted keys
+				Hash,   // perfect hash, the slot of key is (key * mult) >> shift
+			} kind = Kind::Table;
+			s32 low = 0;
+			u32 mult = 0;
+			u32 shift = 0;
+			u32 defaultTarget = 0;
+			std::vector<s32> keys; // Binary: sorted keys, Hash: key of each slot
+			std::vector<u32> targets;
+		};
+
+		inline u32 LookupSwitch(const SwitchTable& s, s32 key)
+		{
+			switch (s.kind)
+			{
+			case SwitchTable::Kind::Table:
+			{
+				u32 i = static_cast<u32>(key) - static_cast<u32>(s.low);
+				return (i < s.targets.size()) ? s.targets[i] : s.defaultTarget;
+			}
+			case SwitchTable::Kind::Hash:
+			{
+				u32 i = (static_cast<u32>(key) * s.mult) >> s.shift;
+				return (s.keys[i] == key) ? s.targets[i] : s.defaultTarget; // empty slots target the default
+			}
+			default:
+			{
+				auto it = std::lower_bound(s.keys.begin(), s.keys.end(), key);
+				return (it != s.keys.end() && *it == key) ? s.targets[it - s.keys.begin()] : s.defaultTarget;
+			}
+			}
+		}
+
+		struct DecodedCode
+		{
+			std::vector<Insn> insns;
+			std::vector<u32> handlerInsn; // handler of each exception table entry
+			std::vector<LoopIdiom> loops;
+			std::vector<LoopGuard> guards;
+			std::vector<CallSite> callSites; // indexed by Insn::b of invokevirtual / invokeinterface
+			std::vector<SwitchTable> switches; // indexed by Insn::a of tableswitch / lookupswitch
+			u16 extraLocals = 0; // frame space used by inlined methods, locals placed after max_locals
+			u16 extraStack = 0;
+		};
+
+		// Returns true if the instruction transfers control to insn.a
+		inline bool IsBranch(u16 op)
+		{
+			return (0x99 <= op && op <= 0xa7) || op == 0xc6 || op == 0xc7;
+		}
+
+		// Returns true if the instruction does not fall through to the next one
+		inline bool CannotFallThrough(u16 op)
+		{
+			return op == 0xa7 || op == 0xaa || op == 0xab || (0xac <= op && op <= 0xb1) || op == 0xbf; // goto, switches, xreturn, athrow
+		}
+
+		// Returns true if the instruction ends a basic block: branches, jsr, ret, switches, returns and athrow
+		inline bool EndsBasicBlock(u16 op)
+		{
+			return IsBranch(op) || (0xa8 <= op && op <= 0xb1) || op == 0xbf || op == 0xc9;
+		}
+
+		// xload_<n> / xstore_<n> to the forms taking the local index in Insn::a
+		inline u16 GenericLocalOp(u16 op)
+		{
+			if (0x1a <= op && op <= 0x2d)
+				return static_cast<u16>(0x15 + (op - 0x1a) / 4);
+			if (0x3b <= op && op <= 0x4e)
+				return static_cast<u16>(0x36 + (op - 0x3b) / 4);
+			return op;
+		}
+
+		// Calls f with each target of the switch tables
+		template<class Code, class F>
+		void ForEachSwitchTarget(Code& code, F f)
+		{
+			for (auto& s : code.switches)
+			{
+				f(s.defaultTarget);
+				for (auto& t : s.targets)
+					f(t);
+			}
+		}
+
+		// Operand stack slots consumed and produced by the instruction.
+		// Returns false for VM internal instructions.
+		bool GetStackEffect(VM& vm, const CFClassFile& cf, const Insn& insn, u32& pop, u32& push);
+
+		// Stack depth before each instruction, -1 if unreachable. Switch targets are followed like branches.
+		// Returns false if the depth is inconsistent or the code uses jsr / ret.
+		bool ComputeStackDepths(VM& vm, const CFClassFile& cf, const DecodedCode& code, std::vector<s32>& depth);
+
+		// OpGetField* / OpPutField* accessing the field
+		u16 FieldAccessOp(const JField& field, bool put);
+
+		// Decodes the bytecode as is, without the optimization passes.
+		// Returns null if the code is malformed.
+		std::unique_ptr<DecodedCode> Decode(const CFCode& code);
+
+		// Build times of the sources deriving the decoded code, part of the code cache key
+		extern const char DecodeBuildStamp[];
+		extern const char InlineBuildStamp[];
+		extern const char EscapeBuildStamp[];
+		extern const char LoopBuildStamp[];
+		extern const char OptimizeBuildStamp[];
+		extern const char ObjectBuildStamp[]; // field layout
+		extern const char CodeCacheBuildStamp[];
+
+		// Bytecode verifier, see jvmVerify.cpp.
+		// Marks the methods of the class as verified, returns false if a method is rejected.
+		bool VerifyClass(VM& vm, CFClassFile& cf);
+
+		// Guard of the checked interpreter for methods that were not verified.
+		// depth is the operand stack depth before the instruction.
+		bool CheckInsn(VM& vm, const CFClassFile& cf, const Insn& insn, u32 depth, u32 maxStack, u32 maxLocals);
+		// The constant pool and local operands of CheckInsn, without the stack
+		bool CheckOperands(const CFClassFile& cf, const Insn& insn, u32 maxLocals);
+
+		// Moves the decoded code of the method out of the code cache of the class, see jvmCodeCache.cpp.
+		// Returns false if the cache has no valid entry.
+		bool TakeCachedCode(VM& vm, JClass& jclass, const CFMethod& method);
+
+		// Decodes the method on first use. The result is owned by the method.
+		// Returns null if the code is malformed, which only unverified methods can be.
+		DecodedCode* PreDecode(VM& vm, JClass& jclass, const CFMethod& method);
+
+		// Inserts an instruction before index at, keeping branch targets consistent.
+		// Branches to at reach the inserted instruction.
+		void InsertInsn(DecodedCode& code, u32 at, const Insn& insn);
+
+		// Inlining of small static methods, see jvmInline.cpp
+		void InlineStaticCalls(VM& vm, JClass& jclass, const CFMethod& method, DecodedCode& code);
+
+		// Scalar replacement of non-escaping arrays, see jvmEscape.cpp
+		void ScalarReplaceArrays(VM& vm, const CFClassFile& cf, const CFMethod& method, DecodedCode& code);
+
+		// Constant folding, propagation and dead code removal, see jvmOptimize.cpp
+		void OptimizeCode(VM& vm, JClass& jclass, const CFMethod& method, DecodedCode& code);
+
+		// Loop idiom recognition, see jvmLoop.cpp
+		void RecognizeLoopIdioms(DecodedCode& code);
+		u32 RunLoopKernel(VM& vm, const LoopIdiom& loop, u32* locals, u32 next);
+		void EliminateBoundsChecks(VM& vm, const CFClassFile& cf, DecodedCode& code);
+		u32 RunLoopGuard(VM& vm, const LoopGuard& guard, u32* locals, u32 next);
+	}
+}
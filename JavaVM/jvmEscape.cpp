@@ -0,0 +1,305 @@
+#include "jvmDecode.h"
+#include "jvmClass.h"
+#include <algorithm>
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+// Scalar replacement of short-lived arrays.
+//
+// "iconst N; newarray T" whose reference never leaves the method is replaced by N locals
+// placed after max_locals. The reference may only be duplicated, popped, stored into a single
+// non-parameter local, and used by arraylength or by element accesses with a constant index
+// in range, all within straight-line code. Element accesses become iload / istore of the
+// element locals, so the array is neither allocated nor bounds checked.
+// Only int, float, long and double arrays are replaced, narrower types need truncating stores.
+
+const char jvm::detail::EscapeBuildStamp[] = __DATE__ " " __TIME__;
+
+namespace
+{
+	const s32 MaxElements = 8;
+
+	enum class Tag : u8
+	{
+		Other,
+		Ref,   // reference to the array
+		Index, // int constant pushed while the reference is live
+	};
+
+	struct Slot
+	{
+		Tag tag;
+		s32 value; // Index: the constant
+		u32 producer; // Index: instruction pushing the constant
+	};
+
+	struct Candidate
+	{
+		u32 insn; // newarray
+		u16 local; // local holding the reference
+		u16 load; // xaload of the element type
+		u16 store;
+		u32 width; // slots per element
+		s32 length;
+		vector<pair<u32, vector<Insn>>> edits; // replaced instructions, empty to delete
+	};
+
+	bool IsIntConst(const Insn& insn)
+	{
+		return (0x02 <= insn.op && insn.op <= 0x08) || insn.op == 0x10 || insn.op == 0x11; // iconst_<i>, bipush, sipush
+	}
+
+	bool GetElementOps(s32 atype, u16& load, u16& store, u32& width)
+	{
+		switch (atype)
+		{
+		case 10: load = 0x2e; store = 0x4f; width = 1; return true; // int
+		case 11: load = 0x2f; store = 0x50; width = 2; return true; // long
+		case 6: load = 0x30; store = 0x51; width = 1; return true; // float
+		case 7: load = 0x31; store = 0x52; width = 2; return true; // double
+		default: return false;
+		}
+	}
+
+	// Simulates the straight-line code from the instruction pushing the reference until no copy
+	// of it is left on the stack, recording the rewrites. Returns false if the reference escapes.
+	bool FollowReference(VM& vm, const CFClassFile& cf, const vector<Insn>& insns, const vector<bool>& isTarget,
+		u32 start, u32 elemBase, Candidate& c, vector<bool>& handled, bool& stored)
+	{
+		const bool fromAlloc = (start == c.insn);
+		vector<Slot> stack{ { Tag::Ref, 0, 0 } };
+		const auto Pop = [&]() -> Slot
+		{
+			if (stack.empty())
+				return { Tag::Other, 0, 0 };
+			Slot s = stack.back();
+			stack.pop_back();
+			return s;
+		};
+		const auto RefCount = [&]()
+		{
+			return count_if(stack.begin(), stack.end(), [](const Slot& s) { return s.tag == Tag::Ref; });
+		};
+		const auto Element = [&](s32 index, u32 half) -> s32
+		{
+			return static_cast<s32>(elemBase + index * c.width + half);
+		};
+
+		if (!fromAlloc)
+		{
+			handled[start] = true;
+			c.edits.push_back({ start, {} }); // the aload
+		}
+
+		for (u32 k = start + 1; k < insns.size(); k++)
+		{
+			if (RefCount() == 0)
+				return true;
+			const Insn& insn = insns[k];
+			const u16 op = GenericLocalOp(insn.op);
+			if (isTarget[k] || EndsBasicBlock(op))
+				return false;
+
+			if (op == 0x19 && insn.a == c.local) // aload
+			{
+				if (fromAlloc && !stored)
+					return false; // refers to the previous array
+				handled[k] = true;
+				c.edits.push_back({ k, {} });
+				stack.push_back({ Tag::Ref, 0, 0 });
+				continue;
+			}
+			if (IsIntConst(insn))
+			{
+				stack.push_back({ Tag::Index, insn.a, k });
+				continue;
+			}
+
+			switch (op)
+			{
+			case 0x57: // pop
+				if (!stack.empty() && stack.back().tag == Tag::Ref)
+					c.edits.push_back({ k, {} });
+				Pop();
+				continue;
+			case 0x59: // dup
+				if (!stack.empty() && stack.back().tag == Tag::Ref)
+				{
+					c.edits.push_back({ k, {} });
+					stack.push_back(stack.back());
+					continue;
+				}
+				if (!stack.empty())
+					stack.back().tag = Tag::Other;
+				stack.push_back({ Tag::Other, 0, 0 });
+				continue;
+			case 0x3a: // astore
+				if (!stack.empty() && stack.back().tag == Tag::Ref)
+				{
+					if (!fromAlloc || stored || insn.a != c.local)
+						return false;
+					stored = true;
+					c.edits.push_back({ k, {} });
+				}
+				Pop();
+				continue;
+			case 0xbe: // arraylength
+				if (!stack.empty() && stack.back().tag == Tag::Ref)
+				{
+					Pop();
+					c.edits.push_back({ k, { { 0x10, insn.pc, c.length, 0 } } }); // bipush
+					stack.push_back({ Tag::Other, 0, 0 });
+					continue;
+				}
+				break;
+			default:
+				break;
+			}
+
+			if (insn.op == c.load && stack.size() >= 2 && stack[stack.size() - 2].tag == Tag::Ref)
+			{
+				Slot index = Pop();
+				Pop();
+				if (index.tag != Tag::Index || index.value < 0 || index.value >= c.length)
+					return false;
+				vector<Insn> repl;
+				for (u32 h = 0; h < c.width; h++)
+					repl.push_back({ 0x15, insn.pc, Element(index.value, h), 0 }); // iload
+				c.edits.push_back({ index.producer, {} });
+				c.edits.push_back({ k, move(repl) });
+				for (u32 h = 0; h < c.width; h++)
+					stack.push_back({ Tag::Other, 0, 0 });
+				continue;
+			}
+			if (insn.op == c.store && stack.size() >= 2 + c.width && stack[stack.size() - 2 - c.width].tag == Tag::Ref)
+			{
+				for (u32 h = 0; h < c.width; h++)
+				{
+					if (Pop().tag == Tag::Ref)
+						return false;
+				}
+				Slot index = Pop();
+				Pop();
+				if (index.tag != Tag::Index || index.value < 0 || index.value >= c.length)
+					return false;
+				vector<Insn> repl;
+				for (u32 h = c.width; h-- > 0;)
+					repl.push_back({ 0x36, insn.pc, Element(index.value, h), 0 }); // istore, upper half first
+				c.edits.push_back({ index.producer, {} });
+				c.edits.push_back({ k, move(repl) });
+				continue;
+			}
+
+			// Any other use of the reference lets it escape
+			u32 pop, push;
+			if (!GetStackEffect(vm, cf, insn, pop, push))
+				return false;
+			for (u32 i = 0; i < pop; i++)
+			{
+				if (Pop().tag == Tag::Ref)
+					return false;
+			}
+			for (u32 i = 0; i < push; i++)
+				stack.push_back({ Tag::Other, 0, 0 });
+		}
+		return RefCount() == 0;
+	}
+}
+
+void jvm::detail::ScalarReplaceArrays(VM& vm, const CFClassFile& cf, const CFMethod& method, DecodedCode& code)
+{
+	auto& insns = code.insns;
+	vector<bool> isTarget(insns.size(), false);
+	for (auto& insn : insns)
+	{
+		if (insn.op == 0xa9)
+			return; // ret targets are not tracked
+		if (IsBranch(insn.op) || insn.op == 0xa8 || insn.op == 0xc9)
+			isTarget[insn.a] = true;
+	}
+	for (auto h : code.handlerInsn)
+		isTarget[h] = true;
+	ForEachSwitchTarget(code, [&](u32 target) { isTarget[target] = true; });
+
+	const u32 params = GetArgSlotSize(method.signature) + ((method.access_flags & 0x0008) ? 0 : 1); // ACC_STATIC
+	vector<vector<Insn>> repl(insns.size());
+	vector<bool> replaced(insns.size(), false);
+	bool changed = false;
+
+	for (u32 k = 1; k < insns.size(); k++)
+	{
+		Candidate c;
+		c.insn = k;
+		c.length = insns[k - 1].a;
+		if (insns[k].op != 0xbc || !IsIntConst(insns[k - 1]) || isTarget[k] // newarray
+			|| c.length < 0 || c.length > MaxElements || !GetElementOps(insns[k].a, c.load, c.store, c.width))
+			continue;
+
+		// Find the local holding the reference
+		u32 at = k + 1;
+		while (at < insns.size() && GenericLocalOp(insns[at].op) != 0x3a && !isTarget[at] && !EndsBasicBlock(insns[at].op))
+			at++;
+		if (at >= insns.size() || GenericLocalOp(insns[at].op) != 0x3a || insns[at].a < static_cast<s32>(params))
+			continue;
+		c.local = static_cast<u16>(insns[at].a);
+		if (count_if(insns.begin(), insns.end(), [&](const Insn& i) { return GenericLocalOp(i.op) == 0x3a && i.a == c.local; }) != 1)
+			continue; // other stores reuse the slot for locals of other types
+
+		const u32 elemBase = method.code->max_locals + code.extraLocals;
+		vector<bool> handled(insns.size(), false);
+		bool stored = false;
+		bool ok = FollowReference(vm, cf, insns, isTarget, k, elemBase, c, handled, stored) && stored;
+		for (u32 i = 0; ok && i < insns.size(); i++)
+		{
+			if (GenericLocalOp(insns[i].op) == 0x19 && insns[i].a == c.local && !handled[i])
+				ok = FollowReference(vm, cf, insns, isTarget, i, elemBase, c, handled, stored);
+		}
+		for (auto& e : c.edits)
+			ok = ok && !replaced[e.first];
+		if (!ok)
+			continue;
+
+		// Zero the elements in place of the allocation
+		vector<Insn> init;
+		for (s32 i = 0; i < c.length * static_cast<s32>(c.width); i++)
+		{
+			init.push_back({ 0x03, insns[k].pc, 0, 0 }); // iconst_0
+			init.push_back({ 0x36, insns[k].pc, static_cast<s32>(elemBase) + i, 0 }); // istore
+		}
+		c.edits.push_back({ k - 1, {} });
+		c.edits.push_back({ k, move(init) });
+		for (auto& e : c.edits)
+		{
+			replaced[e.first] = true;
+			repl[e.first] = move(e.second);
+		}
+		code.extraLocals = static_cast<u16>(code.extraLocals + c.length * c.width);
+		changed = true;
+	}
+	if (!changed)
+		return;
+
+	// Rebuild, deleted instructions continue to the next one
+	vector<Insn> out;
+	vector<u32> map(insns.size() + 1);
+	for (u32 k = 0; k < insns.size(); k++)
+	{
+		map[k] = static_cast<u32>(out.size());
+		if (replaced[k])
+			out.insert(out.end(), repl[k].begin(), repl[k].end());
+		else
+			out.push_back(insns[k]);
+	}
+	map[insns.size()] = static_cast<u32>(out.size());
+	for (auto& insn : out)
+	{
+		if (IsBranch(insn.op) || insn.op == 0xa8 || insn.op == 0xc9)
+			insn.a = static_cast<s32>(map[insn.a]);
+	}
+	for (auto& h : code.handlerInsn)
+		h = map[h];
+	ForEachSwitchTarget(code, [&](u32& target) { target = map[target]; });
+	insns = move(out);
+}
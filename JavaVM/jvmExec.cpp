@@ -1,51 +1,154 @@
 #include "jvmExec.h"
+#include "jvmString.h"
+#include "jvmIntrinsic.h"
+#include "jvmObject.h"
 #include <iostream>
 #include <cassert>
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
+#include <cmath>
+#include <limits>
 
 using namespace std;
 using namespace jvm;
+using detail::Insn;
+
+namespace
+{
+	static_assert(sizeof(f32) == 4 && sizeof(f64) == 8, "Java float and double");
+
+	// A float takes one stack slot, a long or double two in host byte order like the elements of long[] and double[]
+	inline f32 GetFloat(const u32* p) { f32 v; memcpy(&v, p, 4); return v; }
+	inline void SetFloat(u32* p, f32 v) { memcpy(p, &v, 4); }
+	inline f64 GetDouble(const u32* p) { f64 v; memcpy(&v, p, 8); return v; }
+	inline void SetDouble(u32* p, f64 v) { memcpy(p, &v, 8); }
+	inline s64 GetLong(const u32* p) { s64 v; memcpy(&v, p, 8); return v; }
+	inline void SetLong(u32* p, s64 v) { memcpy(p, &v, 8); }
+
+	// f2i, d2i, f2l, d2l: NaN converts to 0 and values out of range saturate
+	template<class R, class T>
+	R ToInteger(T v)
+	{
+		if (v != v)
+			return 0;
+		if (v >= static_cast<T>(numeric_limits<R>::max()))
+			return numeric_limits<R>::max();
+		if (v <= static_cast<T>(numeric_limits<R>::min()))
+			return numeric_limits<R>::min();
+		return static_cast<R>(v);
+	}
+
+	// fcmpl / dcmpl give -1 and fcmpg / dcmpg 1 if either value is NaN
+	template<class T>
+	s32 CompareFloat(T a, T b, s32 unordered)
+	{
+		return (a > b) ? 1 : (a == b) ? 0 : (a < b) ? -1 : unordered;
+	}
+
+	// The verifier does not track reference types, so the array and field instructions check the
+	// objects whose layout they rely on. baload and bastore also access boolean[].
+	inline bool IsArrayOf(const JObject& obj, PrimitiveType type)
+	{
+		return obj.kind == ObjectKind::Array && (obj.type == type || (type == PrimitiveType::Byte && obj.type == PrimitiveType::Boolean));
+	}
+
+	inline bool HasField(const JObject& obj, const JField& field)
+	{
+		return obj.kind == ObjectKind::Instance && (obj.clazz == field.owner || detail::IsAssignableTo(*obj.clazz, *field.owner));
+	}
+}
 
 void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) noexcept
 {
-	const auto& ConstantPool = vmcont.jclass.cf.constant_pool;
+	// Java calls push a frame and continue in this loop, only the host enters it recursively
+	auto& frames = vmres.frames;
+	const size_t EntryDepth = frames.size();
+	frames.push_back({ &vmcont.jclass, &vmcont.method, nullptr, vmcont.baseStackIndex - vmcont.numArgs, 0 });
 
-	// Code̎擾
-	const CFAttribute& codeSection = [&]()
+	auto& stack = vmres.stackFrame;
+	const std::atomic<bool>& safepointPoll = vmres.vm.GetSafepointPoll();
+	JClass* jclass = nullptr;
+	const CFMethod* method = nullptr;
+	const CFConstantPool* ConstantPool = nullptr;
+	const CFCode* Code = nullptr;
+	detail::DecodedCode* Decoded = nullptr;
+	const Insn* Insns = nullptr;
+	u32 MaxLocals = 0;
+	bool Verified = false;
+	u32 localIdx = 0;
+
+	// Switches to the frame on top, the caller sets codeIdx and stackIdx
+	const auto LoadFrame = [&]()
+	{
+		const detail::Frame& f = frames.back();
+		jclass = f.jclass;
+		method = f.method;
+		ConstantPool = jclass->cf.constant_pool.begin();
+		Code = method->code;
+		Decoded = f.decoded;
+		Insns = Decoded->insns.data();
+		MaxLocals = Code->max_locals + Decoded->extraLocals; // inlined methods use the locals after max_locals
+		Verified = method->verified; // unverified methods run with per-instruction guards
+		localIdx = f.localIdx;
+	};
+
+	// Decodes the method of a new frame and makes room for it in the VM stack.
+	// Returns false if the code is malformed or the stack overflows.
+	const auto StackOverflow = [&]()
+	{
+		cout << "Error: stack overflow" << endl;
+		assert(0); // throw StackOverflowError
+		return false;
+	};
+	const auto EnterFrame = [&]()
 	{
-		for (auto& m : vmcont.method.attributes)
+		if (frames.size() > vmres.vm.GetMaxFrameDepth())
+			return StackOverflow();
+		detail::Frame& f = frames.back();
+		assert(f.method->code);
+		f.decoded = detail::PreDecode(vmres.vm, *f.jclass, *f.method);
+		if (!f.decoded)
 		{
-			if (m.type == CFAttribute::Type::Code)
-				return m;
+			cout << "Error: malformed bytecode" << endl;
+			assert(0); // throw VerifyError
+			return false;
 		}
-		return CFAttribute();
-	}();
-	const auto& Code = codeSection.val.code;
+		LoadFrame();
 
-	// X^bNt[̊m
-	const u32 StackSize = Code.max_locals + Code.max_stack - vmcont.numArgs;
-	vmres.stackFrame.resize(vmcont.baseStackIndex + StackSize);
+		// Frames only grow the VM stack, the host shrinks it after the call
+		const size_t frameEnd = size_t(localIdx) + MaxLocals + Code->max_stack + Decoded->extraStack;
+		if (frameEnd > stack.size())
+		{
+			if (frameEnd > vmres.vm.GetMaxStackSize())
+				return StackOverflow();
+			stack.resize(frameEnd);
+		}
 
-	// C^v^̏
-	auto& stack = vmres.stackFrame;
-	u32 localIdx = vmcont.baseStackIndex - vmcont.numArgs;
-	u32 stackIdx = localIdx + Code.max_locals;
+		// Method entry is a safepoint, the frame starts at its first instruction
+		if (safepointPoll.load(std::memory_order_relaxed))
+			vmres.vm.Safepoint();
+		return true;
+	};
+	if (!EnterFrame())
+	{
+		frames.pop_back();
+		return;
+	}
+	u32 stackIdx = localIdx + MaxLocals;
 	u32 codeIdx = 0;
 
 	// fobOpF[Jϐ̏o
 	const auto PrintLocalVariables = [&]()
 	{
-		for (auto& a : Code.attributes)
+		for (auto& a : Code->attributes)
 		{
 			if (a.type == CFAttribute::Type::LocalVariableTable)
 			{
-				u32 baseLocalIdx = vmcont.baseStackIndex - vmcont.numArgs;
+				u32 baseLocalIdx = localIdx;
 				auto& lvt = a.val.localVariableTable;
 				wcout << L"Print local variables" << endl;
 				for (auto& v : lvt.local_variable_table)
 				{
-					if (v.start_pc <= codeIdx && codeIdx < ((u32)(v.start_pc) + v.length))
+					u32 pc = Insns[codeIdx].pc;
+					if (v.start_pc <= pc && pc < ((u32)(v.start_pc) + v.length))
 					{
 						u32 *stackPtr = &stack[baseLocalIdx + v.index];
 						auto& varName = vmres.vm.GetInternedString(ConstantPool[v.name_index].val.f5.idx);
@@ -56,13 +159,76 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 		}
 	};
 
+	const auto GetArray = [&](u32 ref) -> JObject&
+	{
+		if (ref == 0)
+			assert(0); // throw NullPointerException
+		return StackValueToObject(vmres.vm, ref);
+	};
+	const auto GetInstance = GetArray;
+
+	// Returns the branch target, polling for a safepoint on backedges
+	const auto Branch = [&](u32 from, u32 target) -> u32
+	{
+		if ((target <= from) & safepointPoll.load(std::memory_order_relaxed))
+		{
+			frames.back().codeIdx = target;
+			vmres.vm.Safepoint();
+		}
+		return target;
+	};
+
+	// Attributes the next allocation to the current instruction
+	const auto MarkAllocationSite = [&]()
+	{
+		vmres.vm.SetAllocationSite(jclass, method, Insns[codeIdx].pc);
+	};
+
 	// C^v^̎s
 	bool executeBytecode = true;
+
+	// Objects of another layout than the instruction expects end the call like an uncaught error.
+	// Return null in that case.
+	const auto IncompatibleObject = [&]() -> JObject*
+	{
+		cout << "Error: incompatible object" << endl;
+		assert(0); // throw VerifyError
+		frames.erase(frames.begin() + EntryDepth, frames.end());
+		executeBytecode = false;
+		return nullptr;
+	};
+	const auto GetArrayOf = [&](u32 ref, PrimitiveType type) -> JObject*
+	{
+		JObject& obj = GetArray(ref);
+		return IsArrayOf(obj, type) ? &obj : IncompatibleObject();
+	};
+	const auto GetInstanceOf = [&](u32 ref, const JField& field) -> JObject*
+	{
+		JObject& obj = GetInstance(ref);
+		return HasField(obj, field) ? &obj : IncompatibleObject();
+	};
+
 	while (executeBytecode)
 	{
-		const u8 mnemonic = Code.code[codeIdx];
+		if (!Verified && (codeIdx >= Decoded->insns.size() // fell off the end
+			|| !detail::CheckInsn(vmres.vm, jclass->cf, Insns[codeIdx], stackIdx - localIdx - MaxLocals, Code->max_stack + Decoded->extraStack, MaxLocals)))
+		{
+			cout << "Error: malformed bytecode at pc " << ((codeIdx < Decoded->insns.size()) ? Insns[codeIdx].pc : Code->code_length) << endl;
+			assert(0); // throw VerifyError
+			frames.erase(frames.begin() + EntryDepth, frames.end()); // not catchable, back to the host
+			break;
+		}
+		const Insn& insn = Insns[codeIdx];
+		const u16 mnemonic = insn.op;
 		switch (mnemonic)
 		{
+		case 0x00: // nop
+			codeIdx++;
+			break;
+		case 0x01: // aconst_null
+			stack[stackIdx++] = 0;
+			codeIdx++;
+			break;
 		case 0x02: // iconst_m1
 			stack[stackIdx++] = static_cast<u32>(-1);
 			codeIdx++;
@@ -92,20 +258,68 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			codeIdx++;
 			break;
 
+		case 0x09: // lconst_0
+		case 0x0a: // lconst_1
+			SetLong(&stack[stackIdx], mnemonic - 0x09);
+			stackIdx += 2;
+			codeIdx++;
+			break;
+		case 0x0b: // fconst_0
+		case 0x0c: // fconst_1
+		case 0x0d: // fconst_2
+			SetFloat(&stack[stackIdx++], static_cast<f32>(mnemonic - 0x0b));
+			codeIdx++;
+			break;
+		case 0x0e: // dconst_0
+		case 0x0f: // dconst_1
+			SetDouble(&stack[stackIdx], static_cast<f64>(mnemonic - 0x0e));
+			stackIdx += 2;
+			codeIdx++;
+			break;
+
 		case 0x10: // bipush
-			stack[stackIdx++] = static_cast<s8>(Code.code[codeIdx + 1]);
-			codeIdx += 2;
+		case 0x11: // sipush
+			stack[stackIdx++] = insn.a;
+			codeIdx++;
 			break;
 
 		case 0x12: // ldc
-			assert(ConstantPool[codeIdx + 1].type != CFConstantPool::Type::String); // TODO: 
-			stack[stackIdx++] = ConstantPool[Code.code[codeIdx + 1]].val.f3.v;
-			codeIdx += 2;
+		case 0x13: // ldc_w
+		{
+			u32 cpIdx = insn.a;
+			auto& cp = ConstantPool[cpIdx];
+			if (cp.type == CFConstantPool::Type::String)
+			{
+				// Materialize the literal once per constant pool entry
+				u32& str = jclass->stringConstants[cpIdx];
+				if (str == 0)
+				{
+					MarkAllocationSite();
+					str = StackObjectToValue(vmres.vm.GetStringConstant(ConstantPool[cp.val.f1.v].val.f5.idx));
+				}
+				stack[stackIdx++] = str;
+			}
+			else
+			{
+				stack[stackIdx++] = cp.val.f3.v;
+			}
+			codeIdx++;
+			break;
+		}
+
+		case 0x14: // ldc2_w
+			memcpy(&stack[stackIdx], &ConstantPool[insn.a].val.f4.v, 8);
+			stackIdx += 2;
+			codeIdx++;
 			break;
 
 		case 0x15: // iload
-			stack[stackIdx++] = stack[localIdx + Code.code[codeIdx + 1]];
-			codeIdx += 2;
+			stack[stackIdx++] = stack[localIdx + insn.a];
+			codeIdx++;
+			break;
+		case 0x19: // aload
+			stack[stackIdx++] = stack[localIdx + insn.a];
+			codeIdx++;
 			break;
 		case 0x1a: // iload_0
 			stack[stackIdx++] = stack[localIdx];
@@ -142,8 +356,12 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			break;
 
 		case 0x2e: // iaload
+		case 0x30: // faload
 		{
-			JObject& aryref = StackValueToObject(stack[stackIdx - 2]);
+			JObject* ary = GetArrayOf(stack[stackIdx - 2], (mnemonic == 0x2e) ? PrimitiveType::Int : PrimitiveType::Float);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
 			s32 idx = static_cast<s32>(stack[stackIdx - 1]);
 			if (idx < 0 || aryref.length <= idx)
 				assert(0); // throw ArrayIndexOutOfBoundsException
@@ -152,10 +370,97 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			codeIdx++;
 			break;
 		}
+		case 0x2f: // laload
+		case 0x31: // daload
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 2], (mnemonic == 0x2f) ? PrimitiveType::Long : PrimitiveType::Double);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 1]);
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			memcpy(&stack[stackIdx - 2], aryref.data.get() + 8 * idx, 8);
+			codeIdx++;
+			break;
+		}
+		case 0x32: // aaload
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 2], PrimitiveType::Class);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 1]);
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			memcpy(&stack[stackIdx - 2], aryref.data.get() + 4 * idx, 4);
+			stackIdx--;
+			codeIdx++;
+			break;
+		}
+		case 0x33: // baload
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 2], PrimitiveType::Byte);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 1]);
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			stack[stackIdx - 2] = static_cast<s32>(static_cast<s8>(aryref.data[idx]));
+			stackIdx--;
+			codeIdx++;
+			break;
+		}
+		case 0x34: // caload
+		case 0x35: // saload
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 2], (mnemonic == 0x34) ? PrimitiveType::Char : PrimitiveType::Short);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 1]);
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			u16 v;
+			memcpy(&v, aryref.data.get() + 2 * idx, 2);
+			stack[stackIdx - 2] = (mnemonic == 0x34) ? static_cast<u32>(v) : static_cast<s32>(static_cast<s16>(v));
+			stackIdx--;
+			codeIdx++;
+			break;
+		}
+
+		case 0x17: // fload
+		case 0x22: // fload_0
+		case 0x23: // fload_1
+		case 0x24: // fload_2
+		case 0x25: // fload_3
+			stack[stackIdx++] = stack[localIdx + insn.a];
+			codeIdx++;
+			break;
+		case 0x16: // lload
+		case 0x18: // dload
+		case 0x1e: // lload_0
+		case 0x1f: // lload_1
+		case 0x20: // lload_2
+		case 0x21: // lload_3
+		case 0x26: // dload_0
+		case 0x27: // dload_1
+		case 0x28: // dload_2
+		case 0x29: // dload_3
+			stack[stackIdx] = stack[localIdx + insn.a];
+			stack[stackIdx + 1] = stack[localIdx + insn.a + 1];
+			stackIdx += 2;
+			codeIdx++;
+			break;
 
 		case 0x36: // istore
-			stack[localIdx + Code.code[codeIdx + 1]] = stack[--stackIdx];
-			codeIdx += 2;
+			stack[localIdx + insn.a] = stack[--stackIdx];
+			codeIdx++;
+			break;
+		case 0x3a: // astore
+			stack[localIdx + insn.a] = stack[--stackIdx];
+			codeIdx++;
 			break;
 		case 0x3b: // istore_0
 			stack[localIdx] = stack[--stackIdx];
@@ -191,9 +496,37 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			codeIdx++;
 			break;
 
+		case 0x38: // fstore
+		case 0x43: // fstore_0
+		case 0x44: // fstore_1
+		case 0x45: // fstore_2
+		case 0x46: // fstore_3
+			stack[localIdx + insn.a] = stack[--stackIdx];
+			codeIdx++;
+			break;
+		case 0x37: // lstore
+		case 0x39: // dstore
+		case 0x3f: // lstore_0
+		case 0x40: // lstore_1
+		case 0x41: // lstore_2
+		case 0x42: // lstore_3
+		case 0x47: // dstore_0
+		case 0x48: // dstore_1
+		case 0x49: // dstore_2
+		case 0x4a: // dstore_3
+			stackIdx -= 2;
+			stack[localIdx + insn.a] = stack[stackIdx];
+			stack[localIdx + insn.a + 1] = stack[stackIdx + 1];
+			codeIdx++;
+			break;
+
 		case 0x4f: // iastore
+		case 0x51: // fastore
 		{
-			JObject& aryref = StackValueToObject(stack[stackIdx - 3]);
+			JObject* ary = GetArrayOf(stack[stackIdx - 3], (mnemonic == 0x4f) ? PrimitiveType::Int : PrimitiveType::Float);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
 			s32 idx = static_cast<s32>(stack[stackIdx - 2]);
 			u32 val = stack[stackIdx - 1];
 			if (idx < 0 || aryref.length <= idx)
@@ -203,12 +536,109 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			codeIdx++;
 			break;
 		}
+		case 0x50: // lastore
+		case 0x52: // dastore
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 4], (mnemonic == 0x50) ? PrimitiveType::Long : PrimitiveType::Double);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 3]);
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			memcpy(aryref.data.get() + 8 * idx, &stack[stackIdx - 2], 8);
+			stackIdx -= 4;
+			codeIdx++;
+			break;
+		}
+		case 0x53: // aastore
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 3], PrimitiveType::Class);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 2]);
+			u32 val = stack[stackIdx - 1];
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			// Arrays of classes not loaded by the VM, such as String[], take any reference
+			if (val != 0 && aryref.clazz)
+			{
+				const JObject& v = vmres.vm.GetObject(val);
+				if (v.kind != ObjectKind::Instance || !detail::IsAssignableTo(*v.clazz, *aryref.clazz))
+					assert(0); // throw ArrayStoreException
+			}
+			memcpy(aryref.data.get() + 4 * idx, &val, 4);
+			stackIdx -= 3;
+			codeIdx++;
+			break;
+		}
+		case 0x54: // bastore
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 3], PrimitiveType::Byte);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 2]);
+			u32 val = stack[stackIdx - 1];
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			aryref.data[idx] = static_cast<u8>(aryref.type == PrimitiveType::Boolean ? (val & 1) : val);
+			stackIdx -= 3;
+			codeIdx++;
+			break;
+		}
+		case 0x55: // castore
+		case 0x56: // sastore
+		{
+			JObject* ary = GetArrayOf(stack[stackIdx - 3], (mnemonic == 0x55) ? PrimitiveType::Char : PrimitiveType::Short);
+			if (!ary)
+				break;
+			JObject& aryref = *ary;
+			s32 idx = static_cast<s32>(stack[stackIdx - 2]);
+			u16 val = static_cast<u16>(stack[stackIdx - 1]);
+			if (idx < 0 || aryref.length <= idx)
+				assert(0); // throw ArrayIndexOutOfBoundsException
+			memcpy(aryref.data.get() + 2 * idx, &val, 2);
+			stackIdx -= 3;
+			codeIdx++;
+			break;
+		}
 
+		case 0x57: // pop
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x58: // pop2
+			stackIdx -= 2;
+			codeIdx++;
+			break;
 		case 0x59: // dup
 			stack[stackIdx] = stack[stackIdx - 1];
 			stackIdx++;
 			codeIdx++;
 			break;
+		case 0x5a: // dup_x1
+		case 0x5b: // dup_x2
+		case 0x5c: // dup2
+		case 0x5d: // dup2_x1
+		case 0x5e: // dup2_x2
+		{
+			// The top n slots are copied below the n + x slots on the top, a double is two slots
+			const u32 n = (mnemonic <= 0x5b) ? 1 : 2;
+			const u32 x = (mnemonic == 0x5c) ? 0 : (mnemonic == 0x5a || mnemonic == 0x5d) ? 1 : 2;
+			for (u32 i = 0; i < n + x; i++)
+				stack[stackIdx + n - 1 - i] = stack[stackIdx - 1 - i];
+			for (u32 i = 0; i < n; i++)
+				stack[stackIdx - n - x + i] = stack[stackIdx + i];
+			stackIdx += n;
+			codeIdx++;
+			break;
+		}
+		case 0x5f: // swap
+			swap(stack[stackIdx - 1], stack[stackIdx - 2]);
+			codeIdx++;
+			break;
 
 		case 0x60: // iadd
 			stack[stackIdx - 2] += stack[stackIdx - 1];
@@ -226,37 +656,43 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			codeIdx++;
 			break;
 		case 0x6c: // idiv
-			if (stack[stackIdx - 1] == 0)
+		case 0x70: // irem
+		case 0x6d: // ldiv
+		case 0x71: // lrem
+			if ((mnemonic == 0x6c || mnemonic == 0x70) ? (stack[stackIdx - 1] == 0) : ((stack[stackIdx - 1] | stack[stackIdx - 2]) == 0))
 			{
 				const auto ThrowException = [&](const wstring& name, u32& codeIdx)
 				{
-					for (auto& e : Code.exception_table)
+					u32 pc = Insns[codeIdx].pc;
+					for (u32 i = 0; i < Code->exception_table_lenth; i++)
 					{
-						if (e.start_pc <= codeIdx
-							&& codeIdx < e.end_pc)
+						auto& e = Code->exception_table[i];
+						if (e.start_pc <= pc
+							&& pc < e.end_pc)
 						{
 							u16 ec = ConstantPool[e.catch_type].val.f1.v;
 							wstring& ecName = vmres.stringPool[ConstantPool[ec].val.f5.idx];
 							if (ec == 0 || ecName == name)
 							{
-								codeIdx = e.handler_pc;
+								codeIdx = Decoded->handlerInsn[i];
 								return true;
 							}
 						}
 					}
 					return false;
 				};
-				u32 threwPc = codeIdx;
+				u32 threwPc = Insns[codeIdx].pc;
 				bool handled = ThrowException(L"java/lang/ArithmeticException", codeIdx);
 				if (handled) // TODO: eNXO̒T
 				{
+					stackIdx = localIdx + MaxLocals; // the handler starts with the exception alone on the stack
 					stack[stackIdx++] = 555555555; // TODO: ArithmeticExceptionnewăX^bNɐς
 				}
 				else
 				{
 					const auto GetSourceLine = [&](u32 pc) -> int
 					{
-						for (auto& a : Code.attributes)
+						for (auto& a : Code->attributes)
 						{
 							if (a.type == CFAttribute::Type::LineNumberTable)
 							{
@@ -278,7 +714,7 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 					};
 					const auto GetSourceFileName = [&]() -> wstring
 					{
-						for (auto& a : vmcont.jclass.cf.attributes)
+						for (auto& a : jclass->cf.attributes)
 						{
 							if (a.type == CFAttribute::Type::SourceFile)
 							{
@@ -288,9 +724,9 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 						}
 						return L"Unknown Source";
 					};
-					u16 thisCls = ConstantPool[vmcont.jclass.cf.this_class].val.f1.v;
+					u16 thisCls = ConstantPool[jclass->cf.this_class].val.f1.v;
 					auto& thisClsName = vmres.vm.GetInternedString(ConstantPool[thisCls].val.f5.idx);
-					u16 thisMet = vmcont.method.name_index;
+					u16 thisMet = method->name_index;
 					auto& thisMetName = vmres.vm.GetInternedString(ConstantPool[thisMet].val.f5.idx);
 					wstring fileName = GetSourceFileName();
 					int lineNum = GetSourceLine(threwPc);
@@ -300,145 +736,474 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 					assert(0); // TODO: R[X^bNǂ
 				}
 			}
-			else
+			else if (mnemonic == 0x6c || mnemonic == 0x70)
 			{
-				stack[stackIdx - 2] /= stack[stackIdx - 1];
+				// Integer.MIN_VALUE / -1 overflows to Integer.MIN_VALUE
+				const s32 a = static_cast<s32>(stack[stackIdx - 2]);
+				const s32 b = static_cast<s32>(stack[stackIdx - 1]);
+				if (b == -1)
+					stack[stackIdx - 2] = (mnemonic == 0x6c) ? 0u - stack[stackIdx - 2] : 0;
+				else
+					stack[stackIdx - 2] = static_cast<u32>((mnemonic == 0x6c) ? a / b : a % b);
 				stackIdx--;
 				codeIdx++;
 			}
+			else
+			{
+				const s64 a = GetLong(&stack[stackIdx - 4]);
+				const s64 b = GetLong(&stack[stackIdx - 2]);
+				if (b == -1) // Long.MIN_VALUE / -1 overflows to Long.MIN_VALUE
+					SetLong(&stack[stackIdx - 4], (mnemonic == 0x6d) ? static_cast<s64>(0ull - static_cast<u64>(a)) : 0);
+				else
+					SetLong(&stack[stackIdx - 4], (mnemonic == 0x6d) ? a / b : a % b);
+				stackIdx -= 2;
+				codeIdx++;
+			}
+			break;
+		case 0x74: // ineg
+			stack[stackIdx - 1] = 0u - stack[stackIdx - 1];
+			codeIdx++;
+			break;
+		case 0x78: // ishl
+			stack[stackIdx - 2] <<= (stack[stackIdx - 1] & 31);
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x7a: // ishr
+			stack[stackIdx - 2] = static_cast<u32>(static_cast<s32>(stack[stackIdx - 2]) >> (stack[stackIdx - 1] & 31));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x7c: // iushr
+			stack[stackIdx - 2] >>= (stack[stackIdx - 1] & 31);
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x7e: // iand
+			stack[stackIdx - 2] &= stack[stackIdx - 1];
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x80: // ior
+			stack[stackIdx - 2] |= stack[stackIdx - 1];
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x82: // ixor
+			stack[stackIdx - 2] ^= stack[stackIdx - 1];
+			stackIdx--;
+			codeIdx++;
+			break;
+
+		case 0x61: // ladd
+			SetLong(&stack[stackIdx - 4], static_cast<s64>(static_cast<u64>(GetLong(&stack[stackIdx - 4])) + static_cast<u64>(GetLong(&stack[stackIdx - 2]))));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x65: // lsub
+			SetLong(&stack[stackIdx - 4], static_cast<s64>(static_cast<u64>(GetLong(&stack[stackIdx - 4])) - static_cast<u64>(GetLong(&stack[stackIdx - 2]))));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x69: // lmul
+			SetLong(&stack[stackIdx - 4], static_cast<s64>(static_cast<u64>(GetLong(&stack[stackIdx - 4])) * static_cast<u64>(GetLong(&stack[stackIdx - 2]))));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x75: // lneg
+			SetLong(&stack[stackIdx - 2], static_cast<s64>(0ull - static_cast<u64>(GetLong(&stack[stackIdx - 2]))));
+			codeIdx++;
+			break;
+		case 0x79: // lshl
+			SetLong(&stack[stackIdx - 3], static_cast<s64>(static_cast<u64>(GetLong(&stack[stackIdx - 3])) << (stack[stackIdx - 1] & 63)));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x7b: // lshr
+			SetLong(&stack[stackIdx - 3], GetLong(&stack[stackIdx - 3]) >> (stack[stackIdx - 1] & 63));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x7d: // lushr
+			SetLong(&stack[stackIdx - 3], static_cast<s64>(static_cast<u64>(GetLong(&stack[stackIdx - 3])) >> (stack[stackIdx - 1] & 63)));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x7f: // land
+		case 0x81: // lor
+		case 0x83: // lxor
+			// Bitwise on each half
+			if (mnemonic == 0x7f)
+			{
+				stack[stackIdx - 4] &= stack[stackIdx - 2];
+				stack[stackIdx - 3] &= stack[stackIdx - 1];
+			}
+			else if (mnemonic == 0x81)
+			{
+				stack[stackIdx - 4] |= stack[stackIdx - 2];
+				stack[stackIdx - 3] |= stack[stackIdx - 1];
+			}
+			else
+			{
+				stack[stackIdx - 4] ^= stack[stackIdx - 2];
+				stack[stackIdx - 3] ^= stack[stackIdx - 1];
+			}
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+
+		case 0x62: // fadd
+			SetFloat(&stack[stackIdx - 2], GetFloat(&stack[stackIdx - 2]) + GetFloat(&stack[stackIdx - 1]));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x66: // fsub
+			SetFloat(&stack[stackIdx - 2], GetFloat(&stack[stackIdx - 2]) - GetFloat(&stack[stackIdx - 1]));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x6a: // fmul
+			SetFloat(&stack[stackIdx - 2], GetFloat(&stack[stackIdx - 2]) * GetFloat(&stack[stackIdx - 1]));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x6e: // fdiv
+			SetFloat(&stack[stackIdx - 2], GetFloat(&stack[stackIdx - 2]) / GetFloat(&stack[stackIdx - 1]));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x72: // frem
+			SetFloat(&stack[stackIdx - 2], fmod(GetFloat(&stack[stackIdx - 2]), GetFloat(&stack[stackIdx - 1])));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x76: // fneg
+			SetFloat(&stack[stackIdx - 1], -GetFloat(&stack[stackIdx - 1]));
+			codeIdx++;
+			break;
+
+		case 0x63: // dadd
+			SetDouble(&stack[stackIdx - 4], GetDouble(&stack[stackIdx - 4]) + GetDouble(&stack[stackIdx - 2]));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x67: // dsub
+			SetDouble(&stack[stackIdx - 4], GetDouble(&stack[stackIdx - 4]) - GetDouble(&stack[stackIdx - 2]));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x6b: // dmul
+			SetDouble(&stack[stackIdx - 4], GetDouble(&stack[stackIdx - 4]) * GetDouble(&stack[stackIdx - 2]));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x6f: // ddiv
+			SetDouble(&stack[stackIdx - 4], GetDouble(&stack[stackIdx - 4]) / GetDouble(&stack[stackIdx - 2]));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x73: // drem
+			SetDouble(&stack[stackIdx - 4], fmod(GetDouble(&stack[stackIdx - 4]), GetDouble(&stack[stackIdx - 2])));
+			stackIdx -= 2;
+			codeIdx++;
+			break;
+		case 0x77: // dneg
+			SetDouble(&stack[stackIdx - 2], -GetDouble(&stack[stackIdx - 2]));
+			codeIdx++;
 			break;
 
 		case 0x84: // iinc
-			stack[localIdx + Code.code[codeIdx + 1]] += static_cast<s8>(Code.code[codeIdx + 2]);
-			codeIdx += 3;
+			stack[localIdx + insn.a] += insn.b;
+			codeIdx++;
+			break;
+
+		case 0x85: // i2l
+			SetLong(&stack[stackIdx - 1], static_cast<s32>(stack[stackIdx - 1]));
+			stackIdx++;
+			codeIdx++;
+			break;
+		case 0x88: // l2i
+			stack[stackIdx - 2] = static_cast<u32>(GetLong(&stack[stackIdx - 2]));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x89: // l2f
+			SetFloat(&stack[stackIdx - 2], static_cast<f32>(GetLong(&stack[stackIdx - 2])));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x8a: // l2d
+			SetDouble(&stack[stackIdx - 2], static_cast<f64>(GetLong(&stack[stackIdx - 2])));
+			codeIdx++;
+			break;
+		case 0x8c: // f2l
+			SetLong(&stack[stackIdx - 1], ToInteger<s64>(GetFloat(&stack[stackIdx - 1])));
+			stackIdx++;
+			codeIdx++;
+			break;
+		case 0x8f: // d2l
+			SetLong(&stack[stackIdx - 2], ToInteger<s64>(GetDouble(&stack[stackIdx - 2])));
+			codeIdx++;
+			break;
+		case 0x86: // i2f
+			SetFloat(&stack[stackIdx - 1], static_cast<f32>(static_cast<s32>(stack[stackIdx - 1])));
+			codeIdx++;
+			break;
+		case 0x87: // i2d
+			SetDouble(&stack[stackIdx - 1], static_cast<f64>(static_cast<s32>(stack[stackIdx - 1])));
+			stackIdx++;
+			codeIdx++;
+			break;
+		case 0x8b: // f2i
+			stack[stackIdx - 1] = ToInteger<s32>(GetFloat(&stack[stackIdx - 1]));
+			codeIdx++;
+			break;
+		case 0x8d: // f2d
+			SetDouble(&stack[stackIdx - 1], static_cast<f64>(GetFloat(&stack[stackIdx - 1])));
+			stackIdx++;
+			codeIdx++;
+			break;
+		case 0x8e: // d2i
+			stack[stackIdx - 2] = ToInteger<s32>(GetDouble(&stack[stackIdx - 2]));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x90: // d2f
+			SetFloat(&stack[stackIdx - 2], static_cast<f32>(GetDouble(&stack[stackIdx - 2])));
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x91: // i2b
+			stack[stackIdx - 1] = static_cast<u32>(static_cast<s32>(static_cast<s8>(stack[stackIdx - 1])));
+			codeIdx++;
+			break;
+		case 0x92: // i2c
+			stack[stackIdx - 1] = static_cast<u16>(stack[stackIdx - 1]);
+			codeIdx++;
+			break;
+		case 0x93: // i2s
+			stack[stackIdx - 1] = static_cast<u32>(static_cast<s32>(static_cast<s16>(stack[stackIdx - 1])));
+			codeIdx++;
 			break;
 
+		case 0x94: // lcmp
+		{
+			const s64 a = GetLong(&stack[stackIdx - 4]);
+			const s64 b = GetLong(&stack[stackIdx - 2]);
+			stack[stackIdx - 4] = (a > b) ? 1 : (a == b) ? 0 : static_cast<u32>(-1);
+			stackIdx -= 3;
+			codeIdx++;
+			break;
+		}
+		case 0x95: // fcmpl
+		case 0x96: // fcmpg
+			stack[stackIdx - 2] = CompareFloat(GetFloat(&stack[stackIdx - 2]), GetFloat(&stack[stackIdx - 1]), (mnemonic == 0x95) ? -1 : 1);
+			stackIdx--;
+			codeIdx++;
+			break;
+		case 0x97: // dcmpl
+		case 0x98: // dcmpg
+			stack[stackIdx - 4] = CompareFloat(GetDouble(&stack[stackIdx - 4]), GetDouble(&stack[stackIdx - 2]), (mnemonic == 0x97) ? -1 : 1);
+			stackIdx -= 3;
+			codeIdx++;
+			break;
+
+		case 0x99: // ifeq
+		case 0x9a: // ifne
+		case 0x9b: // iflt
+		case 0x9c: // ifge
+		case 0x9d: // ifgt
+		case 0x9e: // ifle
+		{
+			const s32 v = static_cast<s32>(stack[--stackIdx]);
+			bool taken;
+			switch (mnemonic)
+			{
+			case 0x99: taken = (v == 0); break;
+			case 0x9a: taken = (v != 0); break;
+			case 0x9b: taken = (v < 0); break;
+			case 0x9c: taken = (v >= 0); break;
+			case 0x9d: taken = (v > 0); break;
+			default: taken = (v <= 0); break;
+			}
+			codeIdx = taken ? Branch(codeIdx, insn.a) : codeIdx + 1;
+			break;
+		}
+
 		case 0x9f: // if_icmpeq
 			if (static_cast<s32>(stack[stackIdx - 2]) == static_cast<s32>(stack[stackIdx - 1])) {
-				codeIdx += static_cast<s16>((Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2]);
+				codeIdx = Branch(codeIdx, insn.a);
 			}
 			else {
-				codeIdx += 3;
+				codeIdx++;
 			}
 			stackIdx -= 2;
 			break;
 		case 0xa0: // if_icmpne
 			if (static_cast<s32>(stack[stackIdx - 2]) != static_cast<s32>(stack[stackIdx - 1])) {
-				codeIdx += static_cast<s16>((Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2]);
+				codeIdx = Branch(codeIdx, insn.a);
 			}
 			else {
-				codeIdx += 3;
+				codeIdx++;
 			}
 			stackIdx -= 2;
 			break;
 		case 0xa1: // if_icmplt
 			if (static_cast<s32>(stack[stackIdx - 2]) < static_cast<s32>(stack[stackIdx - 1])) {
-				codeIdx += static_cast<s16>((Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2]);
+				codeIdx = Branch(codeIdx, insn.a);
 			}
 			else {
-				codeIdx += 3;
+				codeIdx++;
 			}
 			stackIdx -= 2;
 			break;
 		case 0xa2: // if_icmpge
 			if (static_cast<s32>(stack[stackIdx - 2]) >= static_cast<s32>(stack[stackIdx - 1])) {
-				codeIdx += static_cast<s16>((Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2]);
+				codeIdx = Branch(codeIdx, insn.a);
 			} else {
-				codeIdx += 3;
+				codeIdx++;
 			}
 			stackIdx -= 2;
 			break;
 		case 0xa3: // if_icmpgt
 			if (static_cast<s32>(stack[stackIdx - 2]) > static_cast<s32>(stack[stackIdx - 1])) {
-				codeIdx += static_cast<s16>((Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2]);
+				codeIdx = Branch(codeIdx, insn.a);
 			} else {
-				codeIdx += 3;
+				codeIdx++;
 			}
 			stackIdx -= 2;
 			break;
 		case 0xa4: // if_icmple
 			if (static_cast<s32>(stack[stackIdx - 2]) <= static_cast<s32>(stack[stackIdx - 1])) {
-				codeIdx += static_cast<s16>((Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2]);
+				codeIdx = Branch(codeIdx, insn.a);
+			} else {
+				codeIdx++;
+			}
+			stackIdx -= 2;
+			break;
+		case 0xa5: // if_acmpeq
+			if (stack[stackIdx - 2] == stack[stackIdx - 1]) {
+				codeIdx = Branch(codeIdx, insn.a);
+			} else {
+				codeIdx++;
+			}
+			stackIdx -= 2;
+			break;
+		case 0xa6: // if_acmpne
+			if (stack[stackIdx - 2] != stack[stackIdx - 1]) {
+				codeIdx = Branch(codeIdx, insn.a);
 			} else {
-				codeIdx += 3;
+				codeIdx++;
 			}
 			stackIdx -= 2;
 			break;
 		case 0xa7: // goto
-			codeIdx += static_cast<s16>((Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2]);
+			codeIdx = Branch(codeIdx, insn.a);
+			break;
+		case 0xc6: // ifnull
+		case 0xc7: // ifnonnull
+		{
+			const bool isNull = (stack[--stackIdx] == 0);
+			codeIdx = (isNull == (mnemonic == 0xc6)) ? Branch(codeIdx, insn.a) : codeIdx + 1;
 			break;
+		}
 
-		case 0xac: // ireturn
-			stack[vmcont.baseStackIndex - vmcont.numArgs] = stack[stackIdx - 1];
-			executeBytecode = false;
+		case 0xaa: // tableswitch
+		case 0xab: // lookupswitch
+			codeIdx = Branch(codeIdx, LookupSwitch(Decoded->switches[insn.a], static_cast<s32>(stack[stackIdx - 1])));
+			stackIdx--;
 			break;
+
+		case 0xac: // ireturn
+		case 0xad: // lreturn
+		case 0xae: // freturn
+		case 0xaf: // dreturn
+		case 0xb0: // areturn
 		case 0xb1: // return
-			executeBytecode = false;
+		{
+			// The result goes to the first local of the callee, where the caller's arguments began
+			const u32 retIdx = localIdx;
+			const u32 retSlots = (mnemonic == 0xb1) ? 0 : (mnemonic == 0xad || mnemonic == 0xaf) ? 2 : 1;
+			for (u32 i = 0; i < retSlots; i++)
+				stack[retIdx + i] = stack[stackIdx - retSlots + i];
+			frames.pop_back();
+			if (frames.size() == EntryDepth)
+			{
+				executeBytecode = false;
+				break;
+			}
+			LoadFrame();
+			stackIdx = retIdx + retSlots;
+			codeIdx = frames.back().codeIdx;
 			break;
+		}
 
 		case 0xb2: // getstatic
+		case 0xb3: // putstatic
 		{
-			u32 fieldRef = (Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2];
-			u16 cls = ConstantPool[fieldRef].val.f2.v1;
-			u16 nat = ConstantPool[fieldRef].val.f2.v2;
-			u16 fieldNameRef = ConstantPool[nat].val.f2.v1;
-			u16 fieldTypeRef = ConstantPool[nat].val.f2.v2;
-			auto& fieldName = vmres.vm.GetInternedString(ConstantPool[fieldNameRef].val.f5.idx);
-			auto& typeName = vmres.vm.GetInternedString(ConstantPool[fieldTypeRef].val.f5.idx);
-			JType type = DecodeType(vmres.vm, typeName);
-
-			if (cls != vmcont.jclass.cf.this_class)
-				assert(0); // 
-
-			bool found = false;
-			for (auto& fld : vmcont.jclass.staticFields)
+			JMember* field = detail::ResolveStaticField(vmres.vm, *jclass, insn.a);
+			if (!field)
 			{
-				if (fld.name == fieldName
-					&& fld.type.aryDim == type.aryDim
-					&& fld.type.type == type.type)
-				{
-					memcpy(&stack[stackIdx++] ,&fld.obj.val.i, 4); // TODO: long/double^ł64bit
-					found = true;
-					break;
-				}
+				cout << "Error: static field not found" << endl;
+				assert(0); // throw NoSuchFieldError
 			}
-			if (!found)
-				assert(0); // Throw java.lang.NoSuchFieldException
-
-			codeIdx += 3;
+			const u32 slots = GetSlotSize(field->type);
+			if (mnemonic == 0xb2)
+			{
+				memcpy(&stack[stackIdx], &field->obj.val, 4 * slots);
+				stackIdx += slots;
+			}
+			else
+			{
+				stackIdx -= slots;
+				memcpy(&field->obj.val, &stack[stackIdx], 4 * slots);
+			}
+			codeIdx++;
 			break;
 		}
 
-		case 0xb3: // putstatic
+		case 0xbb: // new
 		{
-			u32 fieldRef = (Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2];
-			u16 cls = ConstantPool[fieldRef].val.f2.v1;
-			u16 nat = ConstantPool[fieldRef].val.f2.v2;
-			u16 fieldNameRef = ConstantPool[nat].val.f2.v1;
-			u16 fieldTypeRef = ConstantPool[nat].val.f2.v2;
-			auto& fieldName = vmres.vm.GetInternedString(ConstantPool[fieldNameRef].val.f5.idx);
-			auto& typeName = vmres.vm.GetInternedString(ConstantPool[fieldTypeRef].val.f5.idx);
-			JType type = DecodeType(vmres.vm, typeName);
-
-			if (cls != vmcont.jclass.cf.this_class)
-				assert(0); // 
-
-			bool found = false;
-			for (auto& fld : vmcont.jclass.staticFields)
+			JClass* clazz = detail::ResolveClass(vmres.vm, *jclass, insn.a);
+			if (!clazz)
 			{
-				if (fld.name == fieldName
-					&& fld.type.aryDim == type.aryDim
-					&& fld.type.type == type.type)
-				{
-					memcpy(&fld.obj.val.i, &stack[--stackIdx], 4); // TODO: long/double^ł64bit
-					found = true;
-					break;
-				}
+				cout << "Error: class not found" << endl;
+				assert(0); // throw NoClassDefFoundError
 			}
-			if (!found)
-				assert(0); // Throw java.lang.NoSuchFieldException
+			if (clazz->state != ClassState::Initialized)
+				vmres.vm.InitializeClass(*clazz);
+			MarkAllocationSite();
+			stack[stackIdx++] = StackObjectToValue(vmres.vm.NewInstance(*clazz));
+			codeIdx++;
+			break;
+		}
 
-			codeIdx += 3;
+		case 0xb4: // getfield
+		case 0xb5: // putfield
+		{
+			// Fields of classes loaded after the method was decoded
+			const JField* field = detail::ResolveField(vmres.vm, *jclass, insn.a);
+			if (!field)
+			{
+				cout << "Error: field not found" << endl;
+				assert(0); // throw NoSuchFieldError
+			}
+			u32 slots = (field->size == 8) ? 2 : 1;
+			JObject* obj = GetInstanceOf(stack[stackIdx - ((mnemonic == 0xb4) ? 1 : slots + 1)], *field);
+			if (!obj)
+				break;
+			u8* p = obj->data.get() + field->offset;
+			if (mnemonic == 0xb4)
+			{
+				LoadField(p, field->type, &stack[stackIdx - 1]);
+				stackIdx += slots - 1;
+			}
+			else
+			{
+				StoreField(p, field->type, &stack[stackIdx - slots]);
+				stackIdx -= slots + 1;
+			}
+			codeIdx++;
 			break;
 		}
 
@@ -447,7 +1212,7 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			s32 sz = static_cast<s32>(stack[stackIdx - 1]);
 			if (sz < 0)
 				assert(0); // TODO: throw Java.lang.NegativeArraySizeException
-			u32 type = Code.code[codeIdx + 1];
+			u32 type = insn.a;
 			PrimitiveType ptype = PrimitiveType::Boolean;
 			switch (type)
 			{
@@ -461,75 +1226,236 @@ void jvm::execute(const detail::VMContext& vmcont, detail::VMResource& vmres) no
 			case 11: ptype = PrimitiveType::Long; break;
 			default: assert(0);
 			}
+			MarkAllocationSite();
 			auto& ary = vmres.vm.NewPrimitiveArray(ptype, sz);
 			stack[stackIdx - 1] = StackObjectToValue(ary);
-			codeIdx += 2;
+			codeIdx++;
 			break;
 		}
 
+		case 0xbd: // anewarray
+		{
+			s32 sz = static_cast<s32>(stack[stackIdx - 1]);
+			if (sz < 0)
+				assert(0); // TODO: throw Java.lang.NegativeArraySizeException
+			const JClass* elementClass = detail::ResolveClass(vmres.vm, *jclass, insn.a);
+			MarkAllocationSite();
+			auto& ary = vmres.vm.NewReferenceArray(elementClass, sz);
+			stack[stackIdx - 1] = StackObjectToValue(ary);
+			codeIdx++;
+			break;
+		}
+
+		case 0xbe: // arraylength
+			stack[stackIdx - 1] = GetArray(stack[stackIdx - 1]).length;
+			codeIdx++;
+			break;
+
 		case 0xb8: // invokestatic
+		case 0xb7: // invokespecial
+		case 0xb6: // invokevirtual
+		case 0xb9: // invokeinterface
 		{
-			u32 methodRef = (Code.code[codeIdx + 1] << 8) + Code.code[codeIdx + 2];
-			u16 cls = ConstantPool[methodRef].val.f2.v1;
-			u16 clazz = ConstantPool[cls].val.f1.v;
-			u16 nat = ConstantPool[methodRef].val.f2.v2;
-			u16 name = ConstantPool[nat].val.f2.v1;
-			u16 type = ConstantPool[nat].val.f2.v2;
-			wstring& clsName = vmres.stringPool[ConstantPool[clazz].val.f5.idx];
-			wstring& methodName = vmres.stringPool[ConstantPool[name].val.f5.idx];
-			wstring& typeName = vmres.stringPool[ConstantPool[type].val.f5.idx];
-			// Special function
-			if (clsName == L"Main" && methodName == L"output" && typeName == L"(I)V")
+			const detail::ResolvedMethod* target = nullptr;
+			u32 argIdx = 0;
+			if (mnemonic == 0xb8 || mnemonic == 0xb7)
 			{
-				cout << "Main.output(int) : " << stack[stackIdx - 1] << endl;
-				stackIdx--;
-				codeIdx += 3;
-				break;
+				target = detail::ResolveMethod(vmres.vm, *jclass, insn.a, mnemonic == 0xb7);
+				if (!target)
+				{
+					cout << "Error: method not found" << endl;
+					assert(0); // throw NoSuchMethodError
+				}
+
+				argIdx = stackIdx - target->argSlots;
+				if (mnemonic == 0xb7 && stack[argIdx] == 0)
+					assert(0); // throw NullPointerException
+				if (mnemonic == 0xb8 && target->owner && target->owner->state != ClassState::Initialized)
+					vmres.vm.InitializeClass(*target->owner);
 			}
-			u16 thisCls = ConstantPool[vmcont.jclass.cf.this_class].val.f1.v;
-			if (thisCls == clazz)
+			else
 			{
-				s32 callNat = -1;
-				for (int i = 0; i < vmcont.jclass.cf.methods_count; i++)
+				auto& site = Decoded->callSites[insn.b];
+				if (site.kind == detail::CallSite::Kind::Unresolved && !detail::ResolveCallSite(vmres.vm, *jclass, insn.a, site))
 				{
-					auto& m = vmcont.jclass.cf.methods[i];
-					u16 n = m.name_index;
-					u16 d = m.descriptor_index;
-					if (n == name && d == type)
-					{
-						callNat = i;
-						break;
-					}
+					cout << "Error: method not found" << endl;
+					assert(0); // throw NoSuchMethodError
 				}
-				if (callNat == -1)
-					assert(0); // throw NoSuchMethodException
 
-				auto& m = vmcont.jclass.cf.methods[callNat];
-				u32 numArgs = m.signature.args.size(); // TODO: longdoublêƂ2{
+				argIdx = stackIdx - site.argSlots;
+				JObject& receiver = GetInstance(stack[argIdx]);
 
-				auto context = detail::VMContext {
-					vmcont.jclass,
-					m,
-					numArgs,
-					stackIdx
-				};
-				execute(context, vmres);
+				// String native, devirtualized or monomorphic fast path, then the rest of the inline cache
+				target = site.direct ? site.direct
+					: (site.count > 0 && site.cache[0].receiver == receiver.clazz) ? site.cache[0].target
+					: detail::Dispatch(site, receiver);
+				if (!target)
+				{
+					cout << "Error: invokevirtual" << endl;
+					assert(0); // throw IncompatibleClassChangeError
+				}
+			}
 
-				bool isRetTypeVoid = (m.signature.ret.type == PrimitiveType::Void);
-				stackIdx = stackIdx - numArgs + (isRetTypeVoid ? 0 : 1);
+			if (target->intrinsic)
+			{
+				u32 ret[2] = {};
+				MarkAllocationSite(); // String methods may return new strings
+				frames.back().codeIdx = codeIdx; // compiled methods poll for safepoints
+				target->intrinsic(vmres.vm, &stack[argIdx], ret);
+				for (u32 i = 0; i < target->retSlots; i++)
+					stack[argIdx + i] = ret[i];
+				stackIdx = argIdx + target->retSlots;
+				codeIdx++;
+				break;
 			}
-			else
+			if (!target->method->code)
 			{
-				cout << "Error: invokestatic" << endl;
-				assert(0);
+				cout << "Error: method has no code" << endl;
+				assert(0); // throw AbstractMethodError / UnsatisfiedLinkError
 			}
-			codeIdx += 3;
+
+			// The callee's locals begin with the arguments
+			frames.back().codeIdx = codeIdx + 1;
+			frames.push_back({ target->owner, target->method, nullptr, argIdx, 0 });
+			if (!EnterFrame())
+			{
+				frames.erase(frames.begin() + EntryDepth, frames.end());
+				executeBytecode = false;
+				break;
+			}
+			stackIdx = localIdx + MaxLocals;
+			codeIdx = 0;
+			break;
+		}
+
+		case 0xc0: // checkcast
+		case 0xc1: // instanceof
+		{
+			u32 ref = stack[stackIdx - 1];
+			bool isInstance = (ref != 0) && detail::IsInstanceOf(vmres.vm, *jclass, vmres.vm.GetObject(ref), insn.a);
+			if (mnemonic == 0xc1)
+				stack[stackIdx - 1] = isInstance ? 1 : 0;
+			else if (ref != 0 && !isInstance)
+				assert(0); // throw ClassCastException
+			codeIdx++;
+			break;
+		}
+
+		case 0xbf: // athrow
+			// Only ArithmeticException is raised and caught, see idiv
+			cout << "Error: athrow is not supported" << endl;
+			assert(0); // TODO: search the handlers of the frames
+			frames.erase(frames.begin() + EntryDepth, frames.end()); // uncaught, back to the host
+			executeBytecode = false;
+			break;
+
+		case 0xc2: // monitorenter
+		case 0xc3: // monitorexit
+			// Only the thread running the VM executes Java code, so monitors are never contended
+			if (stack[stackIdx - 1] == 0)
+				assert(0); // throw NullPointerException
+			stackIdx--;
+			codeIdx++;
+			break;
+
+		case detail::OpLoopKernel:
+			codeIdx = detail::RunLoopKernel(vmres.vm, Decoded->loops[insn.a], &stack[localIdx], codeIdx + 1);
+			break;
+		case detail::OpLoopGuard:
+			codeIdx = detail::RunLoopGuard(vmres.vm, Decoded->guards[insn.a], &stack[localIdx], codeIdx + 1);
+			break;
+		case detail::OpGetFieldByte:
+		case detail::OpGetFieldChar:
+		case detail::OpGetFieldShort:
+		case detail::OpGetField32:
+		case detail::OpGetField64:
+		{
+			// b is the Fieldref, resolved when the code was decoded
+			JObject* obj = GetInstanceOf(stack[stackIdx - 1], *jclass->resolvedFields[insn.b]);
+			if (!obj)
+				break;
+			const u8* p = obj->data.get() + insn.a;
+			switch (mnemonic)
+			{
+			case detail::OpGetFieldByte:
+				stack[stackIdx - 1] = static_cast<s32>(static_cast<s8>(*p));
+				break;
+			case detail::OpGetFieldChar:
+			case detail::OpGetFieldShort:
+			{
+				u16 v;
+				memcpy(&v, p, 2);
+				stack[stackIdx - 1] = (mnemonic == detail::OpGetFieldChar) ? static_cast<u32>(v) : static_cast<s32>(static_cast<s16>(v));
+				break;
+			}
+			case detail::OpGetField32:
+				memcpy(&stack[stackIdx - 1], p, 4);
+				break;
+			default:
+				memcpy(&stack[stackIdx - 1], p, 8);
+				stackIdx++;
+				break;
+			}
+			codeIdx++;
+			break;
+		}
+		case detail::OpPutField8:
+		case detail::OpPutField16:
+		case detail::OpPutField32:
+		case detail::OpPutField64:
+		{
+			const u32 slots = (mnemonic == detail::OpPutField64) ? 2 : 1;
+			JObject* obj = GetInstanceOf(stack[stackIdx - slots - 1], *jclass->resolvedFields[insn.b]);
+			if (!obj)
+				break;
+			u8* p = obj->data.get() + insn.a;
+			switch (mnemonic)
+			{
+			case detail::OpPutField8:
+				*p = static_cast<u8>(stack[stackIdx - 1]);
+				break;
+			case detail::OpPutField16:
+			{
+				u16 v = static_cast<u16>(stack[stackIdx - 1]);
+				memcpy(p, &v, 2);
+				break;
+			}
+			case detail::OpPutField32:
+				memcpy(p, &stack[stackIdx - 1], 4);
+				break;
+			default:
+				memcpy(p, &stack[stackIdx - 2], 8);
+				break;
+			}
+			stackIdx -= slots + 1;
+			codeIdx++;
+			break;
+		}
+		case detail::OpIALoadUnchecked:
+		{
+			JObject& aryref = StackValueToObject(vmres.vm, stack[stackIdx - 2]);
+			s32 idx = static_cast<s32>(stack[stackIdx - 1]);
+			memcpy(&stack[stackIdx - 2], aryref.data.get() + 4 * idx, 4);
+			stackIdx--;
+			codeIdx++;
+			break;
+		}
+		case detail::OpIAStoreUnchecked:
+		{
+			JObject& aryref = StackValueToObject(vmres.vm, stack[stackIdx - 3]);
+			s32 idx = static_cast<s32>(stack[stackIdx - 2]);
+			memcpy(aryref.data.get() + 4 * idx, &stack[stackIdx - 1], 4);
+			stackIdx -= 3;
+			codeIdx++;
 			break;
 		}
 
 		default:
-			cout << "Error: unknown mnemonic : 0x" << hex << static_cast<int>(mnemonic) << endl;
-			assert(0);
+			cout << "Error: unknown mnemonic : 0x" << hex << static_cast<int>(mnemonic) << dec << endl;
+			assert(0); // throw VerifyError
+			frames.erase(frames.begin() + EntryDepth, frames.end()); // not catchable, back to the host
+			executeBytecode = false;
+			break;
 		}
 	}
 }
@@ -0,0 +1,190 @@
+#include "jvmDecode.h"
+#include "jvmClass.h"
+#include "jvmObject.h"
+#include <algorithm>
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+// Inlining of small static methods.
+//
+// "invokestatic m" is replaced by the body of m when m is static, within the inline budget,
+// not recursive and has no exception handlers. Methods of other classes are inlined only if
+// they do not refer to their constant pool. The arguments are stored into locals placed after
+// the caller's max_locals, and the returns of m jump past the inlined body with the return
+// value left on the operand stack. Calls made by m are not inlined further.
+
+const char jvm::detail::InlineBuildStamp[] = __DATE__ " " __TIME__;
+
+namespace
+{
+	bool UsesConstantPool(u16 op)
+	{
+		return (0x12 <= op && op <= 0x14) // ldc, ldc_w, ldc2_w
+			|| (0xb2 <= op && op <= 0xbb) // field access, invoke, new
+			|| op == 0xbd || op == 0xc0 || op == 0xc1 || op == 0xc5; // anewarray, checkcast, instanceof, multianewarray
+	}
+
+	bool IsReturn(u16 op)
+	{
+		return 0xac <= op && op <= 0xb1;
+	}
+
+	bool HasLocalOperand(u16 op)
+	{
+		return (0x15 <= op && op <= 0x19) || (0x36 <= op && op <= 0x3a) || op == 0x84; // xload, xstore, iinc
+	}
+
+	u16 StoreOp(const JType& t)
+	{
+		if (t.aryDim > 0 || t.type == PrimitiveType::Class)
+			return 0x3a; // astore
+		switch (t.type)
+		{
+		case PrimitiveType::Long: return 0x37;
+		case PrimitiveType::Float: return 0x38;
+		case PrimitiveType::Double: return 0x39;
+		default: return 0x36;
+		}
+	}
+
+	bool IsCalleeClassLoaded(VM& vm, JClass& jclass, u16 methodRef)
+	{
+		const auto& cp = jclass.cf.constant_pool;
+		return vm.FindClass(cp[cp[cp[methodRef].val.f2.v1].val.f1.v].val.f5.idx) != nullptr;
+	}
+
+	// Builds the instructions replacing a call of callee. Branch targets are relative to the body.
+	bool BuildInlineBody(VM& vm, JClass& jclass, const CFMethod& caller, const ResolvedMethod& callee,
+		u16 pc, u32 base, vector<Insn>& body)
+	{
+		const CFMethod& m = *callee.method;
+		if (callee.owner != &jclass && callee.owner->state != ClassState::Initialized)
+			return false;
+		if (&m == &caller || !m.code || m.code->code_length > vm.GetInlineBudget() || !m.code->exception_table.empty()
+			|| (m.access_flags & 0x0020)) // ACC_SYNCHRONIZED
+			return false;
+
+		auto decoded = Decode(*m.code);
+		if (!decoded)
+			return false;
+		const auto& src = decoded->insns;
+		const bool sameClass = (callee.owner == &jclass);
+		for (auto& insn : src)
+		{
+			if (!sameClass && UsesConstantPool(insn.op))
+				return false;
+			if (insn.op == 0xbf || insn.op == 0xaa || insn.op == 0xab) // athrow, switches
+				return false;
+			if (insn.op == 0xb8)
+			{
+				const ResolvedMethod* r = ResolveMethod(vm, jclass, static_cast<u16>(insn.a), false);
+				if (r && r->method == &m)
+					return false; // recursive
+			}
+		}
+
+		// Returns must leave nothing but the return value on the stack
+		vector<s32> depth;
+		if (!ComputeStackDepths(vm, callee.owner->cf, *decoded, depth))
+			return false;
+		for (u32 k = 0; k < src.size(); k++)
+		{
+			if (IsReturn(src[k].op) && depth[k] >= 0 && static_cast<u32>(depth[k]) != callee.retSlots)
+				return false;
+		}
+
+		// Arguments, the last one is on the top of the stack
+		const auto& args = m.signature.args;
+		u32 slot = GetArgSlotSize(m.signature);
+		for (size_t i = args.size(); i-- > 0;)
+		{
+			slot -= GetSlotSize(args[i]);
+			body.push_back({ StoreOp(args[i]), pc, static_cast<s32>(base + slot), 0 });
+		}
+
+		// A return at the end falls through to the code after the call
+		const u32 first = static_cast<u32>(body.size());
+		const u32 count = static_cast<u32>(src.size()) - (IsReturn(src.back().op) ? 1 : 0);
+		for (u32 k = 0; k < count; k++)
+		{
+			Insn insn = src[k];
+			insn.pc = pc;
+			insn.op = GenericLocalOp(insn.op);
+			if (HasLocalOperand(insn.op))
+				insn.a += static_cast<s32>(base);
+			if (IsReturn(insn.op))
+			{
+				insn.op = 0xa7; // goto
+				insn.a = static_cast<s32>(first + count);
+			}
+			else if (IsBranch(insn.op))
+				insn.a += static_cast<s32>(first);
+			body.push_back(insn);
+		}
+		return true;
+	}
+}
+
+void jvm::detail::InlineStaticCalls(VM& vm, JClass& jclass, const CFMethod& method, DecodedCode& code)
+{
+	if (vm.GetInlineBudget() == 0)
+		return;
+
+	const u32 base = method.code->max_locals;
+	vector<Insn> insns;
+	vector<u32> map(code.insns.size() + 1);
+	vector<bool> fromBody; // branch targets of inlined bodies are final already
+	bool changed = false;
+
+	for (u32 k = 0; k < code.insns.size(); k++)
+	{
+		const Insn& insn = code.insns[k];
+		map[k] = static_cast<u32>(insns.size());
+
+		vector<Insn> body;
+		// Calls into classes not loaded or initialized yet stay calls, they load and initialize the class
+		const ResolvedMethod* callee = (insn.op == 0xb8 && IsCalleeClassLoaded(vm, jclass, static_cast<u16>(insn.a)))
+			? ResolveMethod(vm, jclass, static_cast<u16>(insn.a), false) : nullptr;
+		if (callee && callee->method && BuildInlineBody(vm, jclass, method, *callee, insn.pc, base, body))
+		{
+			const u32 at = static_cast<u32>(insns.size());
+			for (auto& i : body)
+			{
+				if (IsBranch(i.op))
+					i.a += static_cast<s32>(at);
+				if (i.op == 0xb6 || i.op == 0xb9) // call sites of the caller
+				{
+					i.b = static_cast<s32>(code.callSites.size());
+					code.callSites.emplace_back();
+				}
+				insns.push_back(i);
+				fromBody.push_back(true);
+			}
+			const CFCode& cc = *callee->method->code;
+			code.extraLocals = max(code.extraLocals, cc.max_locals);
+			code.extraStack = max(code.extraStack, cc.max_stack);
+			changed = true;
+		}
+		else
+		{
+			insns.push_back(insn);
+			fromBody.push_back(false);
+		}
+	}
+	if (!changed)
+		return;
+	map[code.insns.size()] = static_cast<u32>(insns.size());
+
+	for (u32 k = 0; k < insns.size(); k++)
+	{
+		Insn& insn = insns[k];
+		if (!fromBody[k] && (IsBranch(insn.op) || insn.op == 0xa8 || insn.op == 0xc9))
+			insn.a = static_cast<s32>(map[insn.a]);
+	}
+	for (auto& h : code.handlerInsn)
+		h = map[h];
+	ForEachSwitchTarget(code, [&](u32& target) { target = map[target]; });
+	code.insns = move(insns);
+}
@@ -0,0 +1,434 @@
+#include "jvmIntrinsic.h"
+#include "jvmString.h"
+#include "jvmKernel.h"
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define JVM_INTRINSIC_SSE2
+#endif
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+namespace
+{
+	//---------- Array kernels ----------//
+
+	JObject& GetArray(VM& vm, u32 ref)
+	{
+		if (ref == 0)
+			assert(0); // throw NullPointerException
+		JObject& ary = vm.GetObject(ref);
+		if (ary.kind != ObjectKind::Array)
+			assert(0); // throw ArrayStoreException
+		return ary;
+	}
+
+	void CheckRange(const JObject& ary, s32 from, s32 to)
+	{
+		if (from < 0 || to < from || ary.length < to)
+			assert(0); // throw ArrayIndexOutOfBoundsException
+	}
+
+	// Arrays.equals() compares floating point elements by floatToIntBits()/doubleToLongBits(),
+	// so raw bits are compared except that every NaN is equal to every other NaN.
+	bool EqualsKernel(const JObject& a, const JObject& b)
+	{
+		size_t bytes = GetPrimitiveSize(a.type) * a.length;
+		if (memcmp(a.data.get(), b.data.get(), bytes) == 0)
+			return true;
+
+		if (a.type == PrimitiveType::Float)
+		{
+			for (s32 i = 0; i < a.length; i++)
+			{
+				f32 x, y;
+				memcpy(&x, a.data.get() + 4 * i, 4);
+				memcpy(&y, b.data.get() + 4 * i, 4);
+				if (memcmp(&x, &y, 4) != 0 && !(x != x && y != y))
+					return false;
+			}
+			return true;
+		}
+		if (a.type == PrimitiveType::Double)
+		{
+			for (s32 i = 0; i < a.length; i++)
+			{
+				f64 x, y;
+				memcpy(&x, a.data.get() + 8 * i, 8);
+				memcpy(&y, b.data.get() + 8 * i, 8);
+				if (memcmp(&x, &y, 8) != 0 && !(x != x && y != y))
+					return false;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	//---------- java.lang.System ----------//
+
+	// arraycopy(Ljava/lang/Object;ILjava/lang/Object;II)V
+	void System_arraycopy(VM& vm, const u32* args, u32*)
+	{
+		JObject& src = GetArray(vm, args[0]);
+		s32 srcPos = static_cast<s32>(args[1]);
+		JObject& dst = GetArray(vm, args[2]);
+		s32 dstPos = static_cast<s32>(args[3]);
+		s32 length = static_cast<s32>(args[4]);
+
+		if (src.type != dst.type)
+			assert(0); // throw ArrayStoreException
+		if (length < 0 || srcPos < 0 || dstPos < 0
+			|| src.length - length < srcPos || dst.length - length < dstPos)
+			assert(0); // throw ArrayIndexOutOfBoundsException
+
+		size_t elemSize = GetPrimitiveSize(src.type);
+		memmove(dst.data.get() + elemSize * dstPos, src.data.get() + elemSize * srcPos, elemSize * length);
+	}
+
+	//---------- java.util.Arrays ----------//
+
+	template<u32 ValueSlots>
+	u64 ReadFillValue(const JObject& ary, const u32* v)
+	{
+		u64 value = 0;
+		if (ValueSlots == 2)
+			memcpy(&value, v, 8);
+		else
+			value = v[0];
+		if (ary.type == PrimitiveType::Boolean)
+			value = value ? 1 : 0;
+		return value;
+	}
+
+	// fill([XX)V
+	template<u32 ValueSlots>
+	void Arrays_fill(VM& vm, const u32* args, u32*)
+	{
+		JObject& ary = GetArray(vm, args[0]);
+		FillKernel(ary.data.get(), ary.length, GetPrimitiveSize(ary.type), ReadFillValue<ValueSlots>(ary, &args[1]));
+	}
+
+	// fill([XIIX)V
+	template<u32 ValueSlots>
+	void Arrays_fillRange(VM& vm, const u32* args, u32*)
+	{
+		JObject& ary = GetArray(vm, args[0]);
+		s32 from = static_cast<s32>(args[1]);
+		s32 to = static_cast<s32>(args[2]);
+		CheckRange(ary, from, to);
+		size_t elemSize = GetPrimitiveSize(ary.type);
+		FillKernel(ary.data.get() + elemSize * from, to - from, elemSize, ReadFillValue<ValueSlots>(ary, &args[3]));
+	}
+
+	// equals([X[X)Z
+	void Arrays_equals(VM& vm, const u32* args, u32* ret)
+	{
+		if (args[0] == args[1])
+		{
+			ret[0] = 1;
+			return;
+		}
+		if (args[0] == 0 || args[1] == 0)
+		{
+			ret[0] = 0;
+			return;
+		}
+		JObject& a = GetArray(vm, args[0]);
+		JObject& b = GetArray(vm, args[1]);
+		ret[0] = (a.length == b.length && EqualsKernel(a, b)) ? 1 : 0;
+	}
+
+	//---------- java.lang.Math / Integer / Long ----------//
+
+	inline s32 ArgI(const u32* args, int slot) { return static_cast<s32>(args[slot]); }
+	inline s64 ArgJ(const u32* args, int slot) { s64 v; memcpy(&v, &args[slot], 8); return v; }
+	inline f32 ArgF(const u32* args, int slot) { f32 v; memcpy(&v, &args[slot], 4); return v; }
+	inline f64 ArgD(const u32* args, int slot) { f64 v; memcpy(&v, &args[slot], 8); return v; }
+	inline void RetI(u32* ret, s32 v) { ret[0] = static_cast<u32>(v); }
+	inline void RetJ(u32* ret, s64 v) { memcpy(ret, &v, 8); }
+	inline void RetF(u32* ret, f32 v) { memcpy(ret, &v, 4); }
+	inline void RetD(u32* ret, f64 v) { memcpy(ret, &v, 8); }
+
+	// Bit operations compile to popcnt/lzcnt/tzcnt when the target has them
+	inline s32 PopCount32(u32 v)
+	{
+#if defined(_MSC_VER)
+		return static_cast<s32>(__popcnt(v));
+#else
+		return __builtin_popcount(v);
+#endif
+	}
+
+	inline s32 PopCount64(u64 v)
+	{
+#if defined(_MSC_VER)
+		return static_cast<s32>(__popcnt64(v));
+#else
+		return __builtin_popcountll(v);
+#endif
+	}
+
+	inline s32 LeadingZeros32(u32 v)
+	{
+		if (v == 0)
+			return 32;
+#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanReverse(&idx, v);
+		return 31 - static_cast<s32>(idx);
+#else
+		return __builtin_clz(v);
+#endif
+	}
+
+	inline s32 LeadingZeros64(u64 v)
+	{
+		if (v == 0)
+			return 64;
+#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanReverse64(&idx, v);
+		return 63 - static_cast<s32>(idx);
+#else
+		return __builtin_clzll(v);
+#endif
+	}
+
+	inline s32 TrailingZeros32(u32 v)
+	{
+		if (v == 0)
+			return 32;
+#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanForward(&idx, v);
+		return static_cast<s32>(idx);
+#else
+		return __builtin_ctz(v);
+#endif
+	}
+
+	inline s32 TrailingZeros64(u64 v)
+	{
+		if (v == 0)
+			return 64;
+#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanForward64(&idx, v);
+		return static_cast<s32>(idx);
+#else
+		return __builtin_ctzll(v);
+#endif
+	}
+
+	inline f64 Sqrt(f64 v)
+	{
+#if defined(JVM_INTRINSIC_SSE2)
+		__m128d x = _mm_set_sd(v);
+		return _mm_cvtsd_f64(_mm_sqrt_sd(x, x));
+#else
+		return sqrt(v);
+#endif
+	}
+
+	// Java's min/max propagate NaN and order -0.0 below +0.0
+	template<class T>
+	T FloatMin(T a, T b)
+	{
+		if (a != a)
+			return a;
+		if (a == 0 && b == 0)
+			return signbit(a) ? a : b;
+		return (a <= b) ? a : b;
+	}
+
+	template<class T>
+	T FloatMax(T a, T b)
+	{
+		if (a != a)
+			return a;
+		if (a == 0 && b == 0)
+			return signbit(a) ? b : a;
+		return (a >= b) ? a : b;
+	}
+
+	// Integer overflow wraps around as in Java
+	template<class T, class U>
+	T FloorDiv(T x, T y)
+	{
+		if (y == 0)
+			assert(0); // throw ArithmeticException
+		if (y == -1)
+			return static_cast<T>(U(0) - static_cast<U>(x));
+		T q = x / y;
+		if ((x % y != 0) && ((x < 0) != (y < 0)))
+			q--;
+		return q;
+	}
+
+	template<class T>
+	T FloorMod(T x, T y)
+	{
+		if (y == 0)
+			assert(0); // throw ArithmeticException
+		if (y == -1)
+			return 0;
+		T m = x % y;
+		if (m != 0 && ((m < 0) != (y < 0)))
+			m += y;
+		return m;
+	}
+
+	void Math_absI(VM&, const u32* a, u32* r) { s32 v = ArgI(a, 0); RetI(r, v < 0 ? static_cast<s32>(0u - static_cast<u32>(v)) : v); }
+	void Math_absJ(VM&, const u32* a, u32* r) { s64 v = ArgJ(a, 0); RetJ(r, v < 0 ? static_cast<s64>(0ull - static_cast<u64>(v)) : v); }
+	void Math_absF(VM&, const u32* a, u32* r) { r[0] = a[0] & 0x7FFFFFFF; }
+	void Math_absD(VM&, const u32* a, u32* r) { r[0] = a[0]; r[1] = a[1] & 0x7FFFFFFF; }
+	void Math_minI(VM&, const u32* a, u32* r) { RetI(r, min(ArgI(a, 0), ArgI(a, 1))); }
+	void Math_minJ(VM&, const u32* a, u32* r) { RetJ(r, min(ArgJ(a, 0), ArgJ(a, 2))); }
+	void Math_minF(VM&, const u32* a, u32* r) { RetF(r, FloatMin(ArgF(a, 0), ArgF(a, 1))); }
+	void Math_minD(VM&, const u32* a, u32* r) { RetD(r, FloatMin(ArgD(a, 0), ArgD(a, 2))); }
+	void Math_maxI(VM&, const u32* a, u32* r) { RetI(r, max(ArgI(a, 0), ArgI(a, 1))); }
+	void Math_maxJ(VM&, const u32* a, u32* r) { RetJ(r, max(ArgJ(a, 0), ArgJ(a, 2))); }
+	void Math_maxF(VM&, const u32* a, u32* r) { RetF(r, FloatMax(ArgF(a, 0), ArgF(a, 1))); }
+	void Math_maxD(VM&, const u32* a, u32* r) { RetD(r, FloatMax(ArgD(a, 0), ArgD(a, 2))); }
+	void Math_sqrt(VM&, const u32* a, u32* r) { RetD(r, Sqrt(ArgD(a, 0))); }
+	void Math_floor(VM&, const u32* a, u32* r) { RetD(r, floor(ArgD(a, 0))); }
+	void Math_ceil(VM&, const u32* a, u32* r) { RetD(r, ceil(ArgD(a, 0))); }
+	void Math_rint(VM&, const u32* a, u32* r) { RetD(r, nearbyint(ArgD(a, 0))); }
+	void Math_floorDivI(VM&, const u32* a, u32* r) { RetI(r, FloorDiv<s32, u32>(ArgI(a, 0), ArgI(a, 1))); }
+	void Math_floorDivJ(VM&, const u32* a, u32* r) { RetJ(r, FloorDiv<s64, u64>(ArgJ(a, 0), ArgJ(a, 2))); }
+	void Math_floorModI(VM&, const u32* a, u32* r) { RetI(r, FloorMod(ArgI(a, 0), ArgI(a, 1))); }
+	void Math_floorModJ(VM&, const u32* a, u32* r) { RetJ(r, FloorMod(ArgJ(a, 0), ArgJ(a, 2))); }
+
+	void Integer_bitCount(VM&, const u32* a, u32* r) { RetI(r, PopCount32(a[0])); }
+	void Integer_numberOfLeadingZeros(VM&, const u32* a, u32* r) { RetI(r, LeadingZeros32(a[0])); }
+	void Integer_numberOfTrailingZeros(VM&, const u32* a, u32* r) { RetI(r, TrailingZeros32(a[0])); }
+	void Integer_rotateLeft(VM&, const u32* a, u32* r) { u32 s = a[1] & 31; r[0] = (a[0] << s) | (a[0] >> ((32 - s) & 31)); }
+	void Integer_rotateRight(VM&, const u32* a, u32* r) { u32 s = a[1] & 31; r[0] = (a[0] >> s) | (a[0] << ((32 - s) & 31)); }
+	void Integer_reverseBytes(VM&, const u32* a, u32* r) { u32 v = a[0]; revbits(v); r[0] = v; }
+	void Long_bitCount(VM&, const u32* a, u32* r) { RetI(r, PopCount64(static_cast<u64>(ArgJ(a, 0)))); }
+	void Long_numberOfLeadingZeros(VM&, const u32* a, u32* r) { RetI(r, LeadingZeros64(static_cast<u64>(ArgJ(a, 0)))); }
+	void Long_numberOfTrailingZeros(VM&, const u32* a, u32* r) { RetI(r, TrailingZeros64(static_cast<u64>(ArgJ(a, 0)))); }
+	void Long_rotateLeft(VM&, const u32* a, u32* r) { u64 v = ArgJ(a, 0); u32 s = a[2] & 63; RetJ(r, static_cast<s64>((v << s) | (v >> ((64 - s) & 63)))); }
+	void Long_rotateRight(VM&, const u32* a, u32* r) { u64 v = ArgJ(a, 0); u32 s = a[2] & 63; RetJ(r, static_cast<s64>((v >> s) | (v << ((64 - s) & 63)))); }
+	void Long_reverseBytes(VM&, const u32* a, u32* r) { u64 v = ArgJ(a, 0); revbits(v); RetJ(r, static_cast<s64>(v)); }
+
+	//---------- java.lang.Object ----------//
+
+	void Object_init(VM&, const u32*, u32*) {}
+
+	//---------- Natives of the sample classes ----------//
+
+	void Main_outputI(VM&, const u32* a, u32*)
+	{
+		cout << "Main.output(int) : " << ArgI(a, 0) << endl;
+	}
+
+	void Main_outputJ(VM&, const u32* a, u32*)
+	{
+		cout << "Main.output(long) : " << ArgJ(a, 0) << endl;
+	}
+
+	void Main_outputS(VM& vm, const u32* a, u32*)
+	{
+		cout << "Main.output(String) : " << (a[0] ? StringToUtf8(vm.GetObject(a[0])) : string("null")) << endl;
+	}
+
+	struct IntrinsicEntry
+	{
+		const wchar_t* clazz;
+		const wchar_t* name;
+		const wchar_t* desc;
+		IntrinsicFunc func;
+	};
+
+	const IntrinsicEntry IntrinsicTable[] =
+	{
+		{ L"java/lang/Object", L"<init>", L"()V", Object_init },
+		{ L"java/lang/System", L"arraycopy", L"(Ljava/lang/Object;ILjava/lang/Object;II)V", System_arraycopy },
+
+		{ L"java/util/Arrays", L"fill", L"([ZZ)V", Arrays_fill<1> },
+		{ L"java/util/Arrays", L"fill", L"([BB)V", Arrays_fill<1> },
+		{ L"java/util/Arrays", L"fill", L"([CC)V", Arrays_fill<1> },
+		{ L"java/util/Arrays", L"fill", L"([SS)V", Arrays_fill<1> },
+		{ L"java/util/Arrays", L"fill", L"([II)V", Arrays_fill<1> },
+		{ L"java/util/Arrays", L"fill", L"([FF)V", Arrays_fill<1> },
+		{ L"java/util/Arrays", L"fill", L"([JJ)V", Arrays_fill<2> },
+		{ L"java/util/Arrays", L"fill", L"([DD)V", Arrays_fill<2> },
+		{ L"java/util/Arrays", L"fill", L"([ZIIZ)V", Arrays_fillRange<1> },
+		{ L"java/util/Arrays", L"fill", L"([BIIB)V", Arrays_fillRange<1> },
+		{ L"java/util/Arrays", L"fill", L"([CIIC)V", Arrays_fillRange<1> },
+		{ L"java/util/Arrays", L"fill", L"([SIIS)V", Arrays_fillRange<1> },
+		{ L"java/util/Arrays", L"fill", L"([IIII)V", Arrays_fillRange<1> },
+		{ L"java/util/Arrays", L"fill", L"([FIIF)V", Arrays_fillRange<1> },
+		{ L"java/util/Arrays", L"fill", L"([JIIJ)V", Arrays_fillRange<2> },
+		{ L"java/util/Arrays", L"fill", L"([DIID)V", Arrays_fillRange<2> },
+
+		{ L"java/util/Arrays", L"equals", L"([Z[Z)Z", Arrays_equals },
+		{ L"java/util/Arrays", L"equals", L"([B[B)Z", Arrays_equals },
+		{ L"java/util/Arrays", L"equals", L"([C[C)Z", Arrays_equals },
+		{ L"java/util/Arrays", L"equals", L"([S[S)Z", Arrays_equals },
+		{ L"java/util/Arrays", L"equals", L"([I[I)Z", Arrays_equals },
+		{ L"java/util/Arrays", L"equals", L"([F[F)Z", Arrays_equals },
+		{ L"java/util/Arrays", L"equals", L"([J[J)Z", Arrays_equals },
+		{ L"java/util/Arrays", L"equals", L"([D[D)Z", Arrays_equals },
+
+		{ L"java/lang/Math", L"abs", L"(I)I", Math_absI },
+		{ L"java/lang/Math", L"abs", L"(J)J", Math_absJ },
+		{ L"java/lang/Math", L"abs", L"(F)F", Math_absF },
+		{ L"java/lang/Math", L"abs", L"(D)D", Math_absD },
+		{ L"java/lang/Math", L"min", L"(II)I", Math_minI },
+		{ L"java/lang/Math", L"min", L"(JJ)J", Math_minJ },
+		{ L"java/lang/Math", L"min", L"(FF)F", Math_minF },
+		{ L"java/lang/Math", L"min", L"(DD)D", Math_minD },
+		{ L"java/lang/Math", L"max", L"(II)I", Math_maxI },
+		{ L"java/lang/Math", L"max", L"(JJ)J", Math_maxJ },
+		{ L"java/lang/Math", L"max", L"(FF)F", Math_maxF },
+		{ L"java/lang/Math", L"max", L"(DD)D", Math_maxD },
+		{ L"java/lang/Math", L"sqrt", L"(D)D", Math_sqrt },
+		{ L"java/lang/StrictMath", L"sqrt", L"(D)D", Math_sqrt },
+		{ L"java/lang/Math", L"floor", L"(D)D", Math_floor },
+		{ L"java/lang/Math", L"ceil", L"(D)D", Math_ceil },
+		{ L"java/lang/Math", L"rint", L"(D)D", Math_rint },
+		{ L"java/lang/Math", L"floorDiv", L"(II)I", Math_floorDivI },
+		{ L"java/lang/Math", L"floorDiv", L"(JJ)J", Math_floorDivJ },
+		{ L"java/lang/Math", L"floorMod", L"(II)I", Math_floorModI },
+		{ L"java/lang/Math", L"floorMod", L"(JJ)J", Math_floorModJ },
+
+		{ L"java/lang/Integer", L"bitCount", L"(I)I", Integer_bitCount },
+		{ L"java/lang/Integer", L"numberOfLeadingZeros", L"(I)I", Integer_numberOfLeadingZeros },
+		{ L"java/lang/Integer", L"numberOfTrailingZeros", L"(I)I", Integer_numberOfTrailingZeros },
+		{ L"java/lang/Integer", L"rotateLeft", L"(II)I", Integer_rotateLeft },
+		{ L"java/lang/Integer", L"rotateRight", L"(II)I", Integer_rotateRight },
+		{ L"java/lang/Integer", L"reverseBytes", L"(I)I", Integer_reverseBytes },
+		{ L"java/lang/Long", L"bitCount", L"(J)I", Long_bitCount },
+		{ L"java/lang/Long", L"numberOfLeadingZeros", L"(J)I", Long_numberOfLeadingZeros },
+		{ L"java/lang/Long", L"numberOfTrailingZeros", L"(J)I", Long_numberOfTrailingZeros },
+		{ L"java/lang/Long", L"rotateLeft", L"(JI)J", Long_rotateLeft },
+		{ L"java/lang/Long", L"rotateRight", L"(JI)J", Long_rotateRight },
+		{ L"java/lang/Long", L"reverseBytes", L"(J)J", Long_reverseBytes },
+
+		{ L"Main", L"output", L"(I)V", Main_outputI },
+		{ L"Main", L"output", L"(J)V", Main_outputJ },
+		{ L"Main", L"output", L"(Ljava/lang/String;)V", Main_outputS },
+	};
+}
+
+IntrinsicFunc jvm::detail::FindIntrinsic(const wstring& clazz, const wstring& name, const wstring& desc)
+{
+	if (clazz == L"java/lang/String")
+		return FindStringMethod(name, desc); // String is not loaded as a class
+	for (auto& e : IntrinsicTable)
+	{
+		if (clazz == e.clazz && name == e.name && desc == e.desc)
+			return e.func;
+	}
+	return nullptr;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "jvm.h"
+
+namespace jvm
+{
+	namespace detail
+	{
+		// Looks up the intrinsic table, returns null if the method has no native replacement
+		IntrinsicFunc FindIntrinsic(const std::wstring& clazz, const std::wstring& name, const std::wstring& desc);
+	}
+}
@@ -0,0 +1,214 @@
+#include "jvmKernel.h"
+#include <cassert>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define JVM_KERNEL_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define JVM_KERNEL_AVX2
+#endif
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+namespace
+{
+	inline s32 ScalarOp(u16 op, s32 x, s32 y)
+	{
+		u32 a = static_cast<u32>(x);
+		u32 b = static_cast<u32>(y);
+		switch (op)
+		{
+		case 0x60: return static_cast<s32>(a + b); // iadd
+		case 0x64: return static_cast<s32>(a - b); // isub
+		case 0x68: return static_cast<s32>(a * b); // imul
+		case 0x7e: return static_cast<s32>(a & b); // iand
+		case 0x80: return static_cast<s32>(a | b); // ior
+		case 0x82: return static_cast<s32>(a ^ b); // ixor
+		default: assert(0); return 0;
+		}
+	}
+
+#if defined(JVM_KERNEL_SSE2)
+	inline __m128i MulLo32(__m128i a, __m128i b)
+	{
+		// SSE2 has no 32bit low multiply, combine two 32x32->64 multiplies
+		__m128i even = _mm_mul_epu32(a, b);
+		__m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+
+	inline __m128i VectorOp(u16 op, __m128i a, __m128i b)
+	{
+		switch (op)
+		{
+		case 0x60: return _mm_add_epi32(a, b);
+		case 0x64: return _mm_sub_epi32(a, b);
+		case 0x68: return MulLo32(a, b);
+		case 0x7e: return _mm_and_si128(a, b);
+		case 0x80: return _mm_or_si128(a, b);
+		default: return _mm_xor_si128(a, b);
+		}
+	}
+#endif
+
+#if defined(JVM_KERNEL_AVX2)
+	inline __m256i VectorOp(u16 op, __m256i a, __m256i b)
+	{
+		switch (op)
+		{
+		case 0x60: return _mm256_add_epi32(a, b);
+		case 0x64: return _mm256_sub_epi32(a, b);
+		case 0x68: return _mm256_mullo_epi32(a, b);
+		case 0x7e: return _mm256_and_si256(a, b);
+		case 0x80: return _mm256_or_si256(a, b);
+		default: return _mm256_xor_si256(a, b);
+		}
+	}
+#endif
+}
+
+void jvm::detail::FillKernel(u8* dst, size_t count, size_t elemSize, u64 value)
+{
+	if (elemSize == 1)
+	{
+		memset(dst, static_cast<int>(value & 0xFF), count);
+		return;
+	}
+
+	size_t bytes = count * elemSize;
+	size_t i = 0;
+#if defined(JVM_KERNEL_SSE2)
+	__m128i v;
+	switch (elemSize)
+	{
+	case 2: v = _mm_set1_epi16(static_cast<short>(value)); break;
+	case 4: v = _mm_set1_epi32(static_cast<int>(value)); break;
+	default: v = _mm_set1_epi64x(static_cast<long long>(value)); break;
+	}
+	for (; i + 64 <= bytes; i += 64)
+	{
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 16), v);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 32), v);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 48), v);
+	}
+	for (; i + 16 <= bytes; i += 16)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+#endif
+	for (; i < bytes; i += elemSize)
+		memcpy(dst + i, &value, elemSize);
+}
+
+s32 jvm::detail::ReduceIntKernel(const s32* src, size_t count, u16 op, s32 init)
+{
+	size_t i = 0;
+	s32 acc = init;
+#if defined(JVM_KERNEL_AVX2)
+	if (count >= 16)
+	{
+		__m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+		__m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 8));
+		for (i = 16; i + 16 <= count; i += 16)
+		{
+			v0 = VectorOp(op, v0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+			v1 = VectorOp(op, v1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 8)));
+		}
+		v0 = VectorOp(op, v0, v1);
+		alignas(32) s32 lanes[8];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v0);
+		for (s32 l : lanes)
+			acc = ScalarOp(op, acc, l);
+	}
+#elif defined(JVM_KERNEL_SSE2)
+	if (count >= 8)
+	{
+		__m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+		__m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4));
+		for (i = 8; i + 8 <= count; i += 8)
+		{
+			v0 = VectorOp(op, v0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+			v1 = VectorOp(op, v1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 4)));
+		}
+		v0 = VectorOp(op, v0, v1);
+		alignas(16) s32 lanes[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes), v0);
+		for (s32 l : lanes)
+			acc = ScalarOp(op, acc, l);
+	}
+#endif
+	for (; i < count; i++)
+		acc = ScalarOp(op, acc, src[i]);
+	return acc;
+}
+
+void jvm::detail::BinaryIntKernel(s32* dst, const s32* a, const s32* b, size_t count, u16 op)
+{
+	size_t i = 0;
+#if defined(JVM_KERNEL_AVX2)
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), VectorOp(op, x, y));
+	}
+#endif
+#if defined(JVM_KERNEL_SSE2)
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), VectorOp(op, x, y));
+	}
+#endif
+	for (; i < count; i++)
+		dst[i] = ScalarOp(op, a[i], b[i]);
+}
+
+size_t jvm::detail::FindIntKernel(const s32* src, size_t count, s32 value)
+{
+	size_t i = 0;
+#if defined(JVM_KERNEL_AVX2)
+	__m256i key8 = _mm256_set1_epi32(value);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key8)));
+		if (mask != 0)
+		{
+			while ((mask & 1) == 0)
+			{
+				mask >>= 1;
+				i++;
+			}
+			return i;
+		}
+	}
+#endif
+#if defined(JVM_KERNEL_SSE2)
+	__m128i key = _mm_set1_epi32(value);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+		if (mask != 0)
+		{
+			while ((mask & 1) == 0)
+			{
+				mask >>= 1;
+				i++;
+			}
+			return i;
+		}
+	}
+#endif
+	for (; i < count; i++)
+	{
+		if (src[i] == value)
+			return i;
+	}
+	return count;
+}
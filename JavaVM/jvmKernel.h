@@ -0,0 +1,25 @@
+#pragma once
+
+#include "jvm.h"
+
+namespace jvm
+{
+	namespace detail
+	{
+		// Vector kernels shared by the intrinsics and the loop idiom replacement.
+		// Integer arithmetic wraps around as in Java.
+
+		// Fills count elements of elemSize bytes with the pattern in value
+		void FillKernel(u8* dst, size_t count, size_t elemSize, u64 value);
+
+		// Reduces with iadd, iand, ior or ixor
+		s32 ReduceIntKernel(const s32* src, size_t count, u16 op, s32 init);
+
+		// dst[i] = a[i] OP b[i] with iadd, isub, imul, iand, ior or ixor.
+		// dst may be the same array as a or b.
+		void BinaryIntKernel(s32* dst, const s32* a, const s32* b, size_t count, u16 op);
+
+		// Index of the first element equal to value, count if not found
+		size_t FindIntKernel(const s32* src, size_t count, s32 value);
+	}
+}
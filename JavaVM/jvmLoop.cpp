@@ -0,0 +1,533 @@
+#include "jvmDecode.h"
+#include "jvmKernel.h"
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+// Loop idiom recognition.
+//
+// javac compiles "for (i = ...; i < n; i++) body" as
+//   L0: iload i; (iload n | aload a; arraylength | int constant); if_icmpge L1
+//       body
+//       iinc i 1
+//       goto L0
+//   L1:
+// When the body is one of the idioms below, an OpLoopKernel instruction is inserted
+// before L0. It runs the iterations whose array accesses are all in bounds in a vector
+// kernel and then falls through to the original loop, which finishes the remaining
+// iterations. Iterations that would throw are therefore always run by the interpreter.
+
+const char jvm::detail::LoopBuildStamp[] = __DATE__ " " __TIME__;
+
+namespace
+{
+	bool IsILoad(const Insn& i) { return i.op == 0x15 || (0x1a <= i.op && i.op <= 0x1d); }
+	bool IsALoad(const Insn& i) { return i.op == 0x19 || (0x2a <= i.op && i.op <= 0x2d); }
+	bool IsIStore(const Insn& i) { return i.op == 0x36 || (0x3b <= i.op && i.op <= 0x3e); }
+	bool IsIConst(const Insn& i) { return (0x02 <= i.op && i.op <= 0x08) || i.op == 0x10 || i.op == 0x11; }
+
+	// Bound of a LoopIdiom or LoopGuard, false if the array is null
+	template<class Loop>
+	bool GetBound(VM& vm, const Loop& loop, const u32* locals, s32& bound)
+	{
+		if (loop.boundIsConst)
+			bound = loop.boundConst;
+		else if (!loop.boundIsLength)
+			bound = static_cast<s32>(locals[loop.bound]);
+		else if (locals[loop.bound] == 0)
+			return false;
+		else
+			bound = vm.GetObject(locals[loop.bound]).length;
+		return true;
+	}
+
+	bool IsReduceOp(u16 op) { return op == 0x60 || op == 0x7e || op == 0x80 || op == 0x82; } // iadd, iand, ior, ixor
+	bool IsBinaryOp(u16 op) { return IsReduceOp(op) || op == 0x64 || op == 0x68; } // + isub, imul
+
+	// Loop invariant int operand: constant or local other than the induction variable
+	bool MatchValue(const Insn& i, u16 index, LoopIdiom& loop)
+	{
+		if (IsIConst(i))
+		{
+			loop.valueIsConst = true;
+			loop.value = i.a;
+			return true;
+		}
+		if (IsILoad(i) && i.a != index)
+		{
+			loop.valueIsConst = false;
+			loop.value = i.a;
+			return true;
+		}
+		return false;
+	}
+
+	// Matches "aload a; iload i; iaload" at p
+	bool MatchLoad(const Insn* p, u16 index, u16& ary)
+	{
+		if (IsALoad(p[0]) && IsILoad(p[1]) && p[1].a == index && p[2].op == 0x2e)
+		{
+			ary = static_cast<u16>(p[0].a);
+			return true;
+		}
+		return false;
+	}
+
+	bool MatchBody(const vector<Insn>& insns, u32 begin, u32 end, u32 incIdx, LoopIdiom& loop)
+	{
+		const Insn* p = &insns[begin];
+		const u32 len = end - begin;
+		const u16 i = loop.index;
+
+		// acc = acc OP a[i] / acc = a[i] OP acc
+		if (len == 6 && IsReduceOp(p[4].op) && IsIStore(p[5]))
+		{
+			u16 acc = static_cast<u16>(p[5].a);
+			u16 ary;
+			bool matched = (IsILoad(p[0]) && p[0].a == acc && MatchLoad(p + 1, i, ary))
+				|| (MatchLoad(p, i, ary) && IsILoad(p[3]) && p[3].a == acc);
+			if (matched && acc != i && !(acc == loop.bound && !loop.boundIsLength && !loop.boundIsConst))
+			{
+				loop.kind = LoopIdiom::Kind::Reduce;
+				loop.op = p[4].op;
+				loop.acc = acc;
+				loop.src1 = ary;
+				return true;
+			}
+		}
+
+		// dst[i] = value
+		if (len == 4 && IsALoad(p[0]) && IsILoad(p[1]) && p[1].a == i && p[3].op == 0x4f
+			&& MatchValue(p[2], i, loop))
+		{
+			loop.kind = LoopIdiom::Kind::Fill;
+			loop.dst = static_cast<u16>(p[0].a);
+			return true;
+		}
+
+		// dst[i] = a[i]
+		if (len == 6 && IsALoad(p[0]) && IsILoad(p[1]) && p[1].a == i && MatchLoad(p + 2, i, loop.src1) && p[5].op == 0x4f)
+		{
+			loop.kind = LoopIdiom::Kind::Copy;
+			loop.dst = static_cast<u16>(p[0].a);
+			return true;
+		}
+
+		// dst[i] = a[i] OP b[i]
+		if (len == 10 && IsALoad(p[0]) && IsILoad(p[1]) && p[1].a == i
+			&& MatchLoad(p + 2, i, loop.src1) && MatchLoad(p + 5, i, loop.src2)
+			&& IsBinaryOp(p[8].op) && p[9].op == 0x4f)
+		{
+			loop.kind = LoopIdiom::Kind::Binary;
+			loop.op = p[8].op;
+			loop.dst = static_cast<u16>(p[0].a);
+			return true;
+		}
+
+		// if (a[i] == value) { found block }
+		if (len >= 5 && p[4].op == 0xa0 && static_cast<u32>(p[4].a) == incIdx) // if_icmpne to the increment
+		{
+			bool matched = (MatchLoad(p, i, loop.src1) && MatchValue(p[3], i, loop))
+				|| (MatchValue(p[0], i, loop) && MatchLoad(p + 1, i, loop.src1));
+			if (matched)
+			{
+				loop.kind = LoopIdiom::Kind::FindFirst;
+				loop.foundTarget = begin + 5;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Matches the header and the increment of the counted loop closed by the goto at backedge.
+	// cond receives the index of the if_icmpge.
+	bool MatchCountedLoop(const vector<Insn>& insns, u32 backedge, LoopIdiom& loop, u32& cond)
+	{
+		u32 head = insns[backedge].a;
+		if (backedge < head + 5 || !IsILoad(insns[head]))
+			return false;
+
+		loop = LoopIdiom();
+		loop.index = static_cast<u16>(insns[head].a);
+
+		if (IsILoad(insns[head + 1]) && insns[head + 1].a != loop.index)
+		{
+			loop.bound = static_cast<u16>(insns[head + 1].a);
+			loop.boundIsLength = false;
+			cond = head + 2;
+		}
+		else if (IsALoad(insns[head + 1]) && insns[head + 2].op == 0xbe) // arraylength
+		{
+			loop.bound = static_cast<u16>(insns[head + 1].a);
+			loop.boundIsLength = true;
+			cond = head + 3;
+		}
+		else if (IsIConst(insns[head + 1]))
+		{
+			loop.boundIsConst = true;
+			loop.boundConst = insns[head + 1].a;
+			cond = head + 2;
+		}
+		else
+			return false;
+
+		if (insns[cond].op != 0xa2 || static_cast<u32>(insns[cond].a) != backedge + 1) // if_icmpge to the exit
+			return false;
+
+		u32 inc = backedge - 1;
+		return insns[inc].op == 0x84 && insns[inc].a == loop.index && insns[inc].b == 1 && cond < inc;
+	}
+
+	bool MatchLoop(const vector<Insn>& insns, u32 backedge, LoopIdiom& loop)
+	{
+		u32 cond;
+		if (!MatchCountedLoop(insns, backedge, loop, cond))
+			return false;
+		return MatchBody(insns, cond + 1, backedge - 1, backedge - 1, loop);
+	}
+}
+
+void jvm::detail::RecognizeLoopIdioms(DecodedCode& code)
+{
+	bool found = true;
+	while (found)
+	{
+		found = false;
+		for (u32 g = static_cast<u32>(code.insns.size()); g-- > 0;)
+		{
+			const Insn& insn = code.insns[g];
+			if (insn.op != 0xa7 || static_cast<u32>(insn.a) >= g) // backward goto
+				continue;
+
+			LoopIdiom loop;
+			if (!MatchLoop(code.insns, g, loop))
+				continue;
+
+			u32 head = insn.a;
+			Insn kernel = { OpLoopKernel, code.insns[head].pc, static_cast<s32>(code.loops.size()), 0 };
+			code.loops.push_back(loop);
+			InsertInsn(code, head, kernel);
+			found = true;
+			break;
+		}
+	}
+}
+
+u32 jvm::detail::RunLoopKernel(VM& vm, const LoopIdiom& loop, u32* locals, u32 next)
+{
+	s32 begin = static_cast<s32>(locals[loop.index]);
+	s32 end;
+	if (!GetBound(vm, loop, locals, end))
+		return next; // the loop throws NullPointerException
+
+	// Clamp the range to the indices valid for every accessed array
+	bool valid = true;
+	const auto IntArray = [&](u16 local) -> s32*
+	{
+		u32 ref = locals[local];
+		if (ref == 0)
+		{
+			valid = false;
+			return nullptr;
+		}
+		JObject& ary = vm.GetObject(ref);
+		if (ary.kind != ObjectKind::Array || ary.type != PrimitiveType::Int)
+		{
+			valid = false;
+			return nullptr;
+		}
+		end = min(end, ary.length);
+		return reinterpret_cast<s32*>(ary.data.get());
+	};
+
+	s32* dst = nullptr;
+	s32* src1 = nullptr;
+	s32* src2 = nullptr;
+	switch (loop.kind)
+	{
+	case LoopIdiom::Kind::Reduce:
+	case LoopIdiom::Kind::FindFirst:
+		src1 = IntArray(loop.src1);
+		break;
+	case LoopIdiom::Kind::Fill:
+		dst = IntArray(loop.dst);
+		break;
+	case LoopIdiom::Kind::Copy:
+		dst = IntArray(loop.dst);
+		src1 = IntArray(loop.src1);
+		break;
+	case LoopIdiom::Kind::Binary:
+		dst = IntArray(loop.dst);
+		src1 = IntArray(loop.src1);
+		src2 = IntArray(loop.src2);
+		break;
+	}
+	if (!valid || begin < 0 || begin >= end)
+		return next;
+
+	size_t count = static_cast<size_t>(end - begin);
+	s32 value = loop.valueIsConst ? loop.value : static_cast<s32>(locals[loop.value]);
+	switch (loop.kind)
+	{
+	case LoopIdiom::Kind::Reduce:
+		locals[loop.acc] = static_cast<u32>(ReduceIntKernel(src1 + begin, count, loop.op, static_cast<s32>(locals[loop.acc])));
+		break;
+	case LoopIdiom::Kind::Fill:
+		FillKernel(reinterpret_cast<u8*>(dst + begin), count, 4, static_cast<u32>(value));
+		break;
+	case LoopIdiom::Kind::Copy:
+		memmove(dst + begin, src1 + begin, 4 * count);
+		break;
+	case LoopIdiom::Kind::Binary:
+		BinaryIntKernel(dst + begin, src1 + begin, src2 + begin, count, loop.op);
+		break;
+	case LoopIdiom::Kind::FindFirst:
+	{
+		size_t idx = FindIntKernel(src1 + begin, count, value);
+		if (idx < count)
+		{
+			locals[loop.index] = static_cast<u32>(begin + static_cast<s32>(idx));
+			return loop.foundTarget;
+		}
+		break;
+	}
+	}
+
+	locals[loop.index] = static_cast<u32>(end);
+	return next;
+}
+
+// Bounds check elimination.
+//
+// In the counted loop above, "a[i]" is in bounds when i starts non-negative, only the
+// final iinc changes i, and a is at least as long as the bound. If the bound is a.length
+// and i starts from a non-negative constant this holds by construction, and the iaload /
+// iastore are replaced in place. Otherwise an OpLoopGuard is inserted before the loop.
+// It checks the condition once and enters an unchecked copy of the loop appended to the
+// method, or falls through to the original loop which keeps every check.
+
+namespace
+{
+	struct ArrayAccess
+	{
+		u32 insn;
+		u16 array; // array local
+	};
+
+	bool WritesLocal(const Insn& i, u16 local)
+	{
+		if (i.op == 0x84) // iinc
+			return i.a == local;
+		if (i.op < 0x36 || 0x4e < i.op)
+			return false;
+		u16 type = (i.op <= 0x3a) ? i.op - 0x36 : (i.op - 0x3b) / 4;
+		u32 width = (type == 1 || type == 3) ? 2 : 1; // lstore, dstore
+		return static_cast<u32>(i.a) <= local && local < static_cast<u32>(i.a) + width;
+	}
+
+	// Finds the "aload a; iload i; ... iaload / iastore" accesses in [begin, end) by tracking
+	// where the operand stack slots come from. Returns false if the code cannot be analyzed.
+	bool FindArrayAccesses(VM& vm, const CFClassFile& cf, const vector<Insn>& insns, u32 begin, u32 end,
+		u16 index, vector<ArrayAccess>& accesses)
+	{
+		enum class From : u8 { Unknown, ALoad, Index };
+		struct Slot
+		{
+			From from;
+			u16 local;
+		};
+		vector<Slot> stack;
+		vector<s32> depthAt(end - begin, -1); // stack depth at forward branch targets
+		bool reachable = true;
+
+		for (u32 k = begin; k < end; k++)
+		{
+			const Insn& insn = insns[k];
+			const s32 joined = depthAt[k - begin];
+			if (joined >= 0)
+			{
+				if (reachable && joined != static_cast<s32>(stack.size()))
+					return false;
+				stack.assign(joined, Slot{ From::Unknown, 0 }); // values merged from several paths
+				reachable = true;
+			}
+			if (!reachable)
+				return false;
+
+			u32 pop, push;
+			if (!GetStackEffect(vm, cf, insn, pop, push) || pop > stack.size())
+				return false;
+
+			const size_t sp = stack.size();
+			if (insn.op == 0x2e && stack[sp - 2].from == From::ALoad && stack[sp - 1].from == From::Index)
+				accesses.push_back({ k, stack[sp - 2].local });
+			if (insn.op == 0x4f && stack[sp - 3].from == From::ALoad && stack[sp - 2].from == From::Index)
+				accesses.push_back({ k, stack[sp - 3].local });
+
+			const Slot top = (sp > 0) ? stack.back() : Slot{ From::Unknown, 0 };
+			stack.resize(sp - pop);
+			if (IsALoad(insn))
+				stack.push_back({ From::ALoad, static_cast<u16>(insn.a) });
+			else if (IsILoad(insn) && insn.a == index)
+				stack.push_back({ From::Index, index });
+			else if (insn.op == 0x59) // dup
+				stack.insert(stack.end(), 2, top);
+			else
+				stack.insert(stack.end(), push, Slot{ From::Unknown, 0 });
+
+			if (IsBranch(insn.op))
+			{
+				u32 target = insn.a;
+				if (target <= k)
+					return false; // innermost loops only
+				if (target < end)
+				{
+					if (depthAt[target - begin] >= 0 && depthAt[target - begin] != static_cast<s32>(stack.size()))
+						return false;
+					depthAt[target - begin] = static_cast<s32>(stack.size());
+				}
+				if (insn.op == 0xa7) // goto
+					reachable = false;
+			}
+			else if (insn.op == 0xa8 || insn.op == 0xa9 || insn.op == 0xaa || insn.op == 0xab || insn.op == 0xc9)
+				return false; // jsr, ret, switches
+			else if ((0xac <= insn.op && insn.op <= 0xb1) || insn.op == 0xbf) // xreturn, athrow
+				reachable = false;
+		}
+		return true;
+	}
+
+	// Returns true if [head, backedge] can only be entered by falling into head
+	bool HasSingleEntry(const DecodedCode& code, u32 head, u32 backedge)
+	{
+		for (u32 k = 0; k < code.insns.size(); k++)
+		{
+			const Insn& insn = code.insns[k];
+			if ((k < head || backedge < k) && (IsBranch(insn.op) || insn.op == 0xa8 || insn.op == 0xc9)
+				&& head <= static_cast<u32>(insn.a) && static_cast<u32>(insn.a) <= backedge)
+				return false;
+		}
+		for (u32 h : code.handlerInsn)
+		{
+			if (head <= h && h <= backedge)
+				return false;
+		}
+		bool entered = false;
+		ForEachSwitchTarget(code, [&](const u32& target)
+		{
+			entered = entered || (head <= target && target <= backedge);
+		});
+		return !entered;
+	}
+}
+
+void jvm::detail::EliminateBoundsChecks(VM& vm, const CFClassFile& cf, DecodedCode& code)
+{
+	auto& insns = code.insns;
+	for (u32 g = static_cast<u32>(insns.size()); g-- > 0;)
+	{
+		if (insns[g].op != 0xa7 || static_cast<u32>(insns[g].a) >= g) // backward goto
+			continue;
+
+		LoopIdiom loop;
+		u32 cond;
+		if (!MatchCountedLoop(insns, g, loop, cond))
+			continue;
+
+		const u32 head = insns[g].a;
+		const u32 inc = g - 1;
+		vector<ArrayAccess> accesses;
+		if (!FindArrayAccesses(vm, cf, insns, cond + 1, inc, loop.index, accesses) || accesses.empty())
+			continue;
+
+		// The induction variable, the bound and the arrays are loop invariant apart from the increment
+		bool invariant = true;
+		for (u32 k = head; k < inc && invariant; k++)
+		{
+			invariant = !WritesLocal(insns[k], loop.index) && (loop.boundIsConst || !WritesLocal(insns[k], loop.bound));
+			for (auto& a : accesses)
+				invariant = invariant && !WritesLocal(insns[k], a.array);
+		}
+		if (!invariant)
+			continue;
+
+		// for (i = C; i < a.length; i++) with C >= 0 and only a[i] accessed
+		const bool proven = loop.boundIsLength && head >= 2
+			&& IsIStore(insns[head - 1]) && insns[head - 1].a == loop.index
+			&& IsIConst(insns[head - 2]) && insns[head - 2].a >= 0
+			&& all_of(accesses.begin(), accesses.end(), [&](const ArrayAccess& a) { return a.array == loop.bound; })
+			&& HasSingleEntry(code, head, g);
+		if (proven)
+		{
+			for (auto& a : accesses)
+				insns[a.insn].op = (insns[a.insn].op == 0x2e) ? OpIALoadUnchecked : OpIAStoreUnchecked;
+			continue;
+		}
+
+		LoopGuard guard;
+		guard.index = loop.index;
+		guard.bound = loop.bound;
+		guard.boundIsLength = loop.boundIsLength;
+		guard.boundIsConst = loop.boundIsConst;
+		guard.boundConst = loop.boundConst;
+		for (auto& a : accesses)
+		{
+			if (!(loop.boundIsLength && a.array == loop.bound)
+				&& find(guard.arrays.begin(), guard.arrays.end(), a.array) == guard.arrays.end())
+				guard.arrays.push_back(a.array);
+		}
+
+		// Unchecked copy of [head, g]; branches leaving the loop keep their targets
+		const u32 fast = static_cast<u32>(insns.size());
+		for (u32 k = head; k <= g; k++)
+		{
+			Insn insn = insns[k];
+			if (IsBranch(insn.op) && head <= static_cast<u32>(insn.a) && static_cast<u32>(insn.a) <= g)
+				insn.a += fast - head;
+			insns.push_back(insn);
+		}
+		for (auto& a : accesses)
+		{
+			Insn& insn = insns[fast + a.insn - head];
+			insn.op = (insn.op == 0x2e) ? OpIALoadUnchecked : OpIAStoreUnchecked;
+		}
+		guard.fastEntry = fast;
+
+		const Insn check = { OpLoopGuard, insns[head].pc, static_cast<s32>(code.guards.size()), 0 };
+		code.guards.push_back(move(guard));
+		InsertInsn(code, head, check);
+
+		// The back edge skips the guard
+		for (u32 k = head + 1; k <= g + 1; k++)
+		{
+			if (IsBranch(insns[k].op) && static_cast<u32>(insns[k].a) == head)
+				insns[k].a = head + 1;
+		}
+		g = head;
+	}
+}
+
+u32 jvm::detail::RunLoopGuard(VM& vm, const LoopGuard& guard, u32* locals, u32 next)
+{
+	if (static_cast<s32>(locals[guard.index]) < 0)
+		return next;
+
+	s32 bound;
+	if (!GetBound(vm, guard, locals, bound))
+		return next; // the loop throws NullPointerException
+
+	for (u16 local : guard.arrays)
+	{
+		u32 ref = locals[local];
+		if (ref == 0)
+			return next;
+		const JObject& ary = vm.GetObject(ref);
+		if (ary.kind != ObjectKind::Array || ary.type != PrimitiveType::Int || ary.length < bound)
+			return next;
+	}
+	return guard.fastEntry;
+}
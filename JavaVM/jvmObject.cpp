@@ -0,0 +1,429 @@
+#include "jvmObject.h"
+#include "jvmClass.h"
+#include "jvmIntrinsic.h"
+#include <algorithm>
+
+using namespace std;
+using namespace jvm;
+
+const char jvm::detail::ObjectBuildStamp[] = __DATE__ " " __TIME__;
+
+void jvm::detail::LayoutInstanceFields(VM& vm, JClass& jclass)
+{
+	auto& cp = jclass.cf.constant_pool;
+	auto& fields = jclass.instanceFields;
+	for (auto& f : jclass.cf.fields)
+	{
+		if (f.access_flags & 0x0008) // ACC_STATIC
+			continue;
+
+		JField fld = {};
+		fld.owner = &jclass;
+		fld.name = cp[f.name_index].val.f5.idx;
+		fld.descriptor = cp[f.descriptor_index].val.f5.idx;
+		JType type = DecodeType(vm, vm.GetInternedString(fld.descriptor));
+		if (type.aryDim > 0 || type.type == PrimitiveType::Class)
+		{
+			fld.type = PrimitiveType::Class;
+			fld.size = 4; // handle
+		}
+		else
+		{
+			fld.type = type.type;
+			fld.size = static_cast<u8>(GetPrimitiveSize(type.type));
+		}
+		fields.push_back(fld);
+	}
+
+	// Largest first, so every field is naturally aligned without padding between them
+	stable_sort(fields.begin(), fields.end(), [](const JField& a, const JField& b) { return a.size > b.size; });
+
+	u32 offset = jclass.super ? jclass.super->instanceSize : 0;
+	for (auto& f : fields)
+	{
+		offset = (offset + f.size - 1) & ~(f.size - 1u);
+		f.offset = offset;
+		offset += f.size;
+	}
+	jclass.instanceSize = offset;
+}
+
+JClass* jvm::detail::ResolveClass(VM& vm, JClass& jclass, u16 classRef)
+{
+	auto& resolved = jclass.resolvedClasses[classRef];
+	if (!resolved)
+	{
+		auto& cp = jclass.cf.constant_pool;
+		resolved = vm.LoadClass(cp[cp[classRef].val.f1.v].val.f5.idx);
+	}
+	return resolved;
+}
+
+JMember* jvm::detail::ResolveStaticField(VM& vm, JClass& jclass, u16 fieldRef)
+{
+	auto& resolved = jclass.resolvedStaticFields[fieldRef];
+	if (resolved)
+		return resolved;
+
+	auto& cp = jclass.cf.constant_pool;
+	// String pool indices, loading the classes below may grow the pool
+	u16 nat = cp[fieldRef].val.f2.v2;
+	const u32 name = cp[cp[nat].val.f2.v1].val.f5.idx;
+	const u32 desc = cp[cp[nat].val.f2.v2].val.f5.idx;
+	const auto Find = [&](JClass& c) -> JMember*
+	{
+		for (auto& fld : c.staticFields)
+		{
+			if (fld.name == name && fld.descriptor == desc)
+				return &fld;
+		}
+		return nullptr;
+	};
+
+	// The class, its direct superinterfaces, then the superclasses
+	JClass* owner = nullptr;
+	for (JClass* c = ResolveClass(vm, jclass, cp[fieldRef].val.f2.v1); c && !resolved; c = c->super)
+	{
+		if ((resolved = Find(*c)) != nullptr)
+			owner = c;
+		for (size_t i = 0; i < c->interfaces.size() && !resolved; i++)
+		{
+			if ((resolved = Find(*c->interfaces[i])) != nullptr)
+				owner = c->interfaces[i];
+		}
+	}
+
+	// Accessing a static field is an active use of the class declaring it
+	if (owner)
+		vm.InitializeClass(*owner);
+	return resolved;
+}
+
+const JField* jvm::detail::ResolveField(VM& vm, JClass& jclass, u16 fieldRef)
+{
+	auto& resolved = jclass.resolvedFields[fieldRef];
+	if (resolved)
+		return resolved;
+
+	auto& cp = jclass.cf.constant_pool;
+	u16 nat = cp[fieldRef].val.f2.v2;
+	u32 name = cp[cp[nat].val.f2.v1].val.f5.idx;
+	u32 desc = cp[cp[nat].val.f2.v2].val.f5.idx;
+	for (JClass* c = ResolveClass(vm, jclass, cp[fieldRef].val.f2.v1); c && !resolved; c = c->super)
+	{
+		for (auto& f : c->instanceFields)
+		{
+			if (f.name == name && f.descriptor == desc)
+			{
+				resolved = &f;
+				break;
+			}
+		}
+	}
+	return resolved;
+}
+
+const detail::ResolvedMethod* jvm::detail::ResolveMethod(VM& vm, JClass& jclass, u16 methodRef, bool hasThis)
+{
+	auto& resolved = jclass.resolvedMethods[methodRef];
+	if (resolved.intrinsic || resolved.method)
+		return &resolved;
+
+	auto& cp = jclass.cf.constant_pool;
+	u16 cls = cp[methodRef].val.f2.v1;
+	u16 nat = cp[methodRef].val.f2.v2;
+	u32 name = cp[cp[nat].val.f2.v1].val.f5.idx;
+	u32 desc = cp[cp[nat].val.f2.v2].val.f5.idx;
+	const wstring& descName = vm.GetInternedString(desc);
+
+	// Known JDK methods are replaced by native implementations
+	resolved.intrinsic = FindIntrinsic(vm.GetInternedString(cp[cp[cls].val.f1.v].val.f5.idx), vm.GetInternedString(name), descName);
+	for (JClass* c = resolved.intrinsic ? nullptr : ResolveClass(vm, jclass, cls); c && !resolved.method; c = c->super)
+	{
+		for (auto& m : c->cf.methods)
+		{
+			if (c->cf.constant_pool[m.name_index].val.f5.idx == name && c->cf.constant_pool[m.descriptor_index].val.f5.idx == desc)
+			{
+				resolved.method = &m;
+				resolved.owner = c;
+				break;
+			}
+		}
+	}
+	if (!resolved.intrinsic && !resolved.method)
+		return nullptr;
+	if (resolved.method && resolved.method->compiled)
+		resolved.intrinsic = resolved.method->compiled; // called like a native replacement
+
+	JSignature sig = DecodeSignature(vm, descName);
+	resolved.argSlots = static_cast<u16>(GetArgSlotSize(sig) + (hasThis ? 1 : 0));
+	resolved.retSlots = static_cast<u16>(GetSlotSize(sig.ret));
+	return &resolved;
+}
+
+namespace
+{
+	u32 FindSlot(const vector<JVirtualMethod>& vtable, u32 name, u32 desc)
+	{
+		for (u32 i = 0; i < vtable.size(); i++)
+		{
+			if (vtable[i].name == name && vtable[i].descriptor == desc)
+				return i;
+		}
+		return static_cast<u32>(vtable.size());
+	}
+
+	void AddVirtual(vector<JVirtualMethod>& vtable, const JVirtualMethod& m)
+	{
+		u32 slot = FindSlot(vtable, m.name, m.descriptor);
+		if (slot < vtable.size())
+			vtable[slot] = m; // override
+		else
+			vtable.push_back(m);
+	}
+
+	bool IsConcrete(const JClass& c)
+	{
+		return !(c.cf.access_flags & (0x0200 | 0x0400)); // ACC_INTERFACE, ACC_ABSTRACT
+	}
+
+	// Method called by the site for a receiver of class c
+	const detail::ResolvedMethod* SlotTarget(const JClass& c, const detail::CallSite& site)
+	{
+		if (site.kind == detail::CallSite::Kind::Virtual)
+			return &c.vtable[site.index].target;
+		auto it = c.itableIndex.find(site.declClass);
+		if (it == c.itableIndex.end())
+			return nullptr;
+		return &c.vtable[c.itables[it->second].slots[site.index]].target;
+	}
+
+	// Walks the loaded subtypes, multiple is set if they do not share one implementation
+	void CollectTargets(const JClass& c, const detail::CallSite& site, const detail::ResolvedMethod*& unique, bool& multiple)
+	{
+		if (IsConcrete(c))
+		{
+			const detail::ResolvedMethod* target = SlotTarget(c, site);
+			if (!unique)
+				unique = target;
+			else if (target->method != unique->method)
+				multiple = true;
+		}
+		for (const JClass* s : c.subtypes)
+		{
+			if (multiple)
+				return;
+			CollectTargets(*s, site, unique, multiple);
+		}
+	}
+
+	void CollectInterfaces(const JClass& c, vector<const JClass*>& out)
+	{
+		for (const JClass* i : c.interfaces)
+		{
+			if (find(out.begin(), out.end(), i) == out.end())
+			{
+				out.push_back(i);
+				CollectInterfaces(*i, out);
+			}
+		}
+		if (c.super)
+			CollectInterfaces(*c.super, out);
+	}
+}
+
+void jvm::detail::LinkMethods(VM& vm, JClass& jclass)
+{
+	auto& cp = jclass.cf.constant_pool;
+	auto& vtable = jclass.vtable;
+
+	// Inherited slots keep their index, so a vtable index of a class is valid for every subclass
+	if (jclass.super)
+		vtable = jclass.super->vtable;
+	if (jclass.isInterface)
+	{
+		for (const JClass* i : jclass.interfaces)
+		{
+			for (auto& m : i->vtable)
+				AddVirtual(vtable, m);
+		}
+	}
+
+	for (auto& m : jclass.cf.methods)
+	{
+		if (m.access_flags & (0x0008 | 0x0002)) // ACC_STATIC, ACC_PRIVATE
+			continue;
+		u32 name = cp[m.name_index].val.f5.idx;
+		if (vm.GetInternedString(name)[0] == L'<') // <init>
+			continue;
+
+		JVirtualMethod entry = { name, cp[m.descriptor_index].val.f5.idx, {} };
+		entry.target.method = &m;
+		entry.target.owner = &jclass;
+		entry.target.argSlots = static_cast<u16>(GetArgSlotSize(m.signature) + 1);
+		entry.target.retSlots = static_cast<u16>(GetSlotSize(m.signature.ret));
+		AddVirtual(vtable, entry);
+	}
+
+	// Interface methods without an implementation (default or abstract) get a slot of their own
+	vector<const JClass*> interfaces;
+	CollectInterfaces(jclass, interfaces);
+	for (const JClass* i : interfaces)
+	{
+		JITable itable = { i, {} };
+		for (auto& m : i->vtable)
+		{
+			u32 slot = FindSlot(vtable, m.name, m.descriptor);
+			if (slot == vtable.size())
+				vtable.push_back(m);
+			itable.slots.push_back(slot);
+		}
+		jclass.itableIndex.emplace(i, static_cast<u32>(jclass.itables.size()));
+		jclass.itables.push_back(move(itable));
+	}
+}
+
+bool jvm::detail::IsAssignableTo(const JClass& from, const JClass& to)
+{
+	if (to.isInterface)
+		return &from == &to || from.itableIndex.count(&to) > 0;
+	for (const JClass* c = &from; c; c = c->super)
+	{
+		if (c == &to)
+			return true;
+	}
+	return false;
+}
+
+bool jvm::detail::IsInstanceOf(VM& vm, JClass& jclass, const JObject& obj, u16 classRef)
+{
+	auto& cp = jclass.cf.constant_pool;
+	const wstring& name = vm.GetInternedString(cp[cp[classRef].val.f1.v].val.f5.idx);
+	if (name == L"java/lang/Object")
+		return true;
+
+	switch (obj.kind)
+	{
+	case ObjectKind::Instance:
+	{
+		const JClass* to = ResolveClass(vm, jclass, classRef);
+		return to && IsAssignableTo(*obj.clazz, *to);
+	}
+	case ObjectKind::String:
+		return name == L"java/lang/String" || name == L"java/lang/CharSequence"
+			|| name == L"java/lang/Comparable" || name == L"java/io/Serializable";
+	case ObjectKind::Array:
+	{
+		static const wchar_t Descriptors[] = L"ZCFDBSIJ"; // PrimitiveType order
+		if (name == L"java/lang/Cloneable" || name == L"java/io/Serializable")
+			return true;
+		if (obj.type == PrimitiveType::Class)
+		{
+			if (name == L"[Ljava/lang/Object;")
+				return true;
+			if (!obj.clazz || name.size() < 4 || name[1] != L'L' || name.back() != L';')
+				return false;
+			const JClass* to = vm.FindClass(vm.InternString(name.substr(2, name.size() - 3)));
+			return to && IsAssignableTo(*obj.clazz, *to);
+		}
+		return name.size() == 2 && name[0] == L'[' && static_cast<size_t>(obj.type) < 8
+			&& name[1] == Descriptors[static_cast<size_t>(obj.type)];
+	}
+	}
+	return false;
+}
+
+bool jvm::detail::ResolveCallSite(VM& vm, JClass& jclass, u16 methodRef, CallSite& site)
+{
+	auto& cp = jclass.cf.constant_pool;
+	u16 cls = cp[methodRef].val.f2.v1;
+	u16 nat = cp[methodRef].val.f2.v2;
+	u32 name = cp[cp[nat].val.f2.v1].val.f5.idx;
+	u32 desc = cp[cp[nat].val.f2.v2].val.f5.idx;
+
+	JClass* declClass = ResolveClass(vm, jclass, cls);
+	if (!declClass)
+	{
+		if (vm.GetInternedString(cp[cp[cls].val.f1.v].val.f5.idx) != L"java/lang/String")
+			return false;
+		const ResolvedMethod* native = ResolveMethod(vm, jclass, methodRef, true);
+		if (!native)
+			return false;
+		site.kind = CallSite::Kind::String;
+		site.direct = native;
+		site.argSlots = native->argSlots;
+		return true;
+	}
+
+	u32 slot = FindSlot(declClass->vtable, name, desc);
+	if (slot < declClass->vtable.size())
+	{
+		site.kind = declClass->isInterface ? CallSite::Kind::Interface : CallSite::Kind::Virtual;
+		site.index = slot;
+		site.declClass = declClass;
+		site.argSlots = declClass->vtable[slot].target.argSlots;
+
+		// Sites with a single loaded implementation are bound to it until a class overriding it is loaded
+		const ResolvedMethod* unique = nullptr;
+		bool multiple = false;
+		CollectTargets(*declClass, site, unique, multiple);
+		if (unique && !multiple)
+		{
+			site.direct = unique;
+			vm.RegisterDevirtualizedSite(site);
+		}
+		return true;
+	}
+
+	// Private methods called through invokevirtual
+	const ResolvedMethod* direct = ResolveMethod(vm, jclass, methodRef, true);
+	if (!direct)
+		return false;
+	site.kind = CallSite::Kind::Direct;
+	site.direct = direct;
+	site.argSlots = direct->argSlots;
+	return true;
+}
+
+const detail::ResolvedMethod* jvm::detail::Dispatch(CallSite& site, const JObject& receiver)
+{
+	const JClass* clazz = receiver.clazz;
+	if (site.direct)
+		return site.direct;
+	if (!clazz)
+		return nullptr; // java.lang.Object methods of arrays and Strings are not supported
+
+	for (u32 i = 0; i < site.count; i++)
+	{
+		if (site.cache[i].receiver == clazz)
+			return site.cache[i].target;
+	}
+
+	const ResolvedMethod* target = SlotTarget(*clazz, site);
+	if (!target)
+		return nullptr; // IncompatibleClassChangeError
+
+	// Megamorphic sites keep using the lookup above
+	if (site.count < CallSite::CacheSize)
+		site.cache[site.count++] = { clazz, target };
+	return target;
+}
+
+void jvm::detail::InvalidateDevirtualizedSites(const JClass& jclass, vector<CallSite*>& sites)
+{
+	if (!IsConcrete(jclass))
+		return; // no instances until a concrete subclass is loaded
+
+	for (auto it = sites.begin(); it != sites.end();)
+	{
+		CallSite& site = **it;
+		if (IsAssignableTo(jclass, *site.declClass) && SlotTarget(jclass, site)->method != site.direct->method)
+		{
+			site.direct = nullptr; // dispatched through the inline cache from now on
+			site.count = 0;
+			it = sites.erase(it);
+		}
+		else
+			++it;
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "jvm.h"
+#include "jvmDecode.h"
+
+namespace jvm
+{
+	// Field values in stack slot representation: sub-int types are widened to int,
+	// long and double take two slots
+	inline void LoadField(const u8* p, PrimitiveType type, u32* slots)
+	{
+		switch (type)
+		{
+		case PrimitiveType::Boolean:
+		case PrimitiveType::Byte:
+			slots[0] = static_cast<s32>(static_cast<s8>(*p));
+			break;
+		case PrimitiveType::Char:
+		case PrimitiveType::Short:
+		{
+			u16 v;
+			memcpy(&v, p, 2);
+			slots[0] = (type == PrimitiveType::Char) ? static_cast<u32>(v) : static_cast<s32>(static_cast<s16>(v));
+			break;
+		}
+		case PrimitiveType::Long:
+		case PrimitiveType::Double:
+			memcpy(slots, p, 8);
+			break;
+		default:
+			memcpy(slots, p, 4);
+			break;
+		}
+	}
+
+	inline void StoreField(u8* p, PrimitiveType type, const u32* slots)
+	{
+		switch (type)
+		{
+		case PrimitiveType::Boolean:
+		case PrimitiveType::Byte:
+			*p = static_cast<u8>(slots[0]);
+			break;
+		case PrimitiveType::Char:
+		case PrimitiveType::Short:
+		{
+			u16 v = static_cast<u16>(slots[0]);
+			memcpy(p, &v, 2);
+			break;
+		}
+		case PrimitiveType::Long:
+		case PrimitiveType::Double:
+			memcpy(p, slots, 8);
+			break;
+		default:
+			memcpy(p, slots, 4);
+			break;
+		}
+	}
+
+	namespace detail
+	{
+		// Assigns the offsets of the non-static fields. The superclass must be linked already.
+		void LayoutInstanceFields(VM& vm, JClass& jclass);
+
+		// Constant pool resolution, cached in JClass. Classes not loaded yet are loaded from the class path.
+		// Returns null if the class or member is not found.
+		JClass* ResolveClass(VM& vm, JClass& jclass, u16 classRef);
+		const JField* ResolveField(VM& vm, JClass& jclass, u16 fieldRef);
+		// Also initializes the class declaring the field
+		JMember* ResolveStaticField(VM& vm, JClass& jclass, u16 fieldRef);
+		const ResolvedMethod* ResolveMethod(VM& vm, JClass& jclass, u16 methodRef, bool hasThis);
+
+		// Builds the vtable and the itables. The superclass and superinterfaces must be linked already.
+		void LinkMethods(VM& vm, JClass& jclass);
+
+		bool IsAssignableTo(const JClass& from, const JClass& to);
+		bool IsInstanceOf(VM& vm, JClass& jclass, const JObject& obj, u16 classRef);
+
+		// Virtual calls. ResolveCallSite returns false if the method is not found.
+		bool ResolveCallSite(VM& vm, JClass& jclass, u16 methodRef, CallSite& site);
+		const ResolvedMethod* Dispatch(CallSite& site, const JObject& receiver);
+
+		// Class hierarchy analysis. Unbinds devirtualized call sites whose method is overridden by a newly linked class.
+		void InvalidateDevirtualizedSites(const JClass& jclass, std::vector<CallSite*>& sites);
+	}
+}
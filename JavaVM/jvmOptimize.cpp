@@ -0,0 +1,600 @@
+#include "jvmDecode.h"
+#include "jvmClass.h"
+#include <algorithm>
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+// Load-time optimizer.
+//
+// Runs on the decoded code of a verified method right after inlining, so the later passes and
+// the interpreter start from simpler code. The rounds below repeat until nothing changes:
+//  - unreachable instructions are removed
+//  - constant and copy propagation: a load of a local known to hold an int constant becomes the
+//    constant, and a load of a local holding a copy of another local loads the original
+//  - constant folding of int arithmetic and of getstatic of static final constant fields,
+//    branches and switches on constants become goto or disappear, and so does goto to the next
+//    instruction; a constant or load followed by pop is removed
+//  - stores to locals that are not read again become pop
+// Folded constants out of the iconst_<i> range are pushed by bipush, which takes any int once decoded.
+// Methods with exception handlers or jsr / ret are left as they are.
+
+const char jvm::detail::OptimizeBuildStamp[] = __DATE__ " " __TIME__;
+
+namespace
+{
+	const u32 MaxRounds = 16;
+
+	// Generic forms only
+	bool IsLoad(u16 op) { return 0x15 <= op && op <= 0x19; }
+	bool IsStore(u16 op) { return 0x36 <= op && op <= 0x3a; }
+	bool IsWide(u16 op) { return op == 0x16 || op == 0x18 || op == 0x37 || op == 0x39; } // long, double
+
+	bool GetIntConst(const CFClassFile& cf, const Insn& insn, s32& v)
+	{
+		if ((0x02 <= insn.op && insn.op <= 0x08) || insn.op == 0x10 || insn.op == 0x11) // iconst_<i>, bipush, sipush
+		{
+			v = insn.a;
+			return true;
+		}
+		if ((insn.op == 0x12 || insn.op == 0x13) && cf.constant_pool[insn.a].type == CFConstantPool::Type::Integer) // ldc, ldc_w
+		{
+			v = static_cast<s32>(cf.constant_pool[insn.a].val.f3.v);
+			return true;
+		}
+		return false;
+	}
+
+	// The short forms javac would emit, the interpreter handles them best
+	Insn MakeIntConst(u16 pc, s32 v)
+	{
+		if (-1 <= v && v <= 5)
+			return { static_cast<u16>(0x03 + v), pc, v, 0 }; // iconst_<i>
+		return { 0x10, pc, v, 0 }; // bipush
+	}
+
+	Insn MakeLoad(u16 op, u16 pc, s32 local)
+	{
+		if (local <= 3)
+			return { static_cast<u16>(0x1a + (op - 0x15) * 4 + local), pc, local, 0 }; // xload_<n>
+		return { op, pc, local, 0 };
+	}
+
+	// Pushes a value without side effects, slots is 1 or 2
+	bool IsPurePush(const CFClassFile& cf, const Insn& insn, u32 slots)
+	{
+		const u16 op = GenericLocalOp(insn.op);
+		s32 v;
+		if (slots == 1)
+			return GetIntConst(cf, insn, v) || op == 0x01 || (0x0b <= op && op <= 0x0d) || (IsLoad(op) && !IsWide(op)); // aconst_null, fconst_<f>
+		return op == 0x09 || op == 0x0a || op == 0x0e || op == 0x0f || op == 0x14 || op == 0x16 || op == 0x18; // lconst, dconst, ldc2_w, lload, dload
+	}
+
+	bool FoldBinary(u16 op, s32 x, s32 y, s32& r)
+	{
+		const u32 a = static_cast<u32>(x);
+		const u32 b = static_cast<u32>(y);
+		switch (op)
+		{
+		case 0x60: r = static_cast<s32>(a + b); return true; // iadd
+		case 0x64: r = static_cast<s32>(a - b); return true; // isub
+		case 0x68: r = static_cast<s32>(a * b); return true; // imul
+		case 0x6c: // idiv
+			if (y == 0)
+				return false; // left to throw at run time
+			r = (y == -1) ? static_cast<s32>(0u - a) : x / y;
+			return true;
+		case 0x70: // irem
+			if (y == 0)
+				return false;
+			r = (y == -1) ? 0 : x % y;
+			return true;
+		case 0x78: r = static_cast<s32>(a << (b & 31)); return true; // ishl
+		case 0x7a: r = x >> (b & 31); return true; // ishr
+		case 0x7c: r = static_cast<s32>(a >> (b & 31)); return true; // iushr
+		case 0x7e: r = x & y; return true; // iand
+		case 0x80: r = x | y; return true; // ior
+		case 0x82: r = x ^ y; return true; // ixor
+		default: return false;
+		}
+	}
+
+	bool FoldUnary(u16 op, s32 x, s32& r)
+	{
+		switch (op)
+		{
+		case 0x74: r = static_cast<s32>(0u - static_cast<u32>(x)); return true; // ineg
+		case 0x91: r = static_cast<s8>(x); return true; // i2b
+		case 0x92: r = static_cast<u16>(x); return true; // i2c
+		case 0x93: r = static_cast<s16>(x); return true; // i2s
+		default: return false;
+		}
+	}
+
+	// if_icmp<cond>
+	bool Compare(u16 op, s32 x, s32 y)
+	{
+		switch (op)
+		{
+		case 0x9f: return x == y;
+		case 0xa0: return x != y;
+		case 0xa1: return x < y;
+		case 0xa2: return x >= y;
+		case 0xa3: return x > y;
+		default: return x <= y;
+		}
+	}
+
+	// Deleted instructions continue to the next one kept
+	void RemoveInsns(DecodedCode& code, const vector<bool>& removed)
+	{
+		auto& insns = code.insns;
+		vector<Insn> out;
+		vector<u32> map(insns.size() + 1);
+		for (u32 k = 0; k < insns.size(); k++)
+		{
+			map[k] = static_cast<u32>(out.size());
+			if (!removed[k])
+				out.push_back(insns[k]);
+		}
+		map[insns.size()] = static_cast<u32>(out.size());
+		for (auto& insn : out)
+		{
+			if (IsBranch(insn.op))
+				insn.a = static_cast<s32>(map[insn.a]);
+		}
+		ForEachSwitchTarget(code, [&](u32& target) { target = map[target]; });
+		insns = move(out);
+	}
+
+	// What a local or an operand stack slot is known to hold
+	struct Value
+	{
+		enum Kind : u8
+		{
+			None, // not reached yet
+			Const,
+			Copy,
+			Unknown,
+		} kind;
+		u16 load; // Copy: generic load reading the original local
+		s32 v;    // Const: the int, Copy: the original local
+
+		bool operator==(const Value& o) const { return kind == o.kind && load == o.load && v == o.v; }
+		bool operator!=(const Value& o) const { return !(*this == o); }
+	};
+
+	const Value UnknownValue = { Value::Unknown, 0, 0 };
+
+	Value Meet(const Value& x, const Value& y)
+	{
+		if (x.kind == Value::None)
+			return y;
+		if (y.kind == Value::None)
+			return x;
+		return (x == y) ? x : UnknownValue;
+	}
+
+	class Optimizer
+	{
+	public:
+		Optimizer(VM& vm, JClass& jclass, const CFMethod& method, DecodedCode& code)
+			: m_vm(vm), m_jclass(jclass), m_cf(jclass.cf), m_code(code),
+			m_numLocals(method.code->max_locals + code.extraLocals)
+		{
+		}
+
+		void Run()
+		{
+			for (u32 round = 0; round < MaxRounds; round++)
+			{
+				bool changed = false;
+				if (!RemoveUnreachable(changed) || !Propagate(changed))
+					return;
+				FoldConstants(changed);
+				RemoveDeadStores(changed);
+				if (!changed)
+					return;
+			}
+		}
+
+	private:
+		VM& m_vm;
+		JClass& m_jclass;
+		const CFClassFile& m_cf;
+		DecodedCode& m_code;
+		const u32 m_numLocals;
+		vector<s32> m_depth;
+
+		vector<bool> FindTargets() const
+		{
+			vector<bool> isTarget(m_code.insns.size(), false);
+			for (auto& insn : m_code.insns)
+			{
+				if (IsBranch(insn.op))
+					isTarget[insn.a] = true;
+			}
+			ForEachSwitchTarget(m_code, [&](u32 target) { isTarget[target] = true; });
+			return isTarget;
+		}
+
+		template<class F>
+		void ForEachSuccessor(u32 k, F f) const
+		{
+			const Insn& insn = m_code.insns[k];
+			if (IsBranch(insn.op))
+				f(static_cast<u32>(insn.a));
+			if (insn.op == 0xaa || insn.op == 0xab) // tableswitch, lookupswitch
+			{
+				const SwitchTable& s = m_code.switches[insn.a];
+				f(s.defaultTarget);
+				for (u32 t : s.targets)
+					f(t);
+			}
+			if (!CannotFallThrough(insn.op) && k + 1 < m_code.insns.size())
+				f(k + 1);
+		}
+
+		bool RemoveUnreachable(bool& changed)
+		{
+			if (!ComputeStackDepths(m_vm, m_cf, m_code, m_depth))
+				return false;
+			vector<bool> removed(m_code.insns.size());
+			for (u32 k = 0; k < removed.size(); k++)
+				removed[k] = (m_depth[k] < 0);
+			if (find(removed.begin(), removed.end(), true) == removed.end())
+				return true;
+			RemoveInsns(m_code, removed);
+			changed = true;
+			return ComputeStackDepths(m_vm, m_cf, m_code, m_depth);
+		}
+
+		// Slots referring to the local become unknown once it is overwritten
+		static void Kill(s32 local, vector<Value>& locals, vector<Value>& stack)
+		{
+			for (auto& v : locals)
+			{
+				if (v.kind == Value::Copy && v.v == local)
+					v = UnknownValue;
+			}
+			for (auto& v : stack)
+			{
+				if (v.kind == Value::Copy && v.v == local)
+					v = UnknownValue;
+			}
+		}
+
+		bool Transfer(const Insn& insn, vector<Value>& locals, vector<Value>& stack) const
+		{
+			const u16 op = GenericLocalOp(insn.op);
+			s32 c;
+			if (GetIntConst(m_cf, insn, c))
+			{
+				stack.push_back({ Value::Const, 0, c });
+				return true;
+			}
+			if (IsLoad(op) && !IsWide(op))
+			{
+				const Value& l = locals[insn.a];
+				if ((l.kind == Value::Const && op == 0x15) || (l.kind == Value::Copy && l.load == op))
+					stack.push_back(l);
+				else
+					stack.push_back({ Value::Copy, op, insn.a });
+				return true;
+			}
+			if (IsStore(op))
+			{
+				const u32 slots = IsWide(op) ? 2 : 1;
+				if (stack.size() < slots)
+					return false;
+				const Value v = stack.back();
+				stack.resize(stack.size() - slots);
+				for (u32 i = 0; i < slots; i++)
+				{
+					Kill(insn.a + i, locals, stack);
+					locals[insn.a + i] = UnknownValue;
+				}
+				const u16 load = static_cast<u16>(op - 0x21);
+				if (slots == 1 && ((v.kind == Value::Const && op == 0x36) || (v.kind == Value::Copy && v.load == load && v.v != insn.a)))
+					locals[insn.a] = v;
+				return true;
+			}
+			if (op == 0x84) // iinc
+			{
+				const Value old = locals[insn.a];
+				Kill(insn.a, locals, stack);
+				locals[insn.a] = (old.kind == Value::Const)
+					? Value{ Value::Const, 0, static_cast<s32>(static_cast<u32>(old.v) + static_cast<u32>(insn.b)) }
+					: UnknownValue;
+				return true;
+			}
+
+			u32 pop, push;
+			if (!GetStackEffect(m_vm, m_cf, insn, pop, push) || stack.size() < pop)
+				return false;
+			stack.resize(stack.size() - pop);
+			stack.insert(stack.end(), push, UnknownValue);
+			return true;
+		}
+
+		// Forward dataflow over the locals, then loads of known values are replaced
+		bool Propagate(bool& changed)
+		{
+			auto& insns = m_code.insns;
+			const u32 n = static_cast<u32>(insns.size());
+			vector<bool> isLeader = FindTargets();
+			isLeader[0] = true;
+			for (u32 k = 0; k + 1 < n; k++)
+			{
+				if (IsBranch(insns[k].op) || CannotFallThrough(insns[k].op))
+					isLeader[k + 1] = true;
+			}
+
+			vector<vector<Value>> in(n);
+			in[0].assign(m_numLocals, UnknownValue); // arguments
+			vector<u32> work = { 0 };
+			vector<Value> locals, stack;
+			const auto Flow = [&](u32 to)
+			{
+				if (in[to].empty())
+				{
+					in[to] = locals;
+					work.push_back(to);
+					return;
+				}
+				bool updated = false;
+				for (u32 i = 0; i < m_numLocals; i++)
+				{
+					Value m = Meet(in[to][i], locals[i]);
+					if (m != in[to][i])
+					{
+						in[to][i] = m;
+						updated = true;
+					}
+				}
+				if (updated)
+					work.push_back(to);
+			};
+
+			// Walks the block starting at the leader, calling visit before each instruction
+			const auto RunBlock = [&](u32 leader, auto visit)
+			{
+				locals = in[leader];
+				stack.assign(m_depth[leader], UnknownValue);
+				for (u32 k = leader; k < n; k++)
+				{
+					if (k != leader && isLeader[k])
+					{
+						Flow(k);
+						break;
+					}
+					visit(k);
+					if (!Transfer(insns[k], locals, stack))
+						return false;
+					bool last = CannotFallThrough(insns[k].op) || IsBranch(insns[k].op);
+					if (last)
+					{
+						ForEachSuccessor(k, Flow);
+						break;
+					}
+				}
+				return true;
+			};
+
+			while (!work.empty())
+			{
+				u32 leader = work.back();
+				work.pop_back();
+				if (!RunBlock(leader, [](u32) {}))
+					return false;
+			}
+
+			bool rewritten = false;
+			for (u32 leader = 0; leader < n; leader++)
+			{
+				if (!isLeader[leader] || in[leader].empty())
+					continue;
+				RunBlock(leader, [&](u32 k)
+				{
+					Insn& insn = insns[k];
+					const u16 op = GenericLocalOp(insn.op);
+					if (!IsLoad(op) || IsWide(op))
+						return;
+					const Value& l = locals[insn.a];
+					if (l.kind == Value::Const && op == 0x15)
+						insn = MakeIntConst(insn.pc, l.v);
+					else if (l.kind == Value::Copy && l.load == op && l.v != insn.a)
+						insn = MakeLoad(op, insn.pc, l.v);
+					else
+						return;
+					rewritten = true;
+				});
+			}
+			work.clear(); // the replay above flows into blocks already done
+			changed |= rewritten;
+			return true;
+		}
+
+		// getstatic of a static final field with a ConstantValue int
+		bool GetConstantField(const Insn& insn, s32& v) const
+		{
+			const auto& cp = m_cf.constant_pool;
+			const auto& ref = cp[insn.a].val.f2;
+			const auto& nat = cp[ref.v2].val.f2;
+			JClass* owner = m_vm.FindClass(cp[cp[ref.v1].val.f1.v].val.f5.idx);
+			if (!owner || (owner != &m_jclass && owner->state != ClassState::Initialized))
+				return false; // the access would initialize the class
+			const u32 name = cp[nat.v1].val.f5.idx;
+			const u32 desc = cp[nat.v2].val.f5.idx;
+			const auto& ocp = owner->cf.constant_pool;
+			for (auto& f : owner->cf.fields)
+			{
+				if ((f.access_flags & 0x0018) != 0x0018 // ACC_STATIC, ACC_FINAL
+					|| ocp[f.name_index].val.f5.idx != name || ocp[f.descriptor_index].val.f5.idx != desc)
+					continue;
+				for (auto& attr : f.attributes)
+				{
+					if (attr.type != CFAttribute::Type::ConstantValue)
+						continue;
+					auto& cv = ocp[attr.val.constantValue.constantvalue_index];
+					if (cv.type != CFConstantPool::Type::Integer)
+						return false;
+					v = static_cast<s32>(cv.val.f3.v);
+					return true;
+				}
+				return false;
+			}
+			return false;
+		}
+
+		void FoldConstants(bool& changed)
+		{
+			auto& insns = m_code.insns;
+			const u32 n = static_cast<u32>(insns.size());
+			const vector<bool> isTarget = FindTargets();
+			vector<bool> removed(n, false);
+			vector<bool> touched(n, false);
+
+			// The instructions are replaced together, so control may only enter at the first one
+			const auto Take = [&](u32 first, u32 last)
+			{
+				for (u32 i = first; i <= last; i++)
+				{
+					if (touched[i] || (i != first && isTarget[i]))
+						return false;
+				}
+				for (u32 i = first; i <= last; i++)
+					touched[i] = true;
+				for (u32 i = first; i < last; i++)
+					removed[i] = true;
+				return true;
+			};
+
+			for (u32 k = 0; k < n; k++)
+			{
+				Insn& insn = insns[k];
+				s32 x = 0, y = 0, r;
+				const bool c1 = k >= 1 && GetIntConst(m_cf, insns[k - 1], y);
+				const bool c2 = c1 && k >= 2 && GetIntConst(m_cf, insns[k - 2], x);
+				s32 branch = -1; // 1 if the conditional branch is always taken, 0 if never
+
+				if (insn.op == 0xb2 && GetConstantField(insn, r) && Take(k, k)) // getstatic
+					insn = MakeIntConst(insn.pc, r);
+				else if (c2 && FoldBinary(insn.op, x, y, r) && Take(k - 2, k))
+					insn = MakeIntConst(insn.pc, r);
+				else if (c1 && FoldUnary(insn.op, y, r) && Take(k - 1, k))
+					insn = MakeIntConst(insn.pc, r);
+				else if (c2 && 0x9f <= insn.op && insn.op <= 0xa4 && Take(k - 2, k)) // if_icmp<cond>
+					branch = Compare(insn.op, x, y) ? 1 : 0;
+				else if (c1 && 0x99 <= insn.op && insn.op <= 0x9e && Take(k - 1, k)) // if<cond>
+					branch = Compare(static_cast<u16>(insn.op + 6), y, 0) ? 1 : 0;
+				else if (k >= 1 && insns[k - 1].op == 0x01 && (insn.op == 0xc6 || insn.op == 0xc7) && Take(k - 1, k)) // aconst_null, ifnull, ifnonnull
+					branch = (insn.op == 0xc6) ? 1 : 0;
+				else if (c1 && (insn.op == 0xaa || insn.op == 0xab) && Take(k - 1, k)) // tableswitch, lookupswitch
+				{
+					SwitchTable& s = m_code.switches[insn.a];
+					insn = { 0xa7, insn.pc, static_cast<s32>(LookupSwitch(s, y)), 0 }; // goto
+					s = SwitchTable(); // unused, its index is kept for the other switches
+				}
+				else if (insn.op == 0xa7 && static_cast<u32>(insn.a) == k + 1 && Take(k, k)) // goto to the next
+					removed[k] = true;
+				else if (k >= 1 && (insn.op == 0x57 || insn.op == 0x58) // pop, pop2
+					&& IsPurePush(m_cf, insns[k - 1], insn.op - 0x56) && Take(k - 1, k))
+					removed[k] = true;
+				else if (k >= 1 && IsStore(GenericLocalOp(insn.op)) && GenericLocalOp(insns[k - 1].op) == GenericLocalOp(insn.op) - 0x21
+					&& insns[k - 1].a == insn.a && Take(k - 1, k)) // stores the value loaded from the same local
+					removed[k] = true;
+				else
+					continue;
+
+				if (branch == 1)
+					insn = { 0xa7, insn.pc, insn.a, 0 }; // goto
+				else if (branch == 0)
+					removed[k] = true;
+				changed = true;
+			}
+			if (changed)
+				RemoveInsns(m_code, removed);
+		}
+
+		// Backward liveness of the locals, then stores no load can see become pop
+		void RemoveDeadStores(bool& changed)
+		{
+			auto& insns = m_code.insns;
+			const u32 n = static_cast<u32>(insns.size());
+			vector<vector<bool>> liveIn(n, vector<bool>(m_numLocals, false));
+			vector<bool> live(m_numLocals);
+			const auto LiveOut = [&](u32 k)
+			{
+				fill(live.begin(), live.end(), false);
+				ForEachSuccessor(k, [&](u32 s)
+				{
+					for (u32 i = 0; i < m_numLocals; i++)
+						live[i] = live[i] || liveIn[s][i];
+				});
+			};
+
+			for (bool updated = true; updated;)
+			{
+				updated = false;
+				for (u32 k = n; k-- > 0;)
+				{
+					LiveOut(k);
+					const u16 op = GenericLocalOp(insns[k].op);
+					const u32 slots = IsWide(op) ? 2 : 1;
+					if (IsStore(op))
+					{
+						for (u32 i = 0; i < slots; i++)
+							live[insns[k].a + i] = false;
+					}
+					else if (IsLoad(op) || op == 0x84) // iinc
+					{
+						for (u32 i = 0; i < slots; i++)
+							live[insns[k].a + i] = true;
+					}
+					if (live != liveIn[k])
+					{
+						liveIn[k] = live;
+						updated = true;
+					}
+				}
+			}
+
+			vector<bool> removed(n, false);
+			bool anyRemoved = false;
+			for (u32 k = 0; k < n; k++)
+			{
+				Insn& insn = insns[k];
+				const u16 op = GenericLocalOp(insn.op);
+				if (!IsStore(op) && op != 0x84)
+					continue;
+				LiveOut(k);
+				if (live[insn.a] || (IsWide(op) && live[insn.a + 1]))
+					continue;
+				if (op == 0x84)
+				{
+					removed[k] = true;
+					anyRemoved = true;
+				}
+				else
+					insn = { static_cast<u16>(IsWide(op) ? 0x58 : 0x57), insn.pc, 0, 0 }; // pop2, pop
+				changed = true;
+			}
+			if (anyRemoved)
+				RemoveInsns(m_code, removed);
+		}
+	};
+}
+
+void jvm::detail::OptimizeCode(VM& vm, JClass& jclass, const CFMethod& method, DecodedCode& code)
+{
+	if (!vm.GetOptimizeBytecode() || !method.verified || !code.handlerInsn.empty())
+		return;
+	for (auto& insn : code.insns)
+	{
+		if (insn.op == 0xa8 || insn.op == 0xa9 || insn.op == 0xc9 || insn.op >= 0x100) // jsr, ret, jsr_w, VM internal
+			return;
+	}
+	Optimizer(vm, jclass, method, code).Run();
+}
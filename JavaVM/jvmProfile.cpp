@@ -0,0 +1,163 @@
+#include "jvm.h"
+#include "jvmClass.h"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <tuple>
+
+using namespace std;
+using namespace jvm;
+
+// Heap profile.
+//
+// The histogram walks every object in the heap. Allocation samples are taken by NewObject from
+// the site the interpreter sets before each allocating instruction, so sampling costs one
+// decrement per allocation. Reports are either aligned text or CSV with a header line.
+
+namespace
+{
+	const char* GetTypeName(PrimitiveType type)
+	{
+		switch (type)
+		{
+		case PrimitiveType::Boolean: return "boolean";
+		case PrimitiveType::Char: return "char";
+		case PrimitiveType::Float: return "float";
+		case PrimitiveType::Double: return "double";
+		case PrimitiveType::Byte: return "byte";
+		case PrimitiveType::Short: return "short";
+		case PrimitiveType::Int: return "int";
+		case PrimitiveType::Long: return "long";
+		case PrimitiveType::Class: return "Object";
+		default: return "void";
+		}
+	}
+
+	string Narrow(const wstring& str)
+	{
+		string s;
+		for (wchar_t c : str)
+			s += (c < 0x80) ? static_cast<char>(c) : '?';
+		return s;
+	}
+
+	string GetObjectTypeName(const vector<wstring>& stringPool, ObjectKind kind, PrimitiveType type, const JClass* clazz)
+	{
+		switch (kind)
+		{
+		case ObjectKind::Array:
+			if (type == PrimitiveType::Class && clazz)
+				return Narrow(stringPool[clazz->name]) + "[]";
+			return string(GetTypeName(type)) + "[]";
+		case ObjectKind::String:
+			return (type == PrimitiveType::Byte) ? "java/lang/String (latin1)" : "java/lang/String (utf16)";
+		default:
+			return clazz ? Narrow(stringPool[clazz->name]) : "?";
+		}
+	}
+
+	string GetSiteName(const vector<wstring>& stringPool, const AllocationSite& site)
+	{
+		if (!site.method)
+			return "<host>";
+		const auto& cp = site.owner->cf.constant_pool;
+		return Narrow(stringPool[site.owner->name]) + "." + Narrow(stringPool[cp[site.method->name_index].val.f5.idx])
+			+ Narrow(stringPool[cp[site.method->descriptor_index].val.f5.idx]);
+	}
+
+	// Names containing commas are quoted for CSV
+	string Quote(const string& str)
+	{
+		if (str.find(',') == string::npos)
+			return str;
+		return "\"" + str + "\"";
+	}
+}
+
+void VM::SetAllocationSampling(u32 interval)
+{
+	m_allocSampleInterval = interval;
+	m_allocCountdown = interval;
+	m_allocSamples.clear();
+}
+
+vector<HeapHistogramEntry> VM::GetHeapHistogram() const
+{
+	map<tuple<ObjectKind, PrimitiveType, const JClass*>, HeapHistogramEntry> groups;
+	for (auto& obj : m_instanceTable)
+	{
+		auto& e = groups.emplace(make_tuple(obj.kind, obj.type, obj.clazz), HeapHistogramEntry{ obj.kind, obj.type, obj.clazz, 0, 0 }).first->second;
+		e.count++;
+		e.bytes += GetPayloadSize(obj);
+	}
+	vector<HeapHistogramEntry> entries;
+	for (auto& g : groups)
+		entries.push_back(g.second);
+	stable_sort(entries.begin(), entries.end(), [](const HeapHistogramEntry& a, const HeapHistogramEntry& b) { return a.bytes > b.bytes; });
+	return entries;
+}
+
+void VM::PrintHeapHistogram(ostream& os, ReportFormat format) const
+{
+	auto entries = GetHeapHistogram();
+	if (format == ReportFormat::Csv)
+	{
+		os << "type,count,bytes" << endl;
+		for (auto& e : entries)
+			os << Quote(GetObjectTypeName(m_stringPool, e.kind, e.type, e.clazz)) << ',' << e.count << ',' << e.bytes << endl;
+		return;
+	}
+
+	size_t totalCount = 0, totalBytes = 0;
+	os << "Heap histogram" << endl;
+	for (auto& e : entries)
+	{
+		os << '\t' << e.count << '\t' << e.bytes << '\t' << GetObjectTypeName(m_stringPool, e.kind, e.type, e.clazz) << endl;
+		totalCount += e.count;
+		totalBytes += e.bytes;
+	}
+	os << "Total " << totalCount << " objects, " << totalBytes << " bytes" << endl;
+}
+
+void VM::PrintAllocationSites(ostream& os, ReportFormat format) const
+{
+	struct Site
+	{
+		AllocationSite site;
+		string type;
+		size_t count;
+		size_t bytes;
+	};
+	map<tuple<const CFMethod*, u32, string>, Site> groups;
+	for (auto& s : m_allocSamples)
+	{
+		string type = GetObjectTypeName(m_stringPool, s.kind, s.type, s.clazz);
+		auto& g = groups.emplace(make_tuple(s.site.method, s.site.pc, type), Site{ s.site, type, 0, 0 }).first->second;
+		g.count++;
+		g.bytes += s.size;
+	}
+	vector<Site> sites;
+	for (auto& g : groups)
+		sites.push_back(g.second);
+	stable_sort(sites.begin(), sites.end(), [](const Site& a, const Site& b) { return a.bytes > b.bytes; });
+
+	// Each sample stands for interval allocations
+	const size_t scale = m_allocSampleInterval ? m_allocSampleInterval : 1;
+	if (format == ReportFormat::Csv)
+	{
+		os << "method,pc,type,samples,estimated_count,estimated_bytes" << endl;
+		for (auto& s : sites)
+		{
+			os << Quote(GetSiteName(m_stringPool, s.site)) << ',' << s.site.pc << ',' << Quote(s.type) << ','
+				<< s.count << ',' << s.count * scale << ',' << s.bytes * scale << endl;
+		}
+		return;
+	}
+
+	os << "Allocation sites (1 in " << scale << " allocations sampled)" << endl;
+	for (auto& s : sites)
+	{
+		os << '\t' << s.count * scale << '\t' << s.bytes * scale << '\t' << s.type << " at "
+			<< GetSiteName(m_stringPool, s.site) << " pc " << s.site.pc << endl;
+	}
+}
@@ -0,0 +1,33 @@
+#include "jvm.h"
+
+using namespace std;
+using namespace jvm;
+
+// Safepoints.
+//
+// The interpreter polls m_safepointPoll at method entry and on taken backward branches, which is
+// one load and one branch that is never taken until an operation is requested. Before running the
+// operations it stores the current instruction to the top frame, so GetFrames gives a consistent
+// view of the Java stack. Compiled methods poll on backward branches too, and the caller's frame
+// is stored before calling them. Loop kernels do not poll, they run counted loops that reach the
+// next poll in bounded time.
+
+void VM::RequestSafepoint(function<void(VM&)> operation)
+{
+	lock_guard<mutex> lock(m_safepointMutex);
+	m_safepointOperations.push_back(move(operation));
+	m_safepointPoll.store(true, memory_order_release);
+}
+
+void VM::Safepoint()
+{
+	// Operations may request more operations, they run at the next poll
+	vector<function<void(VM&)>> operations;
+	{
+		lock_guard<mutex> lock(m_safepointMutex);
+		operations.swap(m_safepointOperations);
+		m_safepointPoll.store(false, memory_order_relaxed);
+	}
+	for (auto& op : operations)
+		op(*this);
+}
@@ -0,0 +1,458 @@
+#include "jvm.h"
+#include "jvmClass.h"
+#include <fstream>
+#include <iostream>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace jvm;
+
+// Heap snapshot.
+//
+// The file is laid out so that it can be used in place after a single copy-on-write mapping:
+//   SnapshotHeader
+//   SnapshotClass records, each followed by its static field values, its resolved string
+//   constants and its name
+//   SnapshotObject records, for handles 1 ~ objectCount
+//   SnapshotString records, the interned string table
+//   payloads of the objects
+// References are stored as handles, which restore unchanged, so restoring only relocates the
+// payload pointers to the mapping and the class pointers to the loaded classes. Before that,
+// every record must match the payload size of its kind and class, and every reference held by
+// the classes and objects must be null or a handle of the snapshot.
+// All records are 8 byte aligned and in the byte order of the host.
+
+namespace jvm
+{
+	namespace detail
+	{
+		// File mapped copy-on-write, unmapped when the VM is destroyed
+		struct MappedFile
+		{
+			u8* data = nullptr;
+			size_t size = 0;
+#if defined(_WIN32)
+			HANDLE file = INVALID_HANDLE_VALUE;
+			HANDLE mapping = nullptr;
+#endif
+
+			bool Map(const char* path);
+			~MappedFile();
+		};
+	}
+}
+
+namespace
+{
+	const u32 SnapshotMagic = 0x50414548; // "HEAP"
+	const u32 SnapshotVersion = 2;
+
+	struct SnapshotHeader
+	{
+		u32 magic;
+		u32 version;
+		u32 classCount;
+		u32 objectCount;
+		u32 stringCount;
+		u32 reserved;
+		u64 objectOffset;
+		u64 stringOffset;
+		u64 size;
+	};
+
+	struct SnapshotClass
+	{
+		u32 nameLength; // UTF-16 chars
+		u32 constantPoolCount; // resolved string constants
+		u32 staticCount; // static field values, 8 bytes each
+		u32 instanceSize;
+		u32 state; // ClassState
+		u32 reserved;
+	};
+
+	struct SnapshotObject
+	{
+		u64 dataOffset;
+		u64 dataSize;
+		s32 length;
+		s32 hash;
+		s32 classIndex; // -1 if clazz is null
+		u8 kind;
+		u8 type;
+		u8 reserved[2];
+	};
+
+	struct SnapshotString
+	{
+		s32 hash;
+		u32 handle;
+	};
+
+	u64 Align8(u64 v)
+	{
+		return (v + 7) & ~static_cast<u64>(7);
+	}
+
+	u64 GetClassRecordSize(u32 nameLength, u32 constantPoolCount, u32 staticCount)
+	{
+		return Align8(sizeof(SnapshotClass) + 8 * static_cast<u64>(staticCount) + 4 * static_cast<u64>(constantPoolCount) + 2 * static_cast<u64>(nameLength));
+	}
+}
+
+bool detail::MappedFile::Map(const char* path)
+{
+#if defined(_WIN32)
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER len;
+	if (!GetFileSizeEx(file, &len) || len.QuadPart == 0)
+		return false;
+	mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (!mapping)
+		return false;
+	data = static_cast<u8*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+	size = static_cast<size_t>(len.QuadPart);
+	return data != nullptr;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	data = static_cast<u8*>(p);
+	size = static_cast<size_t>(st.st_size);
+	return true;
+#endif
+}
+
+detail::MappedFile::~MappedFile()
+{
+#if defined(_WIN32)
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+#else
+	if (data)
+		munmap(data, size);
+#endif
+}
+
+bool VM::SaveHeapSnapshot(const char* path)
+{
+	ofstream ofs(path, ios::binary);
+	if (!ofs)
+	{
+		cout << "Error: cannot create heap snapshot : " << path << endl;
+		return false;
+	}
+	u64 pos = 0;
+	const auto Write = [&](const void* p, u64 size)
+	{
+		ofs.write(static_cast<const char*>(p), static_cast<streamsize>(size));
+		pos += size;
+	};
+	const auto Pad = [&]()
+	{
+		static const u8 zero[8] = {};
+		Write(zero, Align8(pos) - pos);
+	};
+
+	vector<const JClass*> classes;
+	unordered_map<const JClass*, s32> classIndex;
+	u64 classesSize = 0;
+	for (auto& jc : m_classPool)
+	{
+		classIndex[&jc] = static_cast<s32>(classes.size());
+		classes.push_back(&jc);
+		classesSize += GetClassRecordSize(static_cast<u32>(m_stringPool[jc.name].size()), static_cast<u32>(jc.stringConstants.size()), static_cast<u32>(jc.staticFields.size()));
+	}
+
+	SnapshotHeader header = {};
+	header.magic = SnapshotMagic;
+	header.version = SnapshotVersion;
+	header.classCount = static_cast<u32>(classes.size());
+	header.objectCount = static_cast<u32>(m_handleTable.size() - 1);
+	header.stringCount = static_cast<u32>(m_stringTable.size());
+	header.objectOffset = sizeof(SnapshotHeader) + classesSize;
+	header.stringOffset = header.objectOffset + sizeof(SnapshotObject) * static_cast<u64>(header.objectCount);
+	u64 dataOffset = Align8(header.stringOffset + sizeof(SnapshotString) * static_cast<u64>(header.stringCount));
+	header.size = dataOffset;
+	for (size_t i = 1; i < m_handleTable.size(); i++)
+		header.size += Align8(GetPayloadSize(*m_handleTable[i]));
+	Write(&header, sizeof(header));
+
+	// Classes
+	for (const JClass* jc : classes)
+	{
+		const wstring& name = m_stringPool[jc->name];
+		SnapshotClass rec = { static_cast<u32>(name.size()), static_cast<u32>(jc->stringConstants.size()),
+			static_cast<u32>(jc->staticFields.size()), jc->instanceSize, static_cast<u32>(jc->state), 0 };
+		Write(&rec, sizeof(rec));
+		for (auto& f : jc->staticFields)
+		{
+			u64 bits = 0;
+			memcpy(&bits, &f.obj.val, sizeof(bits));
+			Write(&bits, sizeof(bits));
+		}
+		Write(jc->stringConstants.data(), 4 * jc->stringConstants.size());
+		for (wchar_t c : name)
+		{
+			u16 ch = static_cast<u16>(c);
+			Write(&ch, 2);
+		}
+		Pad();
+	}
+
+	// Objects
+	u64 offset = dataOffset;
+	for (size_t i = 1; i < m_handleTable.size(); i++)
+	{
+		const JObject& obj = *m_handleTable[i];
+		SnapshotObject rec = {};
+		rec.dataOffset = offset;
+		rec.dataSize = GetPayloadSize(obj);
+		rec.length = obj.length;
+		rec.hash = obj.hash;
+		rec.classIndex = obj.clazz ? classIndex[obj.clazz] : -1;
+		rec.kind = static_cast<u8>(obj.kind);
+		rec.type = static_cast<u8>(obj.type);
+		Write(&rec, sizeof(rec));
+		offset += Align8(rec.dataSize);
+	}
+	for (auto& s : m_stringTable)
+	{
+		SnapshotString rec = { s.first, s.second };
+		Write(&rec, sizeof(rec));
+	}
+	Pad();
+
+	// Payloads
+	for (size_t i = 1; i < m_handleTable.size(); i++)
+	{
+		const JObject& obj = *m_handleTable[i];
+		Write(obj.data.get(), GetPayloadSize(obj));
+		Pad();
+	}
+
+	if (!ofs || pos != header.size)
+	{
+		cout << "Error: failed to write heap snapshot : " << path << endl;
+		return false;
+	}
+	return true;
+}
+
+bool VM::RestoreHeapSnapshot(const char* path)
+{
+	if (m_handleTable.size() != 1)
+	{
+		cout << "Error: heap snapshot must be restored into an empty heap" << endl;
+		return false;
+	}
+
+	auto file = make_shared<detail::MappedFile>();
+	if (!file->Map(path))
+	{
+		cout << "Error: cannot map heap snapshot : " << path << endl;
+		return false;
+	}
+	u8* base = file->data;
+	const auto Invalid = [&]()
+	{
+		cout << "Error: heap snapshot does not match the loaded classes : " << path << endl;
+		return false;
+	};
+
+	const auto& header = *reinterpret_cast<const SnapshotHeader*>(base);
+	if (file->size < sizeof(SnapshotHeader) || header.magic != SnapshotMagic || header.version != SnapshotVersion
+		|| header.size != file->size || header.classCount < m_classPool.size())
+		return Invalid();
+	// The record tables must lie within the file, written so that the sums cannot wrap
+	const auto InFile = [&](u64 offset, u64 count, u64 recordSize)
+	{
+		return offset % 8 == 0 && offset <= header.size && count <= (header.size - offset) / recordSize;
+	};
+	if (!InFile(header.objectOffset, header.objectCount, sizeof(SnapshotObject))
+		|| !InFile(header.stringOffset, header.stringCount, sizeof(SnapshotString)))
+		return Invalid();
+	// References are handles of restored objects, or null
+	const auto IsHandle = [&](const u8* p)
+	{
+		u32 handle;
+		memcpy(&handle, p, 4);
+		return handle <= header.objectCount;
+	};
+
+	// Classes must be loaded in the same order as when the snapshot was taken.
+	// Those loaded later on demand are loaded from the class path.
+	vector<JClass*> classes;
+	u64 pos = sizeof(SnapshotHeader);
+	auto it = m_classPool.begin();
+	for (u32 k = 0; k < header.classCount; k++, ++it)
+	{
+		if (pos + sizeof(SnapshotClass) > header.objectOffset)
+			return Invalid();
+		const auto& rec = *reinterpret_cast<const SnapshotClass*>(base + pos);
+		const u64 next = pos + GetClassRecordSize(rec.nameLength, rec.constantPoolCount, rec.staticCount);
+		if (next > header.objectOffset)
+			return Invalid();
+		const u8* p = base + pos + sizeof(SnapshotClass);
+		const u8* constants = p + 8 * static_cast<size_t>(rec.staticCount);
+		const u8* name = constants + 4 * static_cast<size_t>(rec.constantPoolCount);
+		wstring recName(rec.nameLength, L'\0');
+		for (u32 i = 0; i < rec.nameLength; i++)
+		{
+			u16 ch;
+			memcpy(&ch, name + 2 * i, 2);
+			recName[i] = static_cast<wchar_t>(ch);
+		}
+
+		if (it == m_classPool.end())
+		{
+			const size_t loaded = m_classPool.size();
+			if (!LoadClass(InternString(wstring(recName))) || m_classPool.size() != loaded + 1)
+				return Invalid();
+			it = prev(m_classPool.end());
+		}
+		JClass& jc = *it;
+		bool same = m_stringPool[jc.name] == recName && rec.constantPoolCount == jc.stringConstants.size()
+			&& rec.staticCount == jc.staticFields.size() && rec.instanceSize == jc.instanceSize
+			&& rec.state <= static_cast<u32>(ClassState::Initialized);
+		if (!same)
+			return Invalid();
+		for (u32 i = 0; i < rec.staticCount; i++)
+		{
+			const JType& t = jc.staticFields[i].type;
+			if ((t.aryDim > 0 || t.type == PrimitiveType::Class) && !IsHandle(p + 8 * static_cast<size_t>(i)))
+				return Invalid();
+		}
+		for (u32 i = 0; i < rec.constantPoolCount; i++)
+		{
+			if (!IsHandle(constants + 4 * static_cast<size_t>(i)))
+				return Invalid();
+		}
+		classes.push_back(&jc);
+		pos = next;
+	}
+
+	// Objects, in handle order so that handles are preserved
+	const auto* objects = reinterpret_cast<const SnapshotObject*>(base + header.objectOffset);
+	const auto IsValidObject = [&](const SnapshotObject& rec)
+	{
+		if (rec.dataOffset > header.size || rec.dataSize > header.size - rec.dataOffset
+			|| rec.classIndex < -1 || rec.classIndex >= static_cast<s32>(classes.size()) || rec.length < 0)
+			return false;
+		const JClass* clazz = (rec.classIndex >= 0) ? classes[rec.classIndex] : nullptr;
+		const PrimitiveType type = static_cast<PrimitiveType>(rec.type);
+		switch (static_cast<ObjectKind>(rec.kind))
+		{
+		case ObjectKind::Array:
+			// Reference arrays may have the element class, primitive arrays have none
+			if (type != PrimitiveType::Class && (GetPrimitiveSize(type) == 0 || clazz))
+				return false;
+			break;
+		case ObjectKind::String:
+			if (type != PrimitiveType::Byte && type != PrimitiveType::Char)
+				return false;
+			break;
+		case ObjectKind::Instance:
+			if (type != PrimitiveType::Class || !clazz || static_cast<u32>(rec.length) != clazz->instanceSize)
+				return false;
+			break;
+		default:
+			return false;
+		}
+		const JObject obj = { 0, nullptr, clazz, rec.length, 0, 0, type, static_cast<ObjectKind>(rec.kind) };
+		return rec.dataSize == GetPayloadSize(obj);
+	};
+	// The references held by an object, once its record is valid
+	const auto HasValidReferences = [&](const SnapshotObject& rec)
+	{
+		const u8* data = base + rec.dataOffset;
+		if (rec.kind == static_cast<u8>(ObjectKind::Array) && rec.type == static_cast<u8>(PrimitiveType::Class))
+		{
+			for (s32 i = 0; i < rec.length; i++)
+			{
+				if (!IsHandle(data + 4 * static_cast<size_t>(i)))
+					return false;
+			}
+		}
+		if (rec.kind == static_cast<u8>(ObjectKind::Instance))
+		{
+			for (const JClass* c = classes[rec.classIndex]; c; c = c->super)
+			{
+				for (auto& f : c->instanceFields)
+				{
+					if (f.type == PrimitiveType::Class && !IsHandle(data + f.offset))
+						return false;
+				}
+			}
+		}
+		return true;
+	};
+	for (u32 i = 0; i < header.objectCount; i++)
+	{
+		if (!IsValidObject(objects[i]) || !HasValidReferences(objects[i]))
+			return Invalid();
+	}
+	const auto* strings = reinterpret_cast<const SnapshotString*>(base + header.stringOffset);
+	for (u32 i = 0; i < header.stringCount; i++)
+	{
+		if (strings[i].handle == 0 || strings[i].handle > header.objectCount)
+			return Invalid();
+	}
+	for (u32 i = 0; i < header.objectCount; i++)
+	{
+		const SnapshotObject& rec = objects[i];
+		u32 handle = static_cast<u32>(m_handleTable.size());
+		m_instanceTable.emplace_back(JObject{ 0, ObjectData(base + rec.dataOffset, ObjectDataDeleter{ false }),
+			(rec.classIndex >= 0) ? classes[rec.classIndex] : nullptr, rec.length, handle, rec.hash,
+			static_cast<PrimitiveType>(rec.type), static_cast<ObjectKind>(rec.kind) });
+		m_handleTable.push_back(&m_instanceTable.back());
+	}
+
+	// Interned strings
+	for (u32 i = 0; i < header.stringCount; i++)
+		m_stringTable.emplace(strings[i].hash, strings[i].handle);
+
+	// Static fields and resolved string constants
+	pos = sizeof(SnapshotHeader);
+	for (JClass* jc : classes)
+	{
+		const auto& rec = *reinterpret_cast<const SnapshotClass*>(base + pos);
+		const u8* p = base + pos + sizeof(SnapshotClass);
+		for (auto& f : jc->staticFields)
+		{
+			memcpy(&f.obj.val, p, sizeof(u64));
+			p += 8;
+		}
+		memcpy(jc->stringConstants.data(), p, 4 * jc->stringConstants.size());
+		jc->state = static_cast<ClassState>(rec.state);
+		pos += GetClassRecordSize(rec.nameLength, rec.constantPoolCount, rec.staticCount);
+	}
+
+	m_snapshot = move(file);
+	return true;
+}
@@ -0,0 +1,310 @@
+#include "jvmString.h"
+#include <cassert>
+
+using namespace std;
+using namespace jvm;
+
+s32 jvm::StringHashCode(JObject& s)
+{
+	if (s.hash != 0 || s.length == 0)
+		return s.hash;
+
+	u32 h = 0;
+	if (IsLatin1String(s))
+	{
+		for (s32 i = 0; i < s.length; i++)
+			h = 31 * h + s.data[i];
+	}
+	else
+	{
+		for (s32 i = 0; i < s.length; i++)
+			h = 31 * h + StringCharAt(s, i);
+	}
+	s.hash = static_cast<s32>(h);
+	return s.hash;
+}
+
+bool jvm::StringEquals(const JObject& a, const JObject& b)
+{
+	if (&a == &b)
+		return true;
+	if (a.length != b.length)
+		return false;
+	// The coder is canonical, so a Latin-1 string never equals a UTF-16 one
+	if (a.type != b.type)
+		return false;
+	size_t sz = IsLatin1String(a) ? a.length : 2 * a.length;
+	return memcmp(a.data.get(), b.data.get(), sz) == 0;
+}
+
+vector<u16> jvm::StringToUtf16(const wstring& str)
+{
+	vector<u16> u;
+	u.reserve(str.size());
+	for (auto c : str)
+	{
+		u32 ch = static_cast<u32>(c);
+		if (ch >= 0x10000)
+		{
+			ch -= 0x10000;
+			u.push_back(static_cast<u16>(0xD800 + (ch >> 10)));
+			u.push_back(static_cast<u16>(0xDC00 + (ch & 0x3FF)));
+		}
+		else
+			u.push_back(static_cast<u16>(ch));
+	}
+	return u;
+}
+
+string jvm::StringToUtf8(const JObject& s)
+{
+	string out;
+	out.reserve(s.length);
+	for (s32 i = 0; i < s.length; i++)
+	{
+		u32 ch = StringCharAt(s, i);
+		if (0xD800 <= ch && ch < 0xDC00 && i + 1 < s.length)
+		{
+			u32 low = StringCharAt(s, i + 1);
+			if (0xDC00 <= low && low < 0xE000)
+			{
+				ch = 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
+				i++;
+			}
+		}
+		if (ch < 0x80)
+			out += static_cast<char>(ch);
+		else if (ch < 0x800)
+		{
+			out += static_cast<char>(0xC0 | (ch >> 6));
+			out += static_cast<char>(0x80 | (ch & 0x3F));
+		}
+		else if (ch < 0x10000)
+		{
+			out += static_cast<char>(0xE0 | (ch >> 12));
+			out += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (ch & 0x3F));
+		}
+		else
+		{
+			out += static_cast<char>(0xF0 | (ch >> 18));
+			out += static_cast<char>(0x80 | ((ch >> 12) & 0x3F));
+			out += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (ch & 0x3F));
+		}
+	}
+	return out;
+}
+
+JObject& VM::NewString(const u16* chars, s32 len)
+{
+	JObject* interned = m_dedupStrings ? FindInternedString(chars, len) : nullptr;
+	if (interned)
+	{
+		// The payload is immutable and the interned string lives as long as the VM
+		JObject& str = NewObject(ObjectKind::String, interned->type, len, 0);
+		str.data = ObjectData(interned->data.get(), ObjectDataDeleter{ false });
+		str.hash = interned->hash;
+		return str;
+	}
+
+	bool latin1 = true;
+	for (s32 i = 0; i < len; i++)
+	{
+		if (chars[i] > 0xFF)
+		{
+			latin1 = false;
+			break;
+		}
+	}
+
+	JObject* str;
+	if (latin1)
+	{
+		str = &NewObject(ObjectKind::String, PrimitiveType::Byte, len, len);
+		for (s32 i = 0; i < len; i++)
+			str->data[i] = static_cast<u8>(chars[i]);
+	}
+	else
+	{
+		str = &NewObject(ObjectKind::String, PrimitiveType::Char, len, 2 * static_cast<size_t>(len));
+		memcpy(str->data.get(), chars, 2 * static_cast<size_t>(len));
+	}
+	return *str;
+}
+
+JObject* VM::FindInternedString(const u16* chars, s32 len)
+{
+	u32 hash = 0;
+	for (s32 i = 0; i < len; i++)
+		hash = 31 * hash + chars[i];
+	auto range = m_stringTable.equal_range(static_cast<s32>(hash));
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		JObject& s = GetObject(it->second);
+		if (s.length != len)
+			continue;
+		s32 i = 0;
+		while (i < len && StringCharAt(s, i) == chars[i])
+			i++;
+		if (i == len)
+			return &s;
+	}
+	return nullptr;
+}
+
+JObject* VM::FindInternedString(const JObject& str)
+{
+	s32 hash = StringHashCode(const_cast<JObject&>(str));
+	auto range = m_stringTable.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		JObject& s = GetObject(it->second);
+		if (StringEquals(s, str))
+			return &s;
+	}
+	return nullptr;
+}
+
+JObject& VM::InternJavaString(JObject& str)
+{
+	JObject* s = FindInternedString(str);
+	if (s)
+		return *s;
+	m_stringTable.emplace(StringHashCode(str), str.handle);
+	return str;
+}
+
+JObject& VM::GetStringConstant(u32 stringPoolIdx)
+{
+	// Literals are interned, equal literals of all classes are the same object
+	auto chars = StringToUtf16(m_stringPool[stringPoolIdx]);
+	const s32 len = static_cast<s32>(chars.size());
+	JObject* str = FindInternedString(chars.data(), len);
+	return str ? *str : InternJavaString(NewString(chars.data(), len));
+}
+
+namespace
+{
+	// java.lang.String natives, args[0] is the receiver
+
+	void String_length(VM& vm, const u32* args, u32* ret)
+	{
+		ret[0] = vm.GetObject(args[0]).length;
+	}
+
+	void String_isEmpty(VM& vm, const u32* args, u32* ret)
+	{
+		ret[0] = vm.GetObject(args[0]).length == 0;
+	}
+
+	void String_charAt(VM& vm, const u32* args, u32* ret)
+	{
+		JObject& self = vm.GetObject(args[0]);
+		s32 idx = static_cast<s32>(args[1]);
+		if (idx < 0 || self.length <= idx)
+			assert(0); // throw StringIndexOutOfBoundsException
+		ret[0] = StringCharAt(self, idx);
+	}
+
+	void String_hashCode(VM& vm, const u32* args, u32* ret)
+	{
+		ret[0] = static_cast<u32>(StringHashCode(vm.GetObject(args[0])));
+	}
+
+	void String_equals(VM& vm, const u32* args, u32* ret)
+	{
+		if (args[1] == 0)
+			ret[0] = 0;
+		else
+		{
+			JObject& other = vm.GetObject(args[1]);
+			ret[0] = other.kind == ObjectKind::String && StringEquals(vm.GetObject(args[0]), other);
+		}
+	}
+
+	void String_intern(VM& vm, const u32* args, u32* ret)
+	{
+		ret[0] = vm.InternJavaString(vm.GetObject(args[0])).handle;
+	}
+
+	void String_indexOf(VM& vm, const u32* args, u32* ret)
+	{
+		JObject& self = vm.GetObject(args[0]);
+		ret[0] = static_cast<u32>(-1);
+		for (s32 i = 0; i < self.length; i++)
+		{
+			if (StringCharAt(self, i) == args[1])
+			{
+				ret[0] = i;
+				break;
+			}
+		}
+	}
+
+	u32 Substring(VM& vm, JObject& self, s32 begin, s32 end)
+	{
+		if (begin < 0 || end > self.length || begin > end)
+			assert(0); // throw StringIndexOutOfBoundsException
+		vector<u16> chars(end - begin);
+		for (s32 i = begin; i < end; i++)
+			chars[i - begin] = StringCharAt(self, i);
+		return vm.NewString(chars.data(), end - begin).handle;
+	}
+
+	void String_substring(VM& vm, const u32* args, u32* ret)
+	{
+		JObject& self = vm.GetObject(args[0]);
+		ret[0] = Substring(vm, self, static_cast<s32>(args[1]), self.length);
+	}
+
+	void String_substringRange(VM& vm, const u32* args, u32* ret)
+	{
+		ret[0] = Substring(vm, vm.GetObject(args[0]), static_cast<s32>(args[1]), static_cast<s32>(args[2]));
+	}
+
+	void String_concat(VM& vm, const u32* args, u32* ret)
+	{
+		if (args[1] == 0)
+			assert(0); // throw NullPointerException
+		JObject& self = vm.GetObject(args[0]);
+		JObject& other = vm.GetObject(args[1]);
+		vector<u16> chars(self.length + other.length);
+		for (s32 i = 0; i < self.length; i++)
+			chars[i] = StringCharAt(self, i);
+		for (s32 i = 0; i < other.length; i++)
+			chars[self.length + i] = StringCharAt(other, i);
+		ret[0] = vm.NewString(chars.data(), static_cast<s32>(chars.size())).handle;
+	}
+
+	struct StringMethodEntry
+	{
+		const wchar_t* name;
+		const wchar_t* desc;
+		detail::IntrinsicFunc func;
+	};
+
+	const StringMethodEntry StringMethodTable[] =
+	{
+		{ L"length", L"()I", String_length },
+		{ L"isEmpty", L"()Z", String_isEmpty },
+		{ L"charAt", L"(I)C", String_charAt },
+		{ L"hashCode", L"()I", String_hashCode },
+		{ L"equals", L"(Ljava/lang/Object;)Z", String_equals },
+		{ L"intern", L"()Ljava/lang/String;", String_intern },
+		{ L"indexOf", L"(I)I", String_indexOf },
+		{ L"substring", L"(I)Ljava/lang/String;", String_substring },
+		{ L"substring", L"(II)Ljava/lang/String;", String_substringRange },
+		{ L"concat", L"(Ljava/lang/String;)Ljava/lang/String;", String_concat },
+	};
+}
+
+detail::IntrinsicFunc jvm::detail::FindStringMethod(const wstring& name, const wstring& desc)
+{
+	for (auto& e : StringMethodTable)
+	{
+		if (name == e.name && desc == e.desc)
+			return e.func;
+	}
+	return nullptr;
+}
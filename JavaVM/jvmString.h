@@ -0,0 +1,32 @@
+#pragma once
+
+#include "jvm.h"
+
+namespace jvm
+{
+	inline bool IsLatin1String(const JObject& s)
+	{
+		return s.type == PrimitiveType::Byte;
+	}
+
+	inline u16 StringCharAt(const JObject& s, s32 idx)
+	{
+		if (IsLatin1String(s))
+			return s.data[idx];
+		u16 c;
+		memcpy(&c, s.data.get() + 2 * idx, 2);
+		return c;
+	}
+
+	s32 StringHashCode(JObject& s);
+	bool StringEquals(const JObject& a, const JObject& b);
+	std::vector<u16> StringToUtf16(const std::wstring& str);
+	std::string StringToUtf8(const JObject& s);
+
+	namespace detail
+	{
+		// Native implementation of a java.lang.String instance method, called like an intrinsic
+		// with args[0] the receiver. Returns null if the method is not supported.
+		IntrinsicFunc FindStringMethod(const std::wstring& name, const std::wstring& desc);
+	}
+}
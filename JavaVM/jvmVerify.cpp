@@ -0,0 +1,647 @@
+#include "jvmDecode.h"
+#include "jvmClass.h"
+#include <iostream>
+#include <cstring>
+
+using namespace std;
+using namespace jvm;
+using namespace jvm::detail;
+
+// Bytecode verifier.
+//
+// Every method is checked once when its class is loaded, by type inference over the
+// instructions: the types of the locals and of the operand stack are propagated along
+// all paths, including exception handlers, until they are stable. References are not
+// distinguished by class, the array and field instructions check the kind and class of the
+// object when they run. A method is accepted if
+//   - the code decodes, branch targets and handlers are instruction boundaries
+//   - every instruction finds operands of the expected types, the stack neither
+//     underflows nor exceeds max_stack and locals are within max_locals
+//   - stack shapes agree where paths merge, and execution cannot fall off the end
+//   - constant pool operands refer to entries of the expected kind
+//   - the interpreter runs the instruction: invokedynamic, multianewarray and ldc of class or
+//     method constants are rejected
+// Verified methods are run without the guards of the checked interpreter, see CheckInsn.
+
+namespace
+{
+	enum class VType : u8
+	{
+		Top, // unusable
+		Int,
+		Float,
+		Long, // lower slot, Long2 follows
+		Long2,
+		Double,
+		Double2,
+		Null,
+		Ref,
+	};
+
+	struct Frame
+	{
+		vector<VType> locals;
+		vector<VType> stack;
+	};
+
+	// Operands of instructions with a fixed signature, "pops>pushes".
+	// I: int, F: float, J: long, D: double, A: reference, N: null
+	const char* GetFixedSignature(u16 op)
+	{
+		static const char* const Arith[] = { "II>I", "JJ>J", "FF>F", "DD>D" };
+		static const char* const Neg[] = { "I>I", "J>J", "F>F", "D>D" };
+
+		if (0x02 <= op && op <= 0x08) return ">I";
+		if (0x60 <= op && op <= 0x73) return Arith[(op - 0x60) % 4]; // add ~ rem
+		if (0x74 <= op && op <= 0x77) return Neg[op - 0x74];
+		if (0x78 <= op && op <= 0x7d) return (op & 1) ? "JI>J" : "II>I"; // shifts
+		if (0x7e <= op && op <= 0x83) return Arith[op & 1]; // and, or, xor
+		if (0x99 <= op && op <= 0x9e) return "I>";
+		if (0x9f <= op && op <= 0xa4) return "II>";
+
+		switch (op)
+		{
+		case 0x00: return ">";
+		case 0x01: return ">N";
+		case 0x09: case 0x0a: return ">J";
+		case 0x0b: case 0x0c: case 0x0d: return ">F";
+		case 0x0e: case 0x0f: return ">D";
+		case 0x10: case 0x11: return ">I";
+		case 0x2e: return "AI>I";
+		case 0x2f: return "AI>J";
+		case 0x30: return "AI>F";
+		case 0x31: return "AI>D";
+		case 0x32: return "AI>A";
+		case 0x33: case 0x34: case 0x35: return "AI>I";
+		case 0x4f: return "AII>";
+		case 0x50: return "AIJ>";
+		case 0x51: return "AIF>";
+		case 0x52: return "AID>";
+		case 0x53: return "AIA>";
+		case 0x54: case 0x55: case 0x56: return "AII>";
+		case 0x85: return "I>J";
+		case 0x86: return "I>F";
+		case 0x87: return "I>D";
+		case 0x88: return "J>I";
+		case 0x89: return "J>F";
+		case 0x8a: return "J>D";
+		case 0x8b: return "F>I";
+		case 0x8c: return "F>J";
+		case 0x8d: return "F>D";
+		case 0x8e: return "D>I";
+		case 0x8f: return "D>J";
+		case 0x90: return "D>F";
+		case 0x91: case 0x92: case 0x93: return "I>I";
+		case 0x94: return "JJ>I";
+		case 0x95: case 0x96: return "FF>I";
+		case 0x97: case 0x98: return "DD>I";
+		case 0xa5: case 0xa6: return "AA>";
+		case 0xa7: return ">";
+		case 0xaa: case 0xab: return "I>";
+		case 0xbc: return "I>A";
+		case 0xbe: return "A>I";
+		case 0xbf: return "A>";
+		case 0xc2: case 0xc3: return "A>";
+		case 0xc6: case 0xc7: return "A>";
+		default: return nullptr;
+		}
+	}
+
+	VType FromChar(char c)
+	{
+		switch (c)
+		{
+		case 'I': return VType::Int;
+		case 'F': return VType::Float;
+		case 'J': return VType::Long;
+		case 'D': return VType::Double;
+		case 'N': return VType::Null;
+		default: return VType::Ref;
+		}
+	}
+
+	VType FromType(const JType& t)
+	{
+		if (t.aryDim > 0 || t.type == PrimitiveType::Class)
+			return VType::Ref;
+		switch (t.type)
+		{
+		case PrimitiveType::Float: return VType::Float;
+		case PrimitiveType::Long: return VType::Long;
+		case PrimitiveType::Double: return VType::Double;
+		case PrimitiveType::Void: return VType::Top;
+		default: return VType::Int;
+		}
+	}
+
+	bool IsReference(VType t)
+	{
+		return t == VType::Ref || t == VType::Null;
+	}
+
+	bool IsWide(VType t)
+	{
+		return t == VType::Long || t == VType::Double;
+	}
+
+	class Verifier
+	{
+	public:
+		Verifier(VM& vm, const CFClassFile& cf, const CFMethod& method)
+			: m_vm(vm), m_cf(cf), m_method(method), m_code(*method.code)
+		{
+		}
+
+		bool Run()
+		{
+			auto decoded = Decode(m_code);
+			if (!decoded)
+				return Fail("malformed code");
+			m_insns = &decoded->insns;
+			const auto& insns = *m_insns;
+
+			// Exception table
+			vector<bool> boundary(m_code.code_length + 1, false);
+			for (auto& insn : insns)
+				boundary[insn.pc] = true;
+			boundary[m_code.code_length] = true;
+			for (auto& e : m_code.exception_table)
+			{
+				if (e.start_pc >= e.end_pc || e.end_pc > m_code.code_length || !boundary[e.start_pc] || !boundary[e.end_pc])
+					return Fail("invalid exception range");
+				if (e.catch_type != 0 && !IsConstant(e.catch_type, CFConstantPool::Type::Class))
+					return Fail("invalid exception class");
+			}
+
+			// Arguments
+			Frame entry;
+			entry.locals.assign(m_code.max_locals, VType::Top);
+			u32 slot = 0;
+			if (!(m_method.access_flags & 0x0008)) // ACC_STATIC
+			{
+				if (!SetLocal(entry, slot, VType::Ref))
+					return Fail("arguments exceed max_locals");
+				slot++;
+			}
+			for (auto& arg : m_method.signature.args)
+			{
+				VType t = FromType(arg);
+				if (!SetLocal(entry, slot, t))
+					return Fail("arguments exceed max_locals");
+				slot += IsWide(t) ? 2 : 1;
+			}
+
+			m_frames.assign(insns.size(), Frame());
+			m_visited.assign(insns.size(), false);
+			if (!Flow(0, entry))
+				return false;
+
+			while (!m_work.empty())
+			{
+				u32 k = m_work.back();
+				m_work.pop_back();
+				m_pc = insns[k].pc;
+
+				for (size_t i = 0; i < m_code.exception_table.size(); i++)
+				{
+					const auto& e = m_code.exception_table[i];
+					if (e.start_pc <= m_pc && m_pc < e.end_pc)
+					{
+						Frame handler = { m_frames[k].locals, { VType::Ref } };
+						if (!Flow(decoded->handlerInsn[i], handler))
+							return false;
+					}
+				}
+
+				Frame cur = m_frames[k];
+				if (!Execute(insns[k], cur))
+					return false;
+				if (cur.stack.size() > m_code.max_stack)
+					return Fail("operand stack overflow");
+
+				const u16 op = insns[k].op;
+				if (IsBranch(op) && !Flow(insns[k].a, cur))
+					return false;
+				if (op == 0xaa || op == 0xab) // tableswitch, lookupswitch
+				{
+					const SwitchTable& s = decoded->switches[insns[k].a];
+					if (!Flow(s.defaultTarget, cur))
+						return false;
+					for (u32 t : s.targets)
+					{
+						if (!Flow(t, cur))
+							return false;
+					}
+					continue;
+				}
+				if (op == 0xa7 || (0xac <= op && op <= 0xb1) || op == 0xbf) // goto, xreturn, athrow
+					continue;
+				if (!Flow(k + 1, cur))
+					return false;
+			}
+			return true;
+		}
+
+		const string& GetError() const { return m_error; }
+		u32 GetErrorPc() const { return m_pc; }
+
+	private:
+		bool Fail(const char* reason)
+		{
+			m_error = reason;
+			return false;
+		}
+
+		// Merges the frame into the frame before instruction k
+		bool Flow(u32 k, const Frame& f)
+		{
+			if (k >= m_insns->size())
+				return Fail("execution falls off the end of the code");
+			Frame& dst = m_frames[k];
+			if (!m_visited[k])
+			{
+				m_visited[k] = true;
+				dst = f;
+				m_work.push_back(k);
+				return true;
+			}
+
+			if (dst.stack.size() != f.stack.size())
+				return Fail("inconsistent stack depth");
+			bool changed = false;
+			for (size_t i = 0; i < f.stack.size(); i++)
+			{
+				VType t = f.stack[i];
+				if (dst.stack[i] == t)
+					continue;
+				if (!IsReference(dst.stack[i]) || !IsReference(t))
+					return Fail("inconsistent stack types");
+				if (dst.stack[i] != VType::Ref)
+				{
+					dst.stack[i] = VType::Ref;
+					changed = true;
+				}
+			}
+			for (size_t i = 0; i < f.locals.size(); i++)
+			{
+				VType t = f.locals[i];
+				if (dst.locals[i] == t || dst.locals[i] == VType::Top)
+					continue;
+				VType merged = (IsReference(dst.locals[i]) && IsReference(t)) ? VType::Ref : VType::Top;
+				if (dst.locals[i] != merged)
+				{
+					dst.locals[i] = merged;
+					changed = true;
+				}
+			}
+			if (changed)
+				m_work.push_back(k);
+			return true;
+		}
+
+		bool Pop(Frame& f, VType t)
+		{
+			if (IsWide(t))
+			{
+				if (f.stack.size() < 2 || f.stack.back() != static_cast<VType>(static_cast<u8>(t) + 1) || f.stack[f.stack.size() - 2] != t)
+					return Fail("operand type mismatch");
+				f.stack.resize(f.stack.size() - 2);
+				return true;
+			}
+			if (f.stack.empty())
+				return Fail("operand stack underflow");
+			VType top = f.stack.back();
+			if (t == VType::Ref ? !IsReference(top) : top != t)
+				return Fail("operand type mismatch");
+			f.stack.pop_back();
+			return true;
+		}
+
+		void Push(Frame& f, VType t)
+		{
+			f.stack.push_back(t);
+			if (IsWide(t))
+				f.stack.push_back(static_cast<VType>(static_cast<u8>(t) + 1));
+		}
+
+		bool GetLocal(const Frame& f, u32 index, VType t)
+		{
+			if (index + (IsWide(t) ? 2 : 1) > f.locals.size())
+				return Fail("local index out of range");
+			VType v = f.locals[index];
+			bool ok = (t == VType::Ref) ? IsReference(v) : v == t;
+			if (IsWide(t))
+				ok = ok && f.locals[index + 1] == static_cast<VType>(static_cast<u8>(t) + 1);
+			return ok ? true : Fail("local type mismatch");
+		}
+
+		bool SetLocal(Frame& f, u32 index, VType t)
+		{
+			const u32 width = IsWide(t) ? 2 : 1;
+			if (index + width > f.locals.size())
+				return Fail("local index out of range");
+			// Overwriting half of a long / double invalidates the other half
+			if (index > 0 && IsWide(f.locals[index - 1]))
+				f.locals[index - 1] = VType::Top;
+			if (index + width < f.locals.size() && (f.locals[index + width] == VType::Long2 || f.locals[index + width] == VType::Double2))
+				f.locals[index + width] = VType::Top;
+			f.locals[index] = t;
+			if (width == 2)
+				f.locals[index + 1] = static_cast<VType>(static_cast<u8>(t) + 1);
+			return true;
+		}
+
+		bool IsConstant(s32 index, CFConstantPool::Type type) const
+		{
+			return 0 < index && index < m_cf.constant_pool_count && m_cf.constant_pool[index].type == type;
+		}
+
+		const wstring& GetDescriptor(s32 ref) const
+		{
+			const auto& cp = m_cf.constant_pool;
+			u16 nat = cp[ref].val.f2.v2;
+			return m_vm.GetInternedString(cp[cp[nat].val.f2.v2].val.f5.idx);
+		}
+
+		// Checks that the top n slots and the n + x slots below can be moved as a group,
+		// neither boundary may split a long / double
+		bool CheckGroups(const Frame& f, u32 n, u32 x)
+		{
+			const auto& s = f.stack;
+			if (s.size() < n + x)
+				return Fail("operand stack underflow");
+			const auto Splits = [&](u32 depth)
+			{
+				return s[s.size() - depth] == VType::Long2 || s[s.size() - depth] == VType::Double2;
+			};
+			if (Splits(n) || Splits(n + x))
+				return Fail("operand splits a long or double");
+			return true;
+		}
+
+		// dup_x / dup2_x: the top n slots are copied below the top n + x slots
+		bool Dup(Frame& f, u32 n, u32 x)
+		{
+			if (!CheckGroups(f, n, x))
+				return false;
+			auto& s = f.stack;
+			vector<VType> top(s.end() - n, s.end());
+			s.insert(s.end() - n - x, top.begin(), top.end());
+			return true;
+		}
+
+		bool Execute(const Insn& insn, Frame& f)
+		{
+			const u16 op = insn.op;
+			if (const char* sig = GetFixedSignature(op))
+			{
+				const char* sep = strchr(sig, '>');
+				for (const char* p = sep; p-- != sig;)
+				{
+					if (!Pop(f, FromChar(*p)))
+						return false;
+				}
+				for (const char* p = sep + 1; *p; p++)
+					Push(f, FromChar(*p));
+				if (op == 0xbc && (insn.a < 4 || 11 < insn.a))
+					return Fail("invalid newarray type");
+				return true;
+			}
+
+			static const VType LocalTypes[] = { VType::Int, VType::Long, VType::Float, VType::Double, VType::Ref };
+			if ((0x15 <= op && op <= 0x19) || (0x1a <= op && op <= 0x2d)) // xload
+			{
+				VType t = LocalTypes[(op <= 0x19) ? op - 0x15 : (op - 0x1a) / 4];
+				if (!GetLocal(f, insn.a, t))
+					return false;
+				Push(f, t == VType::Ref ? f.locals[insn.a] : t);
+				return true;
+			}
+			if ((0x36 <= op && op <= 0x3a) || (0x3b <= op && op <= 0x4e)) // xstore
+			{
+				VType t = LocalTypes[(op <= 0x3a) ? op - 0x36 : (op - 0x3b) / 4];
+				VType v = f.stack.empty() ? VType::Top : f.stack.back();
+				if (!Pop(f, t))
+					return false;
+				return SetLocal(f, insn.a, t == VType::Ref ? v : t);
+			}
+
+			const auto& cp = m_cf.constant_pool;
+			switch (op)
+			{
+			case 0x12: // ldc
+			case 0x13: // ldc_w
+			{
+				if (insn.a <= 0 || insn.a >= m_cf.constant_pool_count)
+					return Fail("invalid constant pool index");
+				switch (cp[insn.a].type)
+				{
+				case CFConstantPool::Type::Integer: Push(f, VType::Int); return true;
+				case CFConstantPool::Type::Float: Push(f, VType::Float); return true;
+				case CFConstantPool::Type::String: Push(f, VType::Ref); return true;
+				case CFConstantPool::Type::Class:
+				case CFConstantPool::Type::MethodType:
+				case CFConstantPool::Type::MethodHandle:
+					return Fail("class and method constants are not supported");
+				default:
+					return Fail("invalid ldc constant");
+				}
+			}
+			case 0x14: // ldc2_w
+				if (IsConstant(insn.a, CFConstantPool::Type::Long))
+					Push(f, VType::Long);
+				else if (IsConstant(insn.a, CFConstantPool::Type::Double))
+					Push(f, VType::Double);
+				else
+					return Fail("invalid ldc2_w constant");
+				return true;
+			case 0x84: // iinc
+				if (!GetLocal(f, insn.a, VType::Int))
+					return false;
+				return true;
+			case 0x57: // pop
+			case 0x58: // pop2
+			{
+				u32 n = op - 0x56;
+				if (!CheckGroups(f, n, 0))
+					return false;
+				f.stack.resize(f.stack.size() - n);
+				return true;
+			}
+			case 0x59: return Dup(f, 1, 0); // dup
+			case 0x5a: return Dup(f, 1, 1); // dup_x1
+			case 0x5b: return Dup(f, 1, 2); // dup_x2
+			case 0x5c: return Dup(f, 2, 0); // dup2
+			case 0x5d: return Dup(f, 2, 1); // dup2_x1
+			case 0x5e: return Dup(f, 2, 2); // dup2_x2
+			case 0x5f: // swap
+				if (!CheckGroups(f, 1, 1))
+					return false;
+				swap(f.stack[f.stack.size() - 1], f.stack[f.stack.size() - 2]);
+				return true;
+			case 0xac: case 0xad: case 0xae: case 0xaf: case 0xb0: // xreturn
+			{
+				VType ret = FromType(m_method.signature.ret);
+				if (ret != LocalTypes[op - 0xac])
+					return Fail("return type mismatch");
+				return Pop(f, ret);
+			}
+			case 0xb1: // return
+				if (m_method.signature.ret.type != PrimitiveType::Void || m_method.signature.ret.aryDim > 0)
+					return Fail("return type mismatch");
+				return true;
+			case 0xb2: // getstatic
+			case 0xb3: // putstatic
+			case 0xb4: // getfield
+			case 0xb5: // putfield
+			{
+				if (!IsConstant(insn.a, CFConstantPool::Type::Fieldref))
+					return Fail("invalid field reference");
+				VType t = FromType(DecodeType(m_vm, GetDescriptor(insn.a)));
+				if (op == 0xb3 || op == 0xb5)
+				{
+					if (!Pop(f, t))
+						return false;
+				}
+				if ((op == 0xb4 || op == 0xb5) && !Pop(f, VType::Ref))
+					return false;
+				if (op == 0xb2 || op == 0xb4)
+					Push(f, t);
+				return true;
+			}
+			case 0xb6: // invokevirtual
+			case 0xb7: // invokespecial
+			case 0xb8: // invokestatic
+			case 0xb9: // invokeinterface
+			{
+				bool valid;
+				if (op == 0xb6)
+					valid = IsConstant(insn.a, CFConstantPool::Type::Methodref);
+				else if (op == 0xb9)
+					valid = IsConstant(insn.a, CFConstantPool::Type::InterfaceMethodref);
+				else
+					valid = IsConstant(insn.a, CFConstantPool::Type::Methodref) || IsConstant(insn.a, CFConstantPool::Type::InterfaceMethodref);
+				if (!valid)
+					return Fail("invalid method reference");
+
+				JSignature sig = DecodeSignature(m_vm, GetDescriptor(insn.a));
+				for (size_t i = sig.args.size(); i-- > 0;)
+				{
+					if (!Pop(f, FromType(sig.args[i])))
+						return false;
+				}
+				if (op != 0xb8 && !Pop(f, VType::Ref))
+					return false;
+				VType ret = FromType(sig.ret);
+				if (ret != VType::Top)
+					Push(f, ret);
+				return true;
+			}
+			case 0xbb: // new
+			case 0xbd: // anewarray
+			case 0xc0: // checkcast
+			case 0xc1: // instanceof
+				if (!IsConstant(insn.a, CFConstantPool::Type::Class))
+					return Fail("invalid class reference");
+				if (op != 0xbb && !Pop(f, (op == 0xbd) ? VType::Int : VType::Ref))
+					return false;
+				Push(f, (op == 0xc1) ? VType::Int : VType::Ref);
+				return true;
+			case 0xba: // invokedynamic
+			case 0xc5: // multianewarray
+				return Fail("instruction not supported by the interpreter");
+			case 0xa8: // jsr
+			case 0xa9: // ret
+			case 0xc9: // jsr_w
+				return Fail("jsr / ret are not supported");
+			default:
+				return Fail("unknown opcode");
+			}
+		}
+
+		VM& m_vm;
+		const CFClassFile& m_cf;
+		const CFMethod& m_method;
+		const CFCode& m_code;
+		const vector<Insn>* m_insns = nullptr;
+		vector<Frame> m_frames;
+		vector<bool> m_visited;
+		vector<u32> m_work;
+		string m_error;
+		u32 m_pc = 0;
+	};
+}
+
+bool jvm::detail::VerifyClass(VM& vm, CFClassFile& cf)
+{
+	for (size_t i = 0; i < cf.methods.size(); i++)
+	{
+		CFMethod& method = cf.methods[i];
+		if (!method.code)
+			continue;
+		Verifier verifier(vm, cf, method);
+		if (!verifier.Run())
+		{
+			cout << "Error: verification failed : method " << i << ", pc " << verifier.GetErrorPc() << " : " << verifier.GetError() << endl;
+			return false; // throw VerifyError
+		}
+		method.verified = true;
+	}
+	return true;
+}
+
+bool jvm::detail::CheckInsn(VM& vm, const CFClassFile& cf, const Insn& insn, u32 depth, u32 maxStack, u32 maxLocals)
+{
+	if (!CheckOperands(cf, insn, maxLocals))
+		return false;
+	u32 pop, push;
+	return !GetStackEffect(vm, cf, insn, pop, push) || (pop <= depth && depth - pop + push <= maxStack);
+}
+
+bool jvm::detail::CheckOperands(const CFClassFile& cf, const Insn& insn, u32 maxLocals)
+{
+	const u16 op = insn.op;
+	if ((0x12 <= op && op <= 0x14) || (0xb2 <= op && op <= 0xbb) || op == 0xbd || op == 0xc0 || op == 0xc1 || op == 0xc5)
+	{
+		// The entry kinds accepted by the verifier
+		using Type = CFConstantPool::Type;
+		if (insn.a <= 0 || insn.a >= cf.constant_pool_count)
+			return false;
+		const Type t = cf.constant_pool[insn.a].type;
+		switch (op)
+		{
+		case 0x12: case 0x13: // ldc, ldc_w
+			return t == Type::Integer || t == Type::Float || t == Type::String;
+		case 0x14: // ldc2_w
+			return t == Type::Long || t == Type::Double;
+		case 0xb2: case 0xb3: case 0xb4: case 0xb5: // getstatic ~ putfield
+			return t == Type::Fieldref;
+		case 0xb6: // invokevirtual
+			return t == Type::Methodref;
+		case 0xb7: case 0xb8: // invokespecial, invokestatic
+			return t == Type::Methodref || t == Type::InterfaceMethodref;
+		case 0xb9: // invokeinterface
+			return t == Type::InterfaceMethodref;
+		case 0xba: // invokedynamic, not supported
+			return false;
+		default: // new, anewarray, checkcast, instanceof, multianewarray
+			return t == Type::Class;
+		}
+	}
+
+	u32 type;
+	if (0x15 <= op && op <= 0x19)
+		type = op - 0x15;
+	else if (0x1a <= op && op <= 0x2d)
+		type = (op - 0x1a) / 4;
+	else if (0x36 <= op && op <= 0x3a)
+		type = op - 0x36;
+	else if (0x3b <= op && op <= 0x4e)
+		type = (op - 0x3b) / 4;
+	else if (op == 0x84) // iinc
+		type = 0;
+	else
+		return true;
+	u32 width = (type == 1 || type == 3) ? 2 : 1; // long, double
+	return insn.a >= 0 && static_cast<u32>(insn.a) + width <= maxLocals;
+}
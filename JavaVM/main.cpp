@@ -1,5 +1,12 @@
 #include "jvm.h"
 
+// Loads a sample class and runs its main method
+static void RunSample(jvm::VM& vm, const char* path, const std::wstring& clazz)
+{
+	vm.Load(path);
+	vm.Invoke(clazz, L"main", L"([Ljava/lang/String;)V");
+}
+
 int main(int argc, char** argv)
 {
 	jvm::VM vm;
@@ -7,5 +14,38 @@ int main(int argc, char** argv)
 	vm.Invoke(L"Main", L"main", L"([Ljava/lang/String;)V");
 	//vm.Load("sample/Fibonacci.class");
 	//vm.Invoke(L"Fibonacci", L"main", L"([Ljava/lang/String;)V");
+
+	// The other samples print through Main, classes they refer to are loaded from the class path
+	vm.AddClassPath("sample");
+	RunSample(vm, "sample/Loops.class", L"Loops");
+	RunSample(vm, "sample/Switches.class", L"Switches");
+	RunSample(vm, "sample/Numbers.class", L"Numbers");
+	RunSample(vm, "sample/Strings.class", L"Strings");
+	RunSample(vm, "sample/Shapes.class", L"Shapes");
+
+	// Code cache, the second run takes the decoded methods written by the first one
+	for (int i = 0; i < 2; i++)
+	{
+		jvm::VM cached;
+		cached.SetCodeCacheDirectory("sample");
+		cached.Load("sample/Main.class");
+		RunSample(cached, "sample/Loops.class", L"Loops");
+		cached.SaveCodeCache();
+	}
+
+	// Heap snapshot, the restored VM prints the static state of Heap without running Heap.main
+	{
+		jvm::VM saved;
+		saved.Load("sample/Main.class");
+		RunSample(saved, "sample/Heap.class", L"Heap");
+		saved.SaveHeapSnapshot("sample/Heap.snapshot");
+	}
+	{
+		jvm::VM restored;
+		restored.Load("sample/Main.class");
+		restored.Load("sample/Heap.class");
+		if (restored.RestoreHeapSnapshot("sample/Heap.snapshot"))
+			restored.Invoke(L"Heap", L"check", L"()V");
+	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,37 @@
+
+class Heap
+{
+	static int[] counts;
+	static String name;
+	static Heap self;
+	int value;
+
+	public static void main(String[] args)
+	{
+		counts = new int[] { 1, 2, 3 };
+		name = "snap".concat("shot");
+		self = new Heap();
+		self.value = 42;
+		check();
+	}
+
+	// Prints the static state, also called after the heap snapshot is restored
+	public static void check()
+	{
+		int s = 0;
+		for (int i = 0; i < counts.length; i++)
+			s += counts[i];
+		Main.output(s);
+		Main.output(name);
+		Main.output(self.value);
+		Main.output(name.intern() == "snapshot" ? 1 : 0);
+	}
+}
+
+/*
+Expected output, printed again by check after main.cpp restores the heap snapshot:
+6
+snapshot
+42
+1
+*/
@@ -0,0 +1,85 @@
+
+class Loops
+{
+	public static void main(String[] args)
+	{
+		int[] a = new int[100];
+		for (int i = 0; i < a.length; i++)
+			a[i] = 3;
+		Main.output(sum(a, a.length));
+
+		int[] b = new int[100];
+		for (int i = 0; i < b.length; i++)
+			b[i] = i;
+		int[] c = new int[100];
+		for (int i = 0; i < c.length; i++)
+			c[i] = a[i] + b[i];
+		int[] d = new int[100];
+		for (int i = 0; i < d.length; i++)
+			d[i] = c[i];
+		Main.output(d[99]);
+
+		// The first hit, a miss, and a hit before the bound passes the array length
+		Main.output(find(c, 100, 60));
+		Main.output(find(c, 100, -7));
+		Main.output(find(c, 1000, 102));
+
+		// Loops that run no iteration touch neither the null array nor the negative index
+		Main.output(sum(null, 0));
+		Main.output(sumRange(a, -3, -5));
+		Main.output(sumRange(a, 10, 20));
+
+		// Bounds checks are removed when the arrays are long enough for the bound
+		scale(c, b, 100);
+		Main.output(c[10]);
+		scale(c, b, 10);
+		Main.output(c[9] + c[10]);
+		scale(null, null, 0);
+	}
+
+	static int sum(int[] a, int n)
+	{
+		int s = 0;
+		for (int i = 0; i < n; i++)
+			s += a[i];
+		return s;
+	}
+
+	static int sumRange(int[] a, int from, int to)
+	{
+		int s = 0;
+		for (int i = from; i < to; i++)
+			s += a[i];
+		return s;
+	}
+
+	static int find(int[] a, int n, int v)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			if (a[i] == v)
+				return i;
+		}
+		return -1;
+	}
+
+	static void scale(int[] a, int[] b, int n)
+	{
+		for (int i = 0; i < n; i++)
+			a[i] = a[i] * b[i] + i;
+	}
+}
+
+/*
+Expected output:
+300
+102
+57
+-1
+99
+0
+0
+30
+140
+1202
+*/
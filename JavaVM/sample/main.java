@@ -54,4 +54,6 @@ class Main
 	static int local_ = 1234567890;
 
 	public static native void output(int val);
+	public static native void output(long val);
+	public static native void output(String val);
 }
@@ -0,0 +1,63 @@
+
+class Numbers
+{
+	public static void main(String[] args)
+	{
+		long f = 1;
+		for (int i = 1; i <= 20; i++)
+			f *= i;
+		Main.output(f);
+		Main.output(f / 1000003 % 1000);
+		Main.output(f >>> 40);
+		Main.output(-f >> 3);
+		long max = Long.MAX_VALUE;
+		Main.output(max + 1);
+		Main.output(f < max ? 1 : 0);
+
+		int min = Integer.MIN_VALUE;
+		Main.output(min / -1);
+		Main.output(min % -1);
+
+		float x = 1.5f;
+		float y = x * x - 0.25f;
+		Main.output((int) (y * 1000));
+		double third = 1.0 / 3;
+		Main.output((long) (third * 1e15));
+		Main.output((int) (third * 1e30));
+		Main.output((long) (-third * 1e300));
+
+		// NaN converts to 0 and compares false
+		float zero = 0;
+		float nan = zero / zero;
+		Main.output((int) nan);
+		Main.output(nan < 1 ? 1 : 0);
+		Main.output(nan > 1 ? 1 : 0);
+		Main.output(nan != nan ? 1 : 0);
+
+		double sum = 0;
+		for (int i = 1; i <= 10; i++)
+			sum += 1.0 / i;
+		Main.output((long) (sum * 1000000));
+	}
+}
+
+/*
+Expected output:
+2432902008176640000
+492
+2212711
+-304112751022080000
+-9223372036854775808
+1
+-2147483648
+0
+2000
+333333333333333
+2147483647
+-9223372036854775808
+0
+0
+0
+1
+2928968
+*/
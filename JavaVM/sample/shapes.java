@@ -0,0 +1,73 @@
+
+interface Shape
+{
+	int area();
+}
+
+class Square implements Shape
+{
+	int side;
+
+	Square(int side)
+	{
+		this.side = side;
+	}
+
+	public int area()
+	{
+		return side * side;
+	}
+}
+
+class Rect extends Square
+{
+	int height;
+
+	Rect(int width, int height)
+	{
+		super(width);
+		this.height = height;
+	}
+
+	public int area()
+	{
+		return side * height;
+	}
+}
+
+class Cube extends Square
+{
+	Cube(int side)
+	{
+		super(side);
+	}
+
+	public int area()
+	{
+		return 6 * super.area();
+	}
+}
+
+class Shapes
+{
+	public static void main(String[] args)
+	{
+		Shape[] shapes = new Shape[3];
+		shapes[0] = new Square(3);
+		shapes[1] = new Rect(2, 5);
+		shapes[2] = new Cube(2);
+		int total = 0;
+		for (int i = 0; i < shapes.length; i++)
+			total += shapes[i].area();
+		Main.output(total);
+
+		Square sq = new Rect(2, 3);
+		Main.output(sq.area());
+	}
+}
+
+/*
+Expected output:
+43
+6
+*/
@@ -0,0 +1,51 @@
+
+class Strings
+{
+	public static void main(String[] args)
+	{
+		String hello = "Hello";
+		String world = "World";
+		Main.output(hello);
+		Main.output(hello.length());
+		Main.output(hello.charAt(1));
+
+		String joined = hello.concat(", ").concat(world);
+		String literal = "Hello, World";
+		Main.output(joined);
+		Main.output(joined.equals(literal) ? 1 : 0);
+		Main.output(joined == literal ? 1 : 0);
+		Main.output(joined.intern() == literal ? 1 : 0);
+		Main.output(joined.substring(7));
+		Main.output(joined.substring(7) == world ? 1 : 0);
+		Main.output(joined.substring(0, 5).equals(hello) ? 1 : 0);
+		Main.output(joined.indexOf('W'));
+		Main.output(literal.hashCode());
+		Main.output("".isEmpty() ? 1 : 0);
+
+		// Characters outside Latin-1
+		String kanji = "\u65e5\u672c\u8a9e";
+		Main.output(kanji.length());
+		Main.output(kanji.charAt(0));
+		Main.output(kanji.concat(hello).hashCode());
+	}
+}
+
+/*
+Expected output:
+Hello
+5
+101
+Hello, World
+1
+0
+1
+World
+0
+1
+7
+-505841268
+1
+3
+26085
+185861499
+*/
@@ -0,0 +1,84 @@
+
+class Switches
+{
+	public static void main(String[] args)
+	{
+		int t = 0;
+		for (int i = -1; i < 6; i++)
+			t = t * 10 + dense(i);
+		Main.output(t);
+
+		Main.output(sparse(0) + sparse(1) + sparse(100) + sparse(10000));
+		Main.output(spread(5) + spread(11) + spread(6));
+
+		int h = 0;
+		int[] keys = { -5, 3, 17, 250, 999, 4096, 70000, 123456, 8 };
+		for (int i = 0; i < keys.length; i++)
+			h = h * 3 + hashed(keys[i]);
+		Main.output(h);
+	}
+
+	// tableswitch
+	static int dense(int v)
+	{
+		switch (v)
+		{
+		case 0: return 1;
+		case 1: return 2;
+		case 2: return 3;
+		case 4: return 5;
+		default: return 0;
+		}
+	}
+
+	// lookupswitch of a few keys, searched
+	static int sparse(int v)
+	{
+		switch (v)
+		{
+		case 1: return 10;
+		case 10: return 20;
+		case 100: return 30;
+		case 1000: return 40;
+		case 10000: return 50;
+		default: return -1;
+		}
+	}
+
+	// lookupswitch with keys close enough for a table
+	static int spread(int v)
+	{
+		switch (v)
+		{
+		case 0: return 100;
+		case 5: return 200;
+		case 11: return 300;
+		default: return 0;
+		}
+	}
+
+	// lookupswitch of many sparse keys, hashed
+	static int hashed(int v)
+	{
+		switch (v)
+		{
+		case -5: return 1;
+		case 3: return 2;
+		case 17: return 1;
+		case 250: return 2;
+		case 999: return 1;
+		case 4096: return 2;
+		case 70000: return 1;
+		case 123456: return 2;
+		default: return 0;
+		}
+	}
+}
+
+/*
+Expected output:
+123050
+89
+500
+12300
+*/
@@ -0,0 +1,32 @@
+#include "jvm.h"
+#include <fstream>
+#include <iostream>
+
+// Ahead-of-time compiler.
+// Translates the methods of the class files to C++, to be built into a native image:
+//   jvm_aot out.cpp Main.class ...
+//   cl /LD /O2 /I JavaVM out.cpp   or   g++ -shared -fPIC -O2 -I JavaVM out.cpp -o out.so
+// Class files are loaded in the order given, superclasses first.
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::cout << "Usage: jvm_aot <output.cpp> <class file>..." << std::endl;
+		return 1;
+	}
+
+	jvm::VM vm;
+	for (int i = 2; i < argc; i++)
+		vm.Load(argv[i]);
+
+	std::ofstream ofs(argv[1]);
+	if (!ofs)
+	{
+		std::cout << "Error: cannot create " << argv[1] << std::endl;
+		return 1;
+	}
+	jvm::u32 n = vm.WriteNativeImageSource(ofs);
+	std::cout << n << " methods compiled" << std::endl;
+	return 0;
+}